@@ -0,0 +1,344 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include <linux/can.h>
+
+#include "canopentool.h"
+#include "canopen.h"
+
+/*
+ * Batch mode runs a list of operations on one client. Each node has
+ * its own SDO channel, so operations on different nodes are in flight at
+ * the same time while those on one node keep their order. An NMT command
+ * waits for all operations before it and holds back all after it.
+ *
+ * One line of output per operation, in input order:
+ *   line ok [value]    expedited values as 0x..., others as hex: bytes
+ *   line abort code
+ *   line timeout
+ *   line error         an NMT command that could not be sent
+ */
+
+typedef enum { BATCH_READ, BATCH_WRITE, BATCH_NMT } batch_command_t;
+
+typedef struct {
+    int line;
+    batch_command_t command;
+    uint8_t node_id;
+    uint16_t index;
+    uint8_t subindex;
+    uint8_t data[4];
+    size_t size;
+    bool size_indicated;
+    nmt_command_specifier_t nmt;
+
+    /* result, kept until the lines before it are printed */
+    bool done;
+    char* output;
+} batch_operation_t;
+
+static batch_operation_t* operations;
+static int operation_count;
+static int next_operation;   /* to be started */
+static int next_output;      /* to be printed */
+static int in_flight;
+static bool failed;
+
+static evloop_t* loop;
+static canopen_client_t* client;
+
+static void syntax_error(int line, const char* message) {
+    fprintf(stderr, "line %d: %s\n", line, message);
+    exit(EXIT_FAILURE);
+}
+
+static long parse_number(int line, char* str, long min, long max, const char* what) {
+    char* end;
+    long value;
+
+    if (str == NULL) {
+        syntax_error(line, what);
+    }
+    errno = 0;
+    value = strtol(str, &end, 0);
+    if (errno != 0 || *end != '\0' || value < min || value > max) {
+        syntax_error(line, what);
+    }
+    return value;
+}
+
+static size_t parse_type(int line, char* str) {
+    static const struct {
+        const char* name;
+        size_t size;
+    } types[] = {
+        { "U32", 4 }, { "I32", 4 }, { "U24", 3 }, { "I24", 3 },
+        { "U16", 2 }, { "I16", 2 }, { "U8", 1 }, { "I8", 1 }
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (!strcasecmp(str, types[i].name)) {
+            return types[i].size;
+        }
+    }
+    syntax_error(line, "illegal data type");
+    return 0;
+}
+
+static nmt_command_specifier_t parse_nmt(int line, char* str) {
+    static const struct {
+        const char* name;
+        nmt_command_specifier_t command_specifier;
+    } commands[] = {
+        { "start", NMT_START_REMOTE_NODE },
+        { "stop", NMT_STOP_REMOTE_NODE },
+        { "preop", NMT_ENTER_PREOPERATIONAL },
+        { "reset-node", NMT_RESET_NODE },
+        { "reset-comm", NMT_RESET_COMMUNICATION }
+    };
+    size_t i;
+
+    for (i = 0; str != NULL && i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (!strcasecmp(str, commands[i].name)) {
+            return commands[i].command_specifier;
+        }
+    }
+    syntax_error(line, "illegal nmt command");
+    return 0;
+}
+
+/*
+ *   read node-id index subindex
+ *   write node-id index subindex data [type]
+ *   nmt start|stop|preop|reset-comm|reset-node [node-id]
+ */
+static bool parse_operation(int line, char* text, batch_operation_t* operation) {
+    char* save;
+    char* word;
+    char* comment = strchr(text, '#');
+
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+    if ((word = strtok_r(text, " \t\r\n", &save)) == NULL) {
+        return false;
+    }
+
+    bzero(operation, sizeof(*operation));
+    operation->line = line;
+    if (!strcasecmp(word, "nmt")) {
+        operation->command = BATCH_NMT;
+        operation->nmt = parse_nmt(line, strtok_r(NULL, " \t\r\n", &save));
+        word = strtok_r(NULL, " \t\r\n", &save);
+        operation->node_id = word == NULL ? NMT_ANY_NODE
+                : parse_number(line, word, 0, 127, "illegal node id");
+    }
+    else if (!strcasecmp(word, "read") || !strcasecmp(word, "write")) {
+        operation->command = !strcasecmp(word, "read") ? BATCH_READ : BATCH_WRITE;
+        operation->node_id = parse_number(line, strtok_r(NULL, " \t\r\n", &save),
+                1, 127, "illegal node id");
+        operation->index = parse_number(line, strtok_r(NULL, " \t\r\n", &save),
+                0, 0xFFFF, "illegal CANopen index");
+        operation->subindex = parse_number(line, strtok_r(NULL, " \t\r\n", &save),
+                0, 0xFF, "illegal CANopen subindex");
+        if (operation->command == BATCH_WRITE) {
+            long data = parse_number(line, strtok_r(NULL, " \t\r\n", &save),
+                    INT32_MIN, UINT32_MAX, "illegal data");
+            operation->data[0] = data >> 0 & 0xFF;
+            operation->data[1] = data >> 8 & 0xFF;
+            operation->data[2] = data >> 16 & 0xFF;
+            operation->data[3] = data >> 24 & 0xFF;
+            word = strtok_r(NULL, " \t\r\n", &save);
+            operation->size = word == NULL ? 4 : parse_type(line, word);
+            operation->size_indicated = word != NULL;
+        }
+    }
+    else {
+        syntax_error(line, "unknown operation");
+    }
+    if (strtok_r(NULL, " \t\r\n", &save) != NULL) {
+        syntax_error(line, "too many arguments");
+    }
+    return true;
+}
+
+static void read_operations(char* path) {
+    FILE* file = path != NULL ? fopen(path, "r") : stdin;
+    char* text = NULL;
+    size_t length = 0;
+    int capacity = 0;
+    int line = 0;
+
+    if (file == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    while (getline(&text, &length, file) >= 0) {
+        if (operation_count == capacity) {
+            capacity = capacity * 2 + 256;
+            operations = realloc(operations, capacity * sizeof(batch_operation_t));
+            if (operations == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (parse_operation(++line, text, &operations[operation_count])) {
+            operation_count++;
+        }
+    }
+    free(text);
+    if (path != NULL) {
+        fclose(file);
+    }
+}
+
+static void print_outputs(void) {
+    while (next_output < operation_count && operations[next_output].done) {
+        batch_operation_t* operation = &operations[next_output++];
+        printf("%d %s\n", operation->line, operation->output);
+        free(operation->output);
+    }
+    fflush(stdout);
+}
+
+static void on_result(void* context, const sdo_result_t* result);
+
+/* start operations up to the next NMT command that still has to wait */
+static void start_operations(void) {
+    while (next_operation < operation_count) {
+        batch_operation_t* operation = &operations[next_operation];
+
+        if (operation->command == BATCH_NMT) {
+            if (in_flight > 0) {
+                break;
+            }
+            if (canopen_client_nmt(client, operation->nmt, &operation->node_id, 1)) {
+                operation->output = strdup("ok");
+            }
+            else {
+                operation->output = strdup("error");
+                failed = true;
+            }
+            operation->done = true;
+            next_operation++;
+            continue;
+        }
+
+        in_flight++;
+        next_operation++;
+        if (operation->command == BATCH_READ) {
+            canopen_client_upload(client, operation->node_id, operation->index,
+                    operation->subindex, on_result, operation);
+        }
+        else {
+            canopen_client_download(client, operation->node_id, operation->index,
+                    operation->subindex, operation->data, operation->size,
+                    operation->size_indicated, on_result, operation);
+        }
+    }
+    print_outputs();
+}
+
+static char* format_result(const sdo_result_t* result) {
+    char* output;
+    size_t i;
+
+    if (result->timed_out) {
+        failed = true;
+        return strdup("timeout");
+    }
+    if (result->abort_code != 0) {
+        failed = true;
+        if (asprintf(&output, "abort 0x%08X", result->abort_code) < 0) {
+            return NULL;
+        }
+        return output;
+    }
+    if (result->size == 0) {
+        return strdup("ok");
+    }
+    if (result->expedited) {
+        uint32_t value = 0;
+        for (i = 0; i < result->size; i++) {
+            value |= (uint32_t) result->data[i] << 8 * i;
+        }
+        if (asprintf(&output, "ok 0x%X", value) < 0) {
+            return NULL;
+        }
+        return output;
+    }
+    if ((output = malloc(7 + 2 * result->size + 1)) != NULL) {
+        strcpy(output, "ok hex:");
+        for (i = 0; i < result->size; i++) {
+            sprintf(output + 7 + 2 * i, "%02x", result->data[i]);
+        }
+    }
+    return output;
+}
+
+static void on_result(void* context, const sdo_result_t* result) {
+    batch_operation_t* operation = context;
+
+    if ((operation->output = format_result(result)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    operation->done = true;
+    in_flight--;
+    start_operations();
+}
+
+void batch(char* can_interface, char* path) {
+    int i;
+
+    read_operations(path);
+    for (i = 0; i < operation_count; i++) {
+        if (operations[i].command != BATCH_READ) {
+            ensure_user_is_root();
+            break;
+        }
+    }
+
+    loop = open_loop();
+    client = open_client(loop, can_interface);
+
+    start_operations();
+    while (next_output < operation_count) {
+        if (evloop_run_once(loop) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < 128; i++) {
+        sdo_channel_stats_t stats;
+        if (canopen_client_get_stats(client, i, &stats)) {
+            print_sdo_channel_stats(&stats);
+        }
+    }
+    canopen_client_close(client);
+    evloop_destroy(loop);
+    free(operations);
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
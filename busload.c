@@ -0,0 +1,399 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/can.h>
+#include <linux/can/error.h>
+#include <linux/can/netlink.h>
+
+#include "busload.h"
+
+/* CRC delimiter, ACK slot, ACK delimiter, end of frame and intermission */
+#define FRAME_TRAILER_BITS (1 + 1 + 1 + 7 + 3)
+
+#define CRC15_POLYNOMIAL 0x4599
+
+/*
+ * Bits of a frame as they go on the wire. While stuffing is on, a bit of
+ * opposite level follows every five bits of the same level, stuff bits
+ * included.
+ */
+typedef struct {
+    bool stuffing;
+    int level;
+    int run;
+    uint16_t crc;
+    bool data_phase;
+    unsigned int nominal_bits;
+    unsigned int data_bits;
+} bitstream_t;
+
+static void count_bit(bitstream_t* stream) {
+    if (stream->data_phase) {
+        stream->data_bits++;
+    }
+    else {
+        stream->nominal_bits++;
+    }
+}
+
+static void put_bit(bitstream_t* stream, int bit) {
+    bool crc_next = bit ^ (stream->crc >> 14 & 1);
+    stream->crc = (stream->crc << 1) & 0x7FFF;
+    if (crc_next) {
+        stream->crc ^= CRC15_POLYNOMIAL;
+    }
+
+    count_bit(stream);
+    if (!stream->stuffing) {
+        return;
+    }
+    if (bit == stream->level) {
+        stream->run++;
+    }
+    else {
+        stream->level = bit;
+        stream->run = 1;
+    }
+    if (stream->run == 5) {
+        count_bit(stream);
+        stream->level = !bit;
+        stream->run = 1;
+    }
+}
+
+static void put_bits(bitstream_t* stream, uint32_t value, int count) {
+    while (count-- > 0) {
+        put_bit(stream, value >> count & 1);
+    }
+}
+
+/* in CAN FD the bit after RTR, there RRS, already is FDF, no r1 follows */
+static void put_identifier(bitstream_t* stream, canid_t can_id, int rtr, bool fd) {
+    put_bit(stream, 0); /* start of frame */
+    if (can_id & CAN_EFF_FLAG) {
+        put_bits(stream, (can_id & CAN_EFF_MASK) >> 18, 11);
+        put_bit(stream, 1); /* SRR */
+        put_bit(stream, 1); /* IDE */
+        put_bits(stream, can_id & 0x3FFFF, 18);
+        put_bit(stream, rtr);
+        if (!fd) {
+            put_bit(stream, 0); /* r1 */
+        }
+    }
+    else {
+        put_bits(stream, can_id & CAN_SFF_MASK, 11);
+        put_bit(stream, rtr);
+        put_bit(stream, 0); /* IDE */
+    }
+}
+
+static uint8_t canfd_dlc(uint8_t len) {
+    static const uint8_t dlc[] = {
+        0, 1, 2, 3, 4, 5, 6, 7, 8,
+        9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 12,
+        13, 13, 13, 13, 13, 13, 13, 13
+    };
+    if (len <= 32) {
+        return dlc[len];
+    }
+    return len <= 48 ? 14 : 15;
+}
+
+static uint8_t canfd_len(uint8_t dlc) {
+    static const uint8_t len[] = {
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64
+    };
+    return len[dlc & 0xF];
+}
+
+void can_frame_bits(const struct canfd_frame* frame, unsigned int* nominal_bits,
+        unsigned int* data_bits) {
+    bitstream_t stream;
+    int i;
+
+    bzero(&stream, sizeof(stream));
+    stream.stuffing = true;
+    stream.level = -1;
+
+    if (!(frame->flags & CANFD_FDF)) {
+        int rtr = frame->can_id & CAN_RTR_FLAG ? 1 : 0;
+        uint8_t len = frame->len > CAN_MAX_DLEN ? CAN_MAX_DLEN : frame->len;
+
+        put_identifier(&stream, frame->can_id, rtr, false);
+        put_bit(&stream, 0); /* r0 */
+        put_bits(&stream, len, 4);
+        for (i = 0; i < len && !rtr; i++) {
+            put_bits(&stream, frame->data[i], 8);
+        }
+        put_bits(&stream, stream.crc, 15);
+    }
+    else {
+        uint8_t dlc = canfd_dlc(frame->len);
+        int crc_bits = dlc <= 10 ? 17 : 21;
+
+        /* no remote frames in CAN FD, the RTR position is RRS */
+        put_identifier(&stream, frame->can_id, 0, true);
+        put_bit(&stream, 1); /* FDF */
+        put_bit(&stream, 0); /* res */
+        put_bit(&stream, frame->flags & CANFD_BRS ? 1 : 0);
+        stream.data_phase = frame->flags & CANFD_BRS;
+        put_bit(&stream, frame->flags & CANFD_ESI ? 1 : 0);
+        put_bits(&stream, dlc, 4);
+        for (i = 0; i < canfd_len(dlc); i++) {
+            put_bits(&stream, i < frame->len ? frame->data[i] : 0, 8);
+        }
+
+        /*
+         * stuff count and CRC have a fixed stuff bit in front and after
+         * every fourth bit
+         */
+        stream.stuffing = false;
+        put_bits(&stream, 0, 4 + crc_bits + (4 + crc_bits + 3) / 4);
+        stream.data_phase = false;
+    }
+
+    *nominal_bits = stream.nominal_bits + FRAME_TRAILER_BITS;
+    *data_bits = stream.data_bits;
+}
+
+static uint64_t milliseconds(const struct timespec* ts) {
+    return (uint64_t) ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+}
+
+void busload_init(busload_t* busload) {
+    struct timespec now;
+
+    bzero(busload, sizeof(*busload));
+    busload->state = BUS_ERROR_ACTIVE;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    busload->started_ms = milliseconds(&now);
+}
+
+static busload_bucket_t* bucket_at(busload_t* busload, const struct timespec* timestamp) {
+    uint64_t number = milliseconds(timestamp) / BUSLOAD_BUCKET_MS;
+    busload_bucket_t* bucket = &busload->buckets[number % BUSLOAD_BUCKETS];
+
+    if (bucket->number != number) {
+        bzero(bucket, sizeof(*bucket));
+        bucket->number = number;
+    }
+    return bucket;
+}
+
+static void add_error_frame(busload_t* busload, const struct canfd_frame* frame,
+        busload_bucket_t* bucket) {
+    canid_t error_class = frame->can_id & CAN_ERR_MASK;
+
+    if (error_class & (CAN_ERR_PROT | CAN_ERR_BUSERROR | CAN_ERR_ACK)) {
+        busload->error_frames++;
+        bucket->error_frames++;
+    }
+    if (error_class & CAN_ERR_CRTL) {
+        uint8_t status = frame->data[1];
+        if (status & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE)) {
+            if (busload->state != BUS_ERROR_PASSIVE) {
+                busload->error_passive_events++;
+            }
+            busload->state = BUS_ERROR_PASSIVE;
+        }
+        else if (status & (CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING)) {
+            busload->state = BUS_ERROR_WARNING;
+        }
+        else if (status & CAN_ERR_CRTL_ACTIVE) {
+            busload->state = BUS_ERROR_ACTIVE;
+        }
+    }
+    if (error_class & CAN_ERR_BUSOFF) {
+        if (busload->state != BUS_OFF) {
+            busload->bus_off_events++;
+        }
+        busload->state = BUS_OFF;
+    }
+    if (error_class & CAN_ERR_RESTARTED) {
+        busload->state = BUS_ERROR_ACTIVE;
+    }
+    /* many drivers fill in the counters without setting CAN_ERR_CNT */
+    if ((error_class & CAN_ERR_CNT) || frame->data[6] != 0 || frame->data[7] != 0) {
+        busload->tx_errors = frame->data[6];
+        busload->rx_errors = frame->data[7];
+    }
+}
+
+void busload_add_frame(busload_t* busload, const struct canfd_frame* frame,
+        const struct timespec* timestamp, busload_class_t class) {
+    busload_bucket_t* bucket = bucket_at(busload, timestamp);
+    unsigned int nominal_bits, data_bits;
+
+    if (frame->can_id & CAN_ERR_FLAG) {
+        add_error_frame(busload, frame, bucket);
+        return;
+    }
+
+    can_frame_bits(frame, &nominal_bits, &data_bits);
+    bucket->frames[class]++;
+    bucket->nominal_bits[class] += nominal_bits;
+    bucket->data_bits[class] += data_bits;
+}
+
+void busload_window(const busload_t* busload, const struct timespec* now,
+        unsigned int window_ms, busload_window_t* window) {
+    uint64_t now_ms = milliseconds(now);
+    uint64_t first_ms;
+    uint64_t number;
+    double nominal_bits[BUSLOAD_CLASSES] = { 0 };
+    double data_bits[BUSLOAD_CLASSES] = { 0 };
+    double frames[BUSLOAD_CLASSES] = { 0 };
+    double error_frames = 0;
+    int class;
+
+    bzero(window, sizeof(*window));
+    if (window_ms > BUSLOAD_MAX_WINDOW_MS) {
+        window_ms = BUSLOAD_MAX_WINDOW_MS;
+    }
+    first_ms = now_ms > window_ms ? now_ms - window_ms : 0;
+    if (first_ms < busload->started_ms) {
+        first_ms = busload->started_ms;
+    }
+    window->seconds = now_ms > first_ms ? (now_ms - first_ms) / 1000.0 : 0.001;
+
+    for (number = first_ms / BUSLOAD_BUCKET_MS;
+            number <= now_ms / BUSLOAD_BUCKET_MS; number++) {
+        const busload_bucket_t* bucket = &busload->buckets[number % BUSLOAD_BUCKETS];
+        double weight = 1.0;
+
+        if (bucket->number != number) {
+            continue;
+        }
+        /* only the part of the oldest bucket inside the window counts */
+        if (number == first_ms / BUSLOAD_BUCKET_MS) {
+            weight = (double) ((number + 1) * BUSLOAD_BUCKET_MS - first_ms)
+                    / BUSLOAD_BUCKET_MS;
+        }
+        for (class = 0; class < BUSLOAD_CLASSES; class++) {
+            frames[class] += weight * bucket->frames[class];
+            nominal_bits[class] += weight * bucket->nominal_bits[class];
+            data_bits[class] += weight * bucket->data_bits[class];
+        }
+        error_frames += weight * bucket->error_frames;
+    }
+
+    window->total_load = busload->nominal_bitrate > 0 ? 0.0 : -1.0;
+    for (class = 0; class < BUSLOAD_CLASSES; class++) {
+        window->frames[class] = frames[class] + 0.5;
+        window->bits[class] = nominal_bits[class] + data_bits[class] + 0.5;
+        window->total_frames += window->frames[class];
+        window->total_bits += window->bits[class];
+
+        if (busload->nominal_bitrate > 0) {
+            uint32_t data_bitrate = busload->data_bitrate > 0
+                    ? busload->data_bitrate : busload->nominal_bitrate;
+            double busy = nominal_bits[class] / busload->nominal_bitrate
+                    + data_bits[class] / data_bitrate;
+            window->load[class] = busy / window->seconds;
+            window->total_load += window->load[class];
+        }
+        else {
+            window->load[class] = -1.0;
+        }
+    }
+    window->error_frames = error_frames + 0.5;
+}
+
+/*
+ * Ask rtnetlink for the bit timing of the interface, which is where
+ * "ip link set canX type can bitrate ..." puts it.
+ */
+bool busload_query_bitrate(const char* interface_name, uint32_t* nominal_bitrate,
+        uint32_t* data_bitrate) {
+    struct {
+        struct nlmsghdr header;
+        struct ifinfomsg info;
+    } request;
+    char response[8192];
+    unsigned int ifindex = if_nametoindex(interface_name);
+    bool found = false;
+    int fd;
+
+    *nominal_bitrate = 0;
+    *data_bitrate = 0;
+    if (ifindex == 0
+            || (fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        return false;
+    }
+
+    bzero(&request, sizeof(request));
+    request.header.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    request.header.nlmsg_type = RTM_GETLINK;
+    request.header.nlmsg_flags = NLM_F_REQUEST;
+    request.info.ifi_family = AF_UNSPEC;
+    request.info.ifi_index = ifindex;
+
+    if (send(fd, &request, request.header.nlmsg_len, 0) < 0) {
+        close(fd);
+        return false;
+    }
+    int length = recv(fd, response, sizeof(response), 0);
+    close(fd);
+
+    struct nlmsghdr* header = (struct nlmsghdr*) response;
+    if (length < 0 || !NLMSG_OK(header, (unsigned int) length)
+            || header->nlmsg_type != RTM_NEWLINK) {
+        return false;
+    }
+
+    struct rtattr* attribute = IFLA_RTA(NLMSG_DATA(header));
+    int attributes_length = IFLA_PAYLOAD(header);
+    for (; RTA_OK(attribute, attributes_length);
+            attribute = RTA_NEXT(attribute, attributes_length)) {
+        if (attribute->rta_type != IFLA_LINKINFO) {
+            continue;
+        }
+        struct rtattr* linkinfo = RTA_DATA(attribute);
+        int linkinfo_length = RTA_PAYLOAD(attribute);
+        for (; RTA_OK(linkinfo, linkinfo_length);
+                linkinfo = RTA_NEXT(linkinfo, linkinfo_length)) {
+            if (linkinfo->rta_type != IFLA_INFO_DATA) {
+                continue;
+            }
+            struct rtattr* data = RTA_DATA(linkinfo);
+            int data_length = RTA_PAYLOAD(linkinfo);
+            for (; RTA_OK(data, data_length); data = RTA_NEXT(data, data_length)) {
+                struct can_bittiming bittiming;
+                if (RTA_PAYLOAD(data) < sizeof(bittiming)) {
+                    continue;
+                }
+                memcpy(&bittiming, RTA_DATA(data), sizeof(bittiming));
+                if (data->rta_type == IFLA_CAN_BITTIMING) {
+                    *nominal_bitrate = bittiming.bitrate;
+                    found = bittiming.bitrate > 0;
+                }
+                else if (data->rta_type == IFLA_CAN_DATA_BITTIMING) {
+                    *data_bitrate = bittiming.bitrate;
+                }
+            }
+        }
+    }
+    return found;
+}
@@ -0,0 +1,107 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUSLOAD_H_
+#define BUSLOAD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/can.h>
+
+/*
+ * Received frames are accounted in buckets of BUSLOAD_BUCKET_MS by their
+ * receive time, so any window up to BUSLOAD_MAX_WINDOW_MS can be summed up.
+ */
+#define BUSLOAD_BUCKET_MS     50
+#define BUSLOAD_MAX_WINDOW_MS 60000
+#define BUSLOAD_BUCKETS       (BUSLOAD_MAX_WINDOW_MS / BUSLOAD_BUCKET_MS + 1)
+
+typedef enum {
+    BUSLOAD_NMT,
+    BUSLOAD_PDO,
+    BUSLOAD_SDO,
+    BUSLOAD_OTHER,
+    BUSLOAD_CLASSES
+} busload_class_t;
+
+typedef enum {
+    BUS_ERROR_ACTIVE,
+    BUS_ERROR_WARNING,
+    BUS_ERROR_PASSIVE,
+    BUS_OFF
+} bus_state_t;
+
+typedef struct {
+    uint64_t number; /* bucket number on CLOCK_MONOTONIC */
+    uint32_t frames[BUSLOAD_CLASSES];
+    uint64_t nominal_bits[BUSLOAD_CLASSES];
+    uint64_t data_bits[BUSLOAD_CLASSES];
+    uint32_t error_frames;
+} busload_bucket_t;
+
+typedef struct {
+    uint32_t nominal_bitrate; /* 0 if unknown */
+    uint32_t data_bitrate;    /* CAN FD data phase, 0 if unknown */
+    uint64_t started_ms;      /* windows do not reach back further */
+    busload_bucket_t buckets[BUSLOAD_BUCKETS];
+
+    /* controller state, from error frames */
+    bus_state_t state;
+    uint8_t rx_errors;
+    uint8_t tx_errors;
+    unsigned long error_frames;
+    unsigned long error_passive_events;
+    unsigned long bus_off_events;
+} busload_t;
+
+/* sums over a window */
+typedef struct {
+    double seconds;
+    uint32_t frames[BUSLOAD_CLASSES];
+    uint64_t bits[BUSLOAD_CLASSES];
+    double load[BUSLOAD_CLASSES]; /* share of bus time, -1 if bitrate unknown */
+    uint32_t total_frames;
+    uint64_t total_bits;
+    double total_load;
+    uint32_t error_frames;
+} busload_window_t;
+
+/*
+ * Length on the wire from start of frame through the intermission,
+ * including stuff bits. Bits of a CAN FD frame sent with bit rate
+ * switching between BRS and the CRC delimiter go to data_bits, all others
+ * to nominal_bits.
+ */
+void can_frame_bits(const struct canfd_frame* frame, unsigned int* nominal_bits,
+        unsigned int* data_bits);
+
+void busload_init(busload_t* busload);
+
+/* bit rates as configured on the interface, false if they are unknown */
+bool busload_query_bitrate(const char* interface_name, uint32_t* nominal_bitrate,
+        uint32_t* data_bitrate);
+
+/*
+ * Account a received frame. Error frames (CAN_ERR_FLAG) update the
+ * controller state instead of the load.
+ */
+void busload_add_frame(busload_t* busload, const struct canfd_frame* frame,
+        const struct timespec* timestamp, busload_class_t class);
+
+void busload_window(const busload_t* busload, const struct timespec* now,
+        unsigned int window_ms, busload_window_t* window);
+
+#endif /* BUSLOAD_H_ */
@@ -0,0 +1,346 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "canopen.h"
+#include "canopen_frame.h"
+
+/*
+ * An upload that goes to the cache when it succeeds, unless a download to
+ * the object was started meanwhile, or a download that invalidates the
+ * object when it ends.
+ */
+typedef struct cached_transfer {
+    canopen_client_t* client;
+    uint8_t node_id;
+    uint16_t index;
+    uint8_t subindex;
+    unsigned long generation;
+    bool discarded;
+    sdo_callback_t callback;
+    void* context;
+    struct cached_transfer* next;
+} cached_transfer_t;
+
+struct canopen_client {
+    evloop_t* loop;
+    transport_t* can;
+    bool fd;
+    sdo_channel_t* channels[128];
+    sdo_cache_t* cache;
+    cached_transfer_t* cached_uploads; /* in progress */
+    cached_transfer_t* cached_downloads;
+};
+
+bool nmt_send(transport_t* can, nmt_command_specifier_t command_specifier,
+        const uint8_t* node_ids, int node_count) {
+    struct canfd_frame frame;
+    int i;
+
+    for (i = 0; i < node_count; i++) {
+        nmt_encode(&frame, command_specifier, node_ids[i]);
+        transport_queue(can, &frame);
+    }
+    return transport_flush(can);
+}
+
+static bool is_reset(uint8_t command_specifier) {
+    return command_specifier == NMT_RESET_NODE
+            || command_specifier == NMT_RESET_COMMUNICATION;
+}
+
+/* boot-up messages and resets, seen only while the cache is enabled */
+static void handle_network_management(canopen_client_t* client,
+        const struct canfd_frame* frame) {
+    if (is_bootup(frame)) {
+        sdo_cache_invalidate_node(client->cache, heartbeat_node_id(frame));
+    }
+    else if (is_nmt_command(frame) && is_reset(nmt_command_specifier(frame))) {
+        sdo_cache_invalidate_node(client->cache, nmt_node_id(frame));
+    }
+}
+
+/* a bus that fails is not read anymore, its transfers time out */
+static void on_can_readable(void* context) {
+    canopen_client_t* client = context;
+    struct canfd_frame frames[TRANSPORT_BATCH_SIZE];
+    int count = transport_read_batch(client->can, frames, NULL, TRANSPORT_BATCH_SIZE);
+    int i;
+
+    if (count < 0) {
+        evloop_remove_fd(client->loop, transport_fileno(client->can));
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        uint8_t node_id = sdo_response_node_id(&frames[i]);
+        if (node_id != 0 && client->channels[node_id] != NULL) {
+            sdo_channel_handle_frame(client->channels[node_id], &frames[i]);
+        }
+        else if (node_id == 0 && client->cache != NULL) {
+            handle_network_management(client, &frames[i]);
+        }
+    }
+}
+
+canopen_client_t* canopen_client_open(evloop_t* loop, char* bus_name, int flags) {
+    static const struct can_filter sdo_responses = SDO_RESPONSE_FILTER;
+    canopen_client_t* client = calloc(1, sizeof(canopen_client_t));
+
+    if (client == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return NULL;
+    }
+    client->loop = loop;
+    client->fd = (flags & CANOPEN_CLIENT_FD) != 0;
+    if ((client->can = transport_open(bus_name)) == NULL) {
+        free(client);
+        return NULL;
+    }
+    if (client->fd && !transport_enable_fd(client->can)) {
+        fprintf(stderr, "%s does not support CAN FD\n", bus_name);
+        transport_close(client->can);
+        free(client);
+        return NULL;
+    }
+    if (!transport_set_filters(client->can, &sdo_responses, 1)
+            || !evloop_add_fd(loop, transport_fileno(client->can),
+                    on_can_readable, client)) {
+        transport_close(client->can);
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+void canopen_client_close(canopen_client_t* client) {
+    int i;
+
+    for (i = 0; i < 128; i++) {
+        if (client->channels[i] != NULL) {
+            sdo_channel_destroy(client->channels[i]);
+        }
+    }
+    while (client->cached_uploads != NULL) {
+        cached_transfer_t* upload = client->cached_uploads;
+        client->cached_uploads = upload->next;
+        free(upload);
+    }
+    while (client->cached_downloads != NULL) {
+        cached_transfer_t* download = client->cached_downloads;
+        client->cached_downloads = download->next;
+        free(download);
+    }
+    if (client->cache != NULL) {
+        sdo_cache_destroy(client->cache);
+    }
+    evloop_remove_fd(client->loop, transport_fileno(client->can));
+    transport_close(client->can);
+    free(client);
+}
+
+bool canopen_client_enable_cache(canopen_client_t* client) {
+    static const struct can_filter filters[] = {
+        SDO_RESPONSE_FILTER,
+        { COB_HEARTBEAT, 0x780 | CAN_EFF_FLAG | CAN_RTR_FLAG },
+        { COB_NMT, CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG }
+    };
+
+    if (client->cache != NULL) {
+        return true;
+    }
+    if ((client->cache = sdo_cache_create()) == NULL) {
+        return false;
+    }
+    if (!transport_set_filters(client->can, filters,
+            sizeof(filters) / sizeof(filters[0]))) {
+        sdo_cache_destroy(client->cache);
+        client->cache = NULL;
+        return false;
+    }
+    return true;
+}
+
+sdo_cache_t* canopen_client_cache(canopen_client_t* client) {
+    return client->cache;
+}
+
+transport_t* canopen_client_transport(canopen_client_t* client) {
+    return client->can;
+}
+
+static bool is_node_id(uint8_t node_id) {
+    return node_id >= 1 && node_id <= 127;
+}
+
+sdo_channel_t* canopen_client_channel(canopen_client_t* client, uint8_t node_id) {
+    if (!is_node_id(node_id)) {
+        return NULL;
+    }
+    if (client->channels[node_id] == NULL) {
+        client->channels[node_id] =
+                sdo_channel_create(client->loop, client->can, node_id, client->fd);
+    }
+    return client->channels[node_id];
+}
+
+/* the transfer could not be started, for lack of memory or a node to talk to */
+static void fail_transfer(uint8_t node_id, sdo_callback_t callback, void* context) {
+    sdo_result_t result;
+    bzero(&result, sizeof(result));
+    result.abort_code = is_node_id(node_id) ? SDO_ERROR_OUT_OF_MEMORY
+            : SDO_ERROR_GENERAL_ERROR;
+    callback(context, &result);
+}
+
+static cached_transfer_t* start_cached_transfer(canopen_client_t* client,
+        cached_transfer_t** list, uint8_t node_id, uint16_t index, uint8_t subindex,
+        sdo_callback_t callback, void* context) {
+    cached_transfer_t* transfer = malloc(sizeof(cached_transfer_t));
+
+    if (transfer == NULL) {
+        return NULL;
+    }
+    transfer->client = client;
+    transfer->node_id = node_id;
+    transfer->index = index;
+    transfer->subindex = subindex;
+    transfer->generation = sdo_cache_generation(client->cache, node_id);
+    transfer->discarded = false;
+    transfer->callback = callback;
+    transfer->context = context;
+    transfer->next = *list;
+    *list = transfer;
+    return transfer;
+}
+
+static void unlink_cached_transfer(cached_transfer_t** list, cached_transfer_t* transfer) {
+    cached_transfer_t** link;
+
+    for (link = list; *link != transfer; link = &(*link)->next) {
+    }
+    *link = transfer->next;
+}
+
+static void on_cached_upload_result(void* context, const sdo_result_t* result) {
+    cached_transfer_t* upload = context;
+    canopen_client_t* client = upload->client;
+
+    unlink_cached_transfer(&client->cached_uploads, upload);
+    if (!upload->discarded && !result->timed_out && result->abort_code == 0) {
+        sdo_cache_store(client->cache, upload->node_id, upload->index,
+                upload->subindex, upload->generation, result);
+    }
+    upload->callback(upload->context, result);
+    free(upload);
+}
+
+void canopen_client_upload(canopen_client_t* client, uint8_t node_id,
+        uint16_t index, uint8_t subindex, sdo_callback_t callback, void* context) {
+    sdo_channel_t* channel = canopen_client_channel(client, node_id);
+    cached_transfer_t* upload;
+    sdo_result_t result;
+
+    if (channel == NULL) {
+        fail_transfer(node_id, callback, context);
+        return;
+    }
+    if (client->cache == NULL || sdo_cache_max_age(client->cache, index, subindex) == 0) {
+        sdo_channel_upload(channel, index, subindex, callback, context);
+        return;
+    }
+    if (sdo_cache_lookup(client->cache, node_id, index, subindex, &result)) {
+        callback(context, &result);
+        return;
+    }
+    if ((upload = start_cached_transfer(client, &client->cached_uploads, node_id,
+            index, subindex, callback, context)) == NULL) {
+        sdo_channel_upload(channel, index, subindex, callback, context);
+        return;
+    }
+    sdo_channel_upload(channel, index, subindex, on_cached_upload_result, upload);
+}
+
+/* a download may have changed the value whether or not it succeeded */
+static void on_cached_download_result(void* context, const sdo_result_t* result) {
+    cached_transfer_t* download = context;
+    canopen_client_t* client = download->client;
+
+    unlink_cached_transfer(&client->cached_downloads, download);
+    sdo_cache_invalidate_object(client->cache, download->node_id, download->index,
+            download->subindex);
+    download->callback(download->context, result);
+    free(download);
+}
+
+void canopen_client_download(canopen_client_t* client, uint8_t node_id,
+        uint16_t index, uint8_t subindex, const uint8_t* data, size_t size,
+        bool size_indicated, sdo_callback_t callback, void* context) {
+    sdo_channel_t* channel = canopen_client_channel(client, node_id);
+    cached_transfer_t* transfer;
+
+    if (channel == NULL) {
+        fail_transfer(node_id, callback, context);
+        return;
+    }
+    if (client->cache == NULL) {
+        sdo_channel_download(channel, index, subindex, data, size, size_indicated,
+                callback, context);
+        return;
+    }
+
+    /* uploads started before may read the old value, but must not keep it */
+    for (transfer = client->cached_uploads; transfer != NULL; transfer = transfer->next) {
+        if (transfer->node_id == node_id && transfer->index == index
+                && transfer->subindex == subindex) {
+            transfer->discarded = true;
+        }
+    }
+    sdo_cache_invalidate_object(client->cache, node_id, index, subindex);
+    if ((transfer = start_cached_transfer(client, &client->cached_downloads, node_id,
+            index, subindex, callback, context)) == NULL) {
+        fail_transfer(node_id, callback, context);
+        return;
+    }
+    sdo_channel_download(channel, index, subindex, data, size, size_indicated,
+            on_cached_download_result, transfer);
+}
+
+/* the client does not receive its own commands */
+bool canopen_client_nmt(canopen_client_t* client,
+        nmt_command_specifier_t command_specifier, const uint8_t* node_ids,
+        int node_count) {
+    int i;
+
+    if (client->cache != NULL && is_reset(command_specifier)) {
+        for (i = 0; i < node_count; i++) {
+            sdo_cache_invalidate_node(client->cache, node_ids[i]);
+        }
+    }
+    return nmt_send(client->can, command_specifier, node_ids, node_count);
+}
+
+bool canopen_client_get_stats(const canopen_client_t* client, uint8_t node_id,
+        sdo_channel_stats_t* stats) {
+    if (!is_node_id(node_id) || client->channels[node_id] == NULL) {
+        return false;
+    }
+    sdo_channel_get_stats(client->channels[node_id], stats);
+    return true;
+}
@@ -0,0 +1,109 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANOPEN_H_
+#define CANOPEN_H_
+
+/*
+ * libcanopentool: asynchronous CANopen master functions for use inside
+ * other programs. All state lives in the objects passed in, nothing ends
+ * the process, and failures are returned or handed to callbacks, so any
+ * number of clients can run in one process, each thread with its own
+ * event loop.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "transport.h"
+#include "evloop.h"
+#include "sdo.h"
+#include "sdo_cache.h"
+
+typedef enum {
+    NMT_START_REMOTE_NODE = 1,
+    NMT_STOP_REMOTE_NODE = 2,
+    NMT_ENTER_PREOPERATIONAL = 128,
+    NMT_RESET_NODE = 129,
+    NMT_RESET_COMMUNICATION = 130
+} nmt_command_specifier_t;
+#define NMT_ANY_NODE (0)
+
+/* send one NMT command per node, false if they could not all be sent */
+bool nmt_send(transport_t* can, nmt_command_specifier_t command_specifier,
+        const uint8_t* node_ids, int node_count);
+
+/* run SDO transfers over CAN FD */
+#define CANOPEN_CLIENT_FD (1 << 0)
+
+/*
+ * SDO and NMT client on one bus. It reads the bus from the event loop it
+ * was opened on and hands each SDO response to the channel of its node,
+ * which is created with the first transfer to that node. Transfers to
+ * different nodes run at the same time, transfers to the same node one
+ * after the other in the order they were started.
+ */
+typedef struct canopen_client canopen_client_t;
+
+/*
+ * Open a bus as transport_open() does. Returns NULL if it cannot be
+ * opened, or does not support CAN FD if CANOPEN_CLIENT_FD is given.
+ */
+canopen_client_t* canopen_client_open(evloop_t* loop, char* bus_name, int flags);
+
+/* transfers in progress are dropped without calling their callbacks */
+void canopen_client_close(canopen_client_t* client);
+
+transport_t* canopen_client_transport(canopen_client_t* client);
+
+/*
+ * The channel to node 1-127, created if needed. NULL for other node ids
+ * and if there is no memory.
+ */
+sdo_channel_t* canopen_client_channel(canopen_client_t* client, uint8_t node_id);
+
+/*
+ * See sdo_channel_upload() and sdo_channel_download(). Transfers to node
+ * ids outside 1-127 fail with SDO_ERROR_GENERAL_ERROR.
+ */
+void canopen_client_upload(canopen_client_t* client, uint8_t node_id,
+        uint16_t index, uint8_t subindex, sdo_callback_t callback, void* context);
+void canopen_client_download(canopen_client_t* client, uint8_t node_id,
+        uint16_t index, uint8_t subindex, const uint8_t* data, size_t size,
+        bool size_indicated, sdo_callback_t callback, void* context);
+
+/* resets drop the cached values of the nodes */
+bool canopen_client_nmt(canopen_client_t* client,
+        nmt_command_specifier_t command_specifier, const uint8_t* node_ids,
+        int node_count);
+
+/* false if no transfer to the node was started yet */
+bool canopen_client_get_stats(const canopen_client_t* client, uint8_t node_id,
+        sdo_channel_stats_t* stats);
+
+/*
+ * Answer uploads from an sdo_cache_t. Besides SDO responses the client
+ * then receives heartbeats and NMT commands, and drops all values of a
+ * node when it sends its boot-up message or is reset. Cache hits call
+ * back before canopen_client_upload() returns. Returns false if there is
+ * no memory or the filters cannot be changed.
+ */
+bool canopen_client_enable_cache(canopen_client_t* client);
+
+/* NULL unless the cache is enabled, for policies and statistics */
+sdo_cache_t* canopen_client_cache(canopen_client_t* client);
+
+#endif /* CANOPEN_H_ */
@@ -0,0 +1,254 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANOPEN_FRAME_H_
+#define CANOPEN_FRAME_H_
+
+/*
+ * Decoding and encoding of the CANopen predefined connection set. All
+ * functions are inline, take the frame by const pointer and read single
+ * bytes at constant offsets, so they compile down to a load, a shift and
+ * a mask at the call site. COB-ID checks compare the whole can_id, which
+ * also rejects extended, remote and error frames.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <linux/can.h>
+
+#define COB_NMT       0x000
+#define COB_SYNC      0x080
+#define COB_EMCY      0x080
+#define COB_TPDO1     0x180
+#define COB_RPDO1     0x200
+#define COB_SDO_TX    0x580 /* server to client */
+#define COB_SDO_RX    0x600 /* client to server */
+#define COB_HEARTBEAT 0x700
+
+#define NMT_STATE_BOOTUP          0
+#define NMT_STATE_STOPPED         4
+#define NMT_STATE_OPERATIONAL     5
+#define NMT_STATE_PREOPERATIONAL  127
+
+/* bits count from 0, the least significant bit of the byte */
+static inline unsigned int frame_bits(const struct canfd_frame* frame, int byte,
+        int shift, int width) {
+    return frame->data[byte] >> shift & ((1u << width) - 1);
+}
+
+static inline uint16_t frame_u16(const struct canfd_frame* frame, int byte) {
+    return frame->data[byte] | frame->data[byte + 1] << 8;
+}
+
+static inline uint32_t frame_u32(const struct canfd_frame* frame, int byte) {
+    return (uint32_t) frame->data[byte + 3] << 24
+         | (uint32_t) frame->data[byte + 2] << 16
+         | (uint32_t) frame->data[byte + 1] << 8
+         | (uint32_t) frame->data[byte + 0] << 0;
+}
+
+static inline void frame_init(struct canfd_frame* frame, canid_t can_id, uint8_t len) {
+    memset(frame, 0, sizeof(*frame));
+    frame->can_id = can_id;
+    frame->len = len;
+}
+
+/* node id 1-127 of a frame with COB-ID base + node id, 0 for other frames */
+static inline uint8_t cob_node_id(const struct canfd_frame* frame, canid_t base) {
+    return frame->can_id > base && frame->can_id <= base + 0x7F
+            ? frame->can_id - base : 0;
+}
+
+/* NMT */
+
+static inline bool is_nmt_command(const struct canfd_frame* frame) {
+    return frame->can_id == COB_NMT && frame->len == 2;
+}
+
+static inline uint8_t nmt_command_specifier(const struct canfd_frame* frame) {
+    return frame->data[0];
+}
+
+/* 0 addresses all nodes */
+static inline uint8_t nmt_node_id(const struct canfd_frame* frame) {
+    return frame->data[1];
+}
+
+static inline void nmt_encode(struct canfd_frame* frame, uint8_t command_specifier,
+        uint8_t node_id) {
+    frame_init(frame, COB_NMT, 2);
+    frame->data[0] = command_specifier;
+    frame->data[1] = node_id;
+}
+
+/* heartbeat and boot-up */
+
+/* 0 if the frame is no heartbeat */
+static inline uint8_t heartbeat_node_id(const struct canfd_frame* frame) {
+    return frame->len == 1 ? cob_node_id(frame, COB_HEARTBEAT) : 0;
+}
+
+/* the NMT_STATE_* without the toggle bit */
+static inline uint8_t heartbeat_state(const struct canfd_frame* frame) {
+    return frame->data[0] & 0x7F;
+}
+
+static inline bool is_bootup(const struct canfd_frame* frame) {
+    return heartbeat_node_id(frame) != 0 && frame->data[0] == NMT_STATE_BOOTUP;
+}
+
+static inline void heartbeat_encode(struct canfd_frame* frame, uint8_t node_id,
+        uint8_t state) {
+    frame_init(frame, COB_HEARTBEAT + node_id, 1);
+    frame->data[0] = state;
+}
+
+/* SYNC and EMCY, which share the function code */
+
+static inline bool is_sync(const struct canfd_frame* frame) {
+    return frame->can_id == COB_SYNC && frame->len <= 1;
+}
+
+/* 0 if the SYNC carries no counter */
+static inline uint8_t sync_counter(const struct canfd_frame* frame) {
+    return frame->len == 1 ? frame->data[0] : 0;
+}
+
+/* 0 if the frame is no emergency message */
+static inline uint8_t emcy_node_id(const struct canfd_frame* frame) {
+    return frame->len == 8 ? cob_node_id(frame, COB_EMCY) : 0;
+}
+
+static inline uint16_t emcy_error_code(const struct canfd_frame* frame) {
+    return frame_u16(frame, 0);
+}
+
+static inline uint8_t emcy_error_register(const struct canfd_frame* frame) {
+    return frame->data[2];
+}
+
+/* PDOs 1-4 in both directions */
+
+/*
+ * Number 1-4 of a PDO, 0 for other frames. transmit tells a TPDO, sent by
+ * the node, from an RPDO.
+ */
+static inline int pdo_number(const struct canfd_frame* frame, bool* transmit) {
+    canid_t function_code = frame->can_id & 0x780;
+
+    if ((frame->can_id & ~0x7FFu) != 0 || (frame->can_id & 0x7F) == 0
+            || function_code < COB_TPDO1 || function_code > COB_RPDO1 + 0x300) {
+        return 0;
+    }
+    *transmit = (function_code & 0x80) != 0;
+    return (function_code - COB_TPDO1) / 0x100 + 1;
+}
+
+static inline uint8_t pdo_node_id(const struct canfd_frame* frame) {
+    return frame->can_id & 0x7F;
+}
+
+/*
+ * SDO. The command byte is data[0]: cs is the command specifier, n the
+ * number of bytes without data (two bits in an initiate frame, three in
+ * a segment), e expedited, s size indicated, t the toggle bit and c the
+ * last segment. Block transfers use ss, sc and seqno.
+ */
+
+/* 0 unless an SDO response of a node, 8 bytes or CAN FD */
+static inline uint8_t sdo_response_node(const struct canfd_frame* frame) {
+    return frame->len == 8 || (frame->flags & CANFD_FDF && frame->len > 8)
+            ? cob_node_id(frame, COB_SDO_TX) : 0;
+}
+
+/* 0 unless an SDO request to a node */
+static inline uint8_t sdo_request_node(const struct canfd_frame* frame) {
+    return frame->len == 8 || (frame->flags & CANFD_FDF && frame->len > 8)
+            ? cob_node_id(frame, COB_SDO_RX) : 0;
+}
+
+static inline int sdo_cs(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 5, 3);
+}
+
+static inline int sdo_n(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 2, 2);
+}
+
+static inline int sdo_segment_n(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 1, 3);
+}
+
+static inline int sdo_e(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 1, 1);
+}
+
+static inline int sdo_s(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 0, 1);
+}
+
+static inline int sdo_t(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 4, 1);
+}
+
+static inline int sdo_c(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 0, 1);
+}
+
+static inline int sdo_block_ss(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 0, 1);
+}
+
+static inline int sdo_block_s(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 1, 1);
+}
+
+static inline int sdo_block_sc(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 2, 1);
+}
+
+static inline int sdo_block_n(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 2, 3);
+}
+
+static inline int sdo_seqno(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 0, 7);
+}
+
+static inline int sdo_block_c(const struct canfd_frame* frame) {
+    return frame_bits(frame, 0, 7, 1);
+}
+
+static inline uint16_t sdo_index(const struct canfd_frame* frame) {
+    return frame_u16(frame, 1);
+}
+
+static inline uint8_t sdo_subindex(const struct canfd_frame* frame) {
+    return frame->data[3];
+}
+
+static inline bool sdo_is_object(const struct canfd_frame* frame, uint16_t index,
+        uint8_t subindex) {
+    return sdo_index(frame) == index && sdo_subindex(frame) == subindex;
+}
+
+/* the size or expedited data of an initiate frame, the code of an abort */
+static inline uint32_t sdo_data32(const struct canfd_frame* frame) {
+    return frame_u32(frame, 4);
+}
+
+#endif /* CANOPEN_FRAME_H_ */
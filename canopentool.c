@@ -14,6 +14,8 @@
  */
 
 #include "canopentool.h"
+#include "socketcan.h"
+#include "ipc.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,10 +34,32 @@
 
 static void show_help() {
     printf("The Swiss Army Knife for CANopen networks\n\n"
-            "nmt can-interface [start|stop|preop|reset-comm|reset-node] [node-id]\n"
-            "sdo-upload can-interface node-id index subindex\n"
-            "sdo-download can-interface node-id index subindex data\n"
-            "heartbeat can-interface\n");
+            "options (before the can-interface):\n"
+            "  -s  print frames accepted/rejected by the kernel filter on exit\n"
+            "  -m  receive through a memory-mapped capture ring (PACKET_MMAP)\n"
+            "  -t  also take hardware receive time stamps of the CAN controller\n"
+            "  -f  run SDO transfers over CAN FD with 62 byte segments\n"
+            "commands given options do not forward to a running daemon\n\n"
+            "nmt can-interface [start|stop|preop|reset-comm|reset-node] [node-id...]\n"
+            "sdo-upload can-interface node-id index subindex [@file] [raw|hex|base64]\n"
+            "sdo-download can-interface node-id index subindex data|@file|-\n"
+            "  (- downloads stdin)\n"
+            "heartbeat can-interface [can-interface...]\n"
+            "scan can-interface  (device type and identity of all nodes)\n"
+            "dump can-interface node-id [node-id...]  (object dictionary to node-<id>.dcf)\n"
+            "simulate can-interface node-id[-node-id][:heartbeat-ms[:pdos-per-s[:state]]]...\n"
+            "         (nodes answering NMT and SDO, sending heartbeats every 1000 ms\n"
+            "         by default and PDOs while operational; state is preop,\n"
+            "         operational or stopped; statistics on SIGUSR1 and exit)\n"
+            "batch can-interface [file]  (operations from file or stdin, one per line:\n"
+            "         read node-id index subindex\n"
+            "         write node-id index subindex data [type]\n"
+            "         nmt start|stop|preop|reset-comm|reset-node [node-id]\n"
+            "         prints \"line ok [value]\", \"line abort code\" or \"line timeout\")\n"
+            "daemon  (serve nmt and sdo requests of the commands above,\n"
+            "         listening on $" IPC_SOCKET_ENV " or " IPC_SOCKET_PATH ",\n"
+            "         caching constant objects until a node restarts,\n"
+            "         round trip times and cache hits per bus on SIGUSR1)\n");
 }
 
 static nmt_command_specifier_t parse_nmt_command_specifier(char* str) {
@@ -86,7 +110,107 @@ static uint32_t parse_sdo_data(char* str) {
     return strtol(str, NULL, 0);
 }
 
-static void ensure_user_is_root() {
+static sdo_output_format_t parse_sdo_output_format(char* str) {
+    if (!strcasecmp(str, "raw")) {
+        return SDO_OUTPUT_RAW;
+    } else if (!strcasecmp(str, "hex")) {
+        return SDO_OUTPUT_HEX;
+    } else if (!strcasecmp(str, "base64")) {
+        return SDO_OUTPUT_BASE64;
+    } else {
+        fprintf(stderr, "illegal output format\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Add the nodes of a "node-id[-node-id][:heartbeat-ms[:pdos-per-s[:state]]]"
+ * argument, returns the new node count.
+ */
+static int parse_simulated_nodes(char* str, simulated_node_t* nodes, int node_count,
+        bool* simulated) {
+    simulated_node_t node = { 0, 1000, 0, 127 };
+    char* fields[4] = { NULL };
+    long first, last;
+    char* end;
+    int count = 0;
+
+    fields[0] = str;
+    while (count < 3 && (end = strchr(fields[count], ':')) != NULL) {
+        *end = '\0';
+        fields[++count] = end + 1;
+    }
+    first = last = strtol(fields[0], &end, 0);
+    if (*end == '-') {
+        last = strtol(end + 1, &end, 0);
+    }
+    if (*end != '\0' || first < 1 || last > 127 || first > last) {
+        fprintf(stderr, "illegal node id\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fields[1] != NULL) {
+        node.heartbeat_ms = strtol(fields[1], NULL, 0);
+        if (node.heartbeat_ms > 0xFFFF) {
+            fprintf(stderr, "illegal heartbeat time\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (fields[2] != NULL) {
+        node.pdos_per_second = strtol(fields[2], NULL, 0);
+        if (node.pdos_per_second > 1000000) {
+            fprintf(stderr, "illegal PDO rate\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (fields[3] != NULL) {
+        node.state = !strcasecmp(fields[3], "preop") ? 127
+                : !strcasecmp(fields[3], "operational") ? 5
+                : !strcasecmp(fields[3], "stopped") ? 4 : 0;
+        if (node.state == 0) {
+            fprintf(stderr, "illegal NMT state\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (; first <= last; first++) {
+        if (simulated[first]) {
+            fprintf(stderr, "node %ld given twice\n", first);
+            exit(EXIT_FAILURE);
+        }
+        simulated[first] = true;
+        node.node_id = first;
+        nodes[node_count++] = node;
+    }
+    return node_count;
+}
+
+static int command_line_client_flags = 0;
+
+void sdo_enable_fd(void) {
+    command_line_client_flags |= CANOPEN_CLIENT_FD;
+}
+
+int client_flags(void) {
+    return command_line_client_flags;
+}
+
+evloop_t* open_loop(void) {
+    evloop_t* loop = evloop_create();
+    if (loop == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    return loop;
+}
+
+canopen_client_t* open_client(evloop_t* loop, char* can_interface) {
+    canopen_client_t* client = canopen_client_open(loop, can_interface, client_flags());
+    if (client == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    return client;
+}
+
+void ensure_user_is_root(void) {
 #define UNLOCK_PASSWORD "I am the master of my fate: I am the captain of my soul."
     bool user_is_root = (getuid() == 0);
 
@@ -100,36 +224,139 @@ static void ensure_user_is_root() {
     }
 }
 
+static bool is_command(char* str) {
+    static char* commands[] = {
+        "nmt", "sdo-upload", "sdo-download", "sdo-read", "sdo-write",
+        "heartbeat", "daemon", "batch", "scan", "dump",
+        "simulate"
+    };
+    size_t i;
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (!strcasecmp(str, commands[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void parse_options(int* argc, char*** argv) {
+    int opt;
+
+    optind = 0;
+    while ((opt = getopt(*argc, *argv, "+smtf")) != -1) {
+        ipc_disable_forwarding();
+        switch (opt) {
+        case 's':
+            socketcan_enable_statistics();
+            break;
+        case 'm':
+            socketcan_enable_packet_mmap();
+            break;
+        case 't':
+            socketcan_enable_hardware_timestamps();
+            break;
+        case 'f':
+            sdo_enable_fd();
+            break;
+        default:
+            fprintf(stderr, "syntax error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    (*argv)[optind - 1] = (*argv)[0];
+    *argc -= optind - 1;
+    *argv += optind - 1;
+}
+
 int main(int argc, char** argv) {
     char* program_name = basename(argv[0]);
 
+    parse_options(&argc, &argv);
+
     if (!strcasecmp(program_name, "canopentool") && argc == 1) {
         show_help();
     }
-    else if (!strcasecmp(program_name, "canopentool") && argc == 2) {
-        char* can_interface = argv[1];
-        heartbeat(can_interface);
-    }
-    else if (!strcasecmp(program_name, "canopentool")) {
+    else if (!strcasecmp(program_name, "canopentool") && is_command(argv[1])) {
         return main(argc - 1, &argv[1]);
     }
-    else if (!strcasecmp(program_name, "nmt") && (argc == 3 || argc == 4)) {
+    else if (!strcasecmp(program_name, "canopentool")
+            || (!strcasecmp(program_name, "heartbeat") && argc >= 2)) {
+        heartbeat(&argv[1], argc - 1);
+    }
+    else if (!strcasecmp(program_name, "daemon") && argc == 1) {
+        run_daemon();
+    }
+    else if (!strcasecmp(program_name, "scan") && argc == 2) {
+        scan(argv[1]);
+    }
+    else if (!strcasecmp(program_name, "dump") && argc >= 3 && argc <= 129) {
+        uint8_t node_ids[127];
+        int i;
+
+        for (i = 2; i < argc; i++) {
+            node_ids[i - 2] = parse_node_id(argv[i]);
+        }
+        dump(argv[1], node_ids, argc - 2);
+    }
+    else if (!strcasecmp(program_name, "simulate") && argc >= 3) {
+        simulated_node_t nodes[127];
+        bool simulated[128] = { false };
+        int node_count = 0;
+        int i;
+
+        for (i = 2; i < argc; i++) {
+            node_count = parse_simulated_nodes(argv[i], nodes, node_count, simulated);
+        }
+
+        ensure_user_is_root();
+        simulate(argv[1], nodes, node_count);
+    }
+    else if (!strcasecmp(program_name, "batch") && (argc == 2 || argc == 3)) {
+        batch(argv[1], argc == 3 && strcmp(argv[2], "-") ? argv[2] : NULL);
+    }
+    else if (!strcasecmp(program_name, "nmt") && argc >= 3) {
         char* can_interface = argv[1];
         nmt_command_specifier_t command_specifier =
                 parse_nmt_command_specifier(argv[2]);
-        uint8_t node_id = argc > 3 ? parse_node_id(argv[3]) : NMT_ANY_NODE;
+        uint8_t node_ids[127] = { NMT_ANY_NODE };
+        int node_count = argc > 3 ? argc - 3 : 1;
+        int i;
+
+        if (node_count > 127) {
+            fprintf(stderr, "too many node ids\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 3; i < argc; i++) {
+            node_ids[i - 3] = parse_node_id(argv[i]);
+        }
 
         ensure_user_is_root();
-        nmt(can_interface, command_specifier, node_id);
+        nmt(can_interface, command_specifier, node_ids, node_count);
     }
     else if ((!strcasecmp(program_name, "sdo-upload")
-            || !strcasecmp(program_name, "sdo-read")) && argc == 5) {
+            || !strcasecmp(program_name, "sdo-read")) && argc >= 5 && argc <= 7) {
         char* can_interface = argv[1];
         uint8_t node_id = parse_node_id(argv[2]);
         uint16_t index = parse_canopen_index(argv[3]);
         uint8_t subindex = parse_canopen_subindex(argv[4]);
+        char* path = NULL;
+        sdo_output_format_t format = SDO_OUTPUT_DEFAULT;
+        int i;
 
-        sdo_upload(can_interface, node_id, index, subindex);
+        for (i = 5; i < argc; i++) {
+            if (argv[i][0] == '@' && path == NULL) {
+                path = &argv[i][1];
+            }
+            else if (format == SDO_OUTPUT_DEFAULT) {
+                format = parse_sdo_output_format(argv[i]);
+            }
+            else {
+                fprintf(stderr, "syntax error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        sdo_upload(can_interface, node_id, index, subindex, path, format);
     }
     else if ((!strcasecmp(program_name, "sdo-download")
             || !strcasecmp(program_name, "sdo-write")) && argc == 6) {
@@ -137,10 +364,18 @@ int main(int argc, char** argv) {
         uint8_t node_id = parse_node_id(argv[2]);
         uint16_t index = parse_canopen_index(argv[3]);
         uint8_t subindex = parse_canopen_subindex(argv[4]);
-        uint32_t data = parse_sdo_data(argv[5]);
 
         ensure_user_is_root();
-        sdo_download(can_interface, node_id, index, subindex, data, SDO_TYPE_UNSPECIFIED);
+        if (!strcmp(argv[5], "-")) {
+            sdo_download_file(can_interface, node_id, index, subindex, NULL);
+        }
+        else if (argv[5][0] == '@') {
+            sdo_download_file(can_interface, node_id, index, subindex, &argv[5][1]);
+        }
+        else {
+            sdo_download(can_interface, node_id, index, subindex,
+                    parse_sdo_data(argv[5]), SDO_TYPE_UNSPECIFIED);
+        }
     }
     else if ((!strcasecmp(program_name, "sdo-download")
             || !strcasecmp(program_name, "sdo-write")) && argc == 7) {
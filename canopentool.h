@@ -19,18 +19,12 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "canopen.h"
 
-void heartbeat(char* can_interface);
+void heartbeat(char** can_interfaces, int count);
 
-typedef enum {
-    NMT_START_REMOTE_NODE = 1,
-    NMT_STOP_REMOTE_NODE = 2,
-    NMT_ENTER_PREOPERATIONAL = 128,
-    NMT_RESET_NODE = 129,
-    NMT_RESET_COMMUNICATION = 130
-} nmt_command_specifier_t;
-#define NMT_ANY_NODE (0)
-void nmt(char* can_interface, nmt_command_specifier_t command_specifier, uint8_t node_id);
+void nmt(char* can_interface, nmt_command_specifier_t command_specifier,
+        const uint8_t* node_ids, int node_count);
 
 typedef enum {
     SDO_TYPE_U32, SDO_TYPE_U24, SDO_TYPE_U16, SDO_TYPE_U8,
@@ -38,7 +32,40 @@ typedef enum {
     SDO_TYPE_UNSPECIFIED
 } sdo_type_specifier_t;
 void sdo_download(char* can_interface, uint8_t node_id, uint16_t index, uint8_t subindex, uint32_t data, sdo_type_specifier_t type);
-void sdo_upload(char* can_interface, uint8_t node_id, uint16_t index, uint8_t subindex);
+void sdo_download_file(char* can_interface, uint8_t node_id, uint16_t index, uint8_t subindex, char* path);
+typedef enum {
+    SDO_OUTPUT_DEFAULT, SDO_OUTPUT_RAW, SDO_OUTPUT_HEX, SDO_OUTPUT_BASE64
+} sdo_output_format_t;
+void sdo_upload(char* can_interface, uint8_t node_id, uint16_t index, uint8_t subindex, char* path, sdo_output_format_t format);
+void sdo_enable_fd(void);
+
+void run_daemon(void);
+
+void batch(char* can_interface, char* path);
+
+void scan(char* can_interface);
+
+void dump(char* can_interface, const uint8_t* node_ids, int node_count);
+
+typedef struct {
+    uint8_t node_id;
+    unsigned long heartbeat_ms;    /* 0 for none */
+    unsigned long pdos_per_second; /* while operational */
+    uint8_t state;                 /* NMT state after the boot-up message */
+} simulated_node_t;
+void simulate(char* can_interface, const simulated_node_t* nodes, int node_count);
+
+void ensure_user_is_root(void);
+
+/* CANOPEN_CLIENT_* flags for the options given on the command line */
+int client_flags(void);
+
+/*
+ * Event loop and client for a command. Both end the program if they
+ * cannot be created.
+ */
+evloop_t* open_loop(void);
+canopen_client_t* open_client(evloop_t* loop, char* can_interface);
 
 
 #endif /* CANOPENTOOL_H_ */
@@ -0,0 +1,39 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRC16_H_
+#define CRC16_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-16/CCITT as used by SDO block transfers: polynomial 0x1021, no
+ * reflection, initial value 0. Pass the result of the previous call as
+ * crc to continue over further data.
+ *
+ * crc16_ccitt() uses carry-less multiplication if the CPU has PCLMULQDQ,
+ * slicing-by-8 otherwise. The single implementations are there for the
+ * benchmark; crc16_ccitt_clmul() falls back to slicing-by-8.
+ */
+uint16_t crc16_ccitt(uint16_t crc, const uint8_t* data, size_t size);
+
+uint16_t crc16_ccitt_bytewise(uint16_t crc, const uint8_t* data, size_t size);
+uint16_t crc16_ccitt_slice8(uint16_t crc, const uint8_t* data, size_t size);
+uint16_t crc16_ccitt_clmul(uint16_t crc, const uint8_t* data, size_t size);
+bool crc16_clmul_supported(void);
+
+#endif /* CRC16_H_ */
@@ -0,0 +1,101 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput of the CRC-16 implementations. Checks them against each
+ * other on random lengths, alignments and split points first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "crc16.h"
+
+#define BUFFER_SIZE (8 << 20)
+#define MIN_SECONDS 0.5
+
+typedef uint16_t (*crc16_function_t)(uint16_t, const uint8_t*, size_t);
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(const char* name, crc16_function_t crc16, const uint8_t* buffer) {
+    int i;
+
+    for (i = 0; i < 10000; i++) {
+        size_t offset = rand() % 64;
+        size_t size = rand() % (i < 9990 ? 4096 : BUFFER_SIZE - 64);
+        size_t split = size > 0 ? rand() % size : 0;
+        uint16_t expected = crc16_ccitt_bytewise(0, buffer + offset, size);
+        uint16_t crc = crc16(crc16(0, buffer + offset, split),
+                buffer + offset + split, size - split);
+
+        if (crc != expected) {
+            fprintf(stderr, "%s: CRC 0x%04X instead of 0x%04X over %zu bytes\n",
+                    name, crc, expected, size);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void measure(const char* name, crc16_function_t crc16, const uint8_t* buffer,
+        size_t size) {
+    double started = now(), elapsed;
+    unsigned long rounds = 0;
+    volatile uint16_t crc = 0;
+
+    do {
+        crc = crc16(crc, buffer, size);
+        rounds++;
+    } while ((elapsed = now() - started) < MIN_SECONDS);
+
+    printf("%-9s %8zu bytes %10.1f MB/s\n", name, size, rounds * size / elapsed / 1e6);
+}
+
+int main(void) {
+    static const size_t sizes[] = { 64, 1024, 65536, BUFFER_SIZE };
+    uint8_t* buffer = malloc(BUFFER_SIZE);
+    size_t i;
+
+    if (buffer == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (i = 0; i < BUFFER_SIZE; i++) {
+        buffer[i] = rand();
+    }
+    if (crc16_ccitt_bytewise(0, (const uint8_t*) "123456789", 9) != 0x31C3) {
+        fprintf(stderr, "check value mismatch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    check("slice8", crc16_ccitt_slice8, buffer);
+    check("clmul", crc16_ccitt_clmul, buffer);
+    printf("PCLMULQDQ %s\n", crc16_clmul_supported() ? "supported" : "not supported");
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        measure("bytewise", crc16_ccitt_bytewise, buffer, sizes[i]);
+        measure("slice8", crc16_ccitt_slice8, buffer, sizes[i]);
+        measure("clmul", crc16_ccitt_clmul, buffer, sizes[i]);
+    }
+    free(buffer);
+    return 0;
+}
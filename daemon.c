@@ -0,0 +1,513 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "canopentool.h"
+#include "canopen.h"
+#include "ipc.h"
+
+/* a client that leaves more than this of its responses unread is dropped */
+#define DAEMON_MAX_BACKLOG (2 * (IPC_MAX_DATA + sizeof(ipc_response_t)))
+
+/*
+ * Every bus is opened once, on the first request for it, and stays open.
+ * Its client runs transfers to different nodes concurrently while
+ * transfers to the same node are queued by the node's channel.
+ */
+typedef struct bus {
+    char name[sizeof(((ipc_request_t*) 0)->bus)];
+    canopen_client_t* client;
+    struct bus* next;
+} bus_t;
+
+typedef struct client {
+    int fd;
+    uid_t uid;
+    ipc_request_t request;
+    size_t received; /* of the request header, then of its data */
+    uint8_t* data;
+    uint8_t* output; /* responses the socket did not take yet */
+    size_t output_size;
+    size_t output_sent;
+    int references;  /* transfers in progress and running handlers */
+    bool closed;
+} client_t;
+
+typedef struct {
+    client_t* client;
+    uint32_t id;
+    uint8_t* data; /* of a download, taken over from the client */
+} pending_t;
+
+static evloop_t* loop;
+static bus_t* buses = NULL;
+static int listen_fd = -1;
+static int signal_fd = -1;
+
+static void exit_failure(char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+
+    exit(EXIT_FAILURE);
+}
+
+static bus_t* find_bus(const char* name) {
+    bus_t* bus;
+
+    for (bus = buses; bus != NULL; bus = bus->next) {
+        if (!strcmp(bus->name, name)) {
+            return bus;
+        }
+    }
+
+    if ((bus = calloc(1, sizeof(bus_t))) == NULL) {
+        exit_failure("out of memory\n");
+    }
+    snprintf(bus->name, sizeof(bus->name), "%s", name);
+    if ((bus->client = canopen_client_open(loop, bus->name, client_flags())) == NULL) {
+        free(bus);
+        return NULL;
+    }
+    if (!canopen_client_enable_cache(bus->client)) {
+        fprintf(stderr, "%s: reads are not cached\n", bus->name);
+    }
+    bus->next = buses;
+    buses = bus;
+    return bus;
+}
+
+static void release_client(client_t* client) {
+    if (--client->references == 0 && client->closed) {
+        free(client);
+    }
+}
+
+static void close_client(client_t* client) {
+    if (!client->closed) {
+        client->closed = true;
+        evloop_remove_fd(loop, client->fd);
+        close(client->fd);
+        free(client->data);
+        client->data = NULL;
+        free(client->output);
+        client->output = NULL;
+        release_client(client);
+    }
+}
+
+static void on_client_writable(void* context);
+
+/* false if the client was closed */
+static bool send_output(client_t* client) {
+    while (client->output_sent < client->output_size) {
+        ssize_t sent = send(client->fd, client->output + client->output_sent,
+                client->output_size - client->output_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (sent <= 0) {
+            close_client(client);
+            return false;
+        }
+        client->output_sent += sent;
+    }
+    client->output_size = 0;
+    client->output_sent = 0;
+    evloop_set_writable_handler(loop, client->fd, NULL, NULL);
+    return true;
+}
+
+static void on_client_writable(void* context) {
+    client_t* client = context;
+
+    client->references++;
+    send_output(client);
+    release_client(client);
+}
+
+/* keep what the socket did not take, to be sent when it becomes writable */
+static void queue_output(client_t* client, const struct iovec* iov, int count) {
+    size_t size = client->output_size - client->output_sent;
+    uint8_t* output;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        size += iov[i].iov_len;
+    }
+    if (size > DAEMON_MAX_BACKLOG) {
+        close_client(client);
+        return;
+    }
+    if (client->output_sent > 0) {
+        memmove(client->output, client->output + client->output_sent,
+                client->output_size - client->output_sent);
+        client->output_size -= client->output_sent;
+        client->output_sent = 0;
+    }
+    if ((output = realloc(client->output, size)) == NULL) {
+        exit_failure("out of memory\n");
+    }
+    client->output = output;
+    for (i = 0; i < count; i++) {
+        memcpy(client->output + client->output_size, iov[i].iov_base, iov[i].iov_len);
+        client->output_size += iov[i].iov_len;
+    }
+    if (!evloop_set_writable_handler(loop, client->fd, on_client_writable, client)) {
+        close_client(client);
+    }
+}
+
+/*
+ * Responses are sent without blocking, the part the socket does not take
+ * waits in the client's output, behind which later responses queue up.
+ */
+static void send_response(client_t* client, uint32_t id, ipc_status_t status,
+        uint8_t flags, uint32_t abort_code, const uint8_t* data, size_t size) {
+    ipc_response_t response;
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t total = sizeof(response) + size;
+
+    if (client->closed) {
+        return;
+    }
+
+    bzero(&response, sizeof(response));
+    response.id = id;
+    response.status = status;
+    response.flags = flags;
+    response.abort_code = abort_code;
+    response.size = size;
+
+    iov[0].iov_base = &response;
+    iov[0].iov_len = sizeof(response);
+    iov[1].iov_base = (void*) data;
+    iov[1].iov_len = size;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (client->output_size > 0) {
+        queue_output(client, msg.msg_iov, msg.msg_iovlen);
+        return;
+    }
+    while (total > 0) {
+        ssize_t sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            queue_output(client, msg.msg_iov, msg.msg_iovlen);
+            return;
+        }
+        if (sent <= 0) {
+            close_client(client);
+            return;
+        }
+        total -= sent;
+        while (msg.msg_iovlen > 0 && (size_t) sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t*) msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+}
+
+static void on_sdo_result(void* context, const sdo_result_t* result) {
+    pending_t* pending = context;
+    ipc_status_t status = result->timed_out ? IPC_STATUS_TIMED_OUT
+            : result->abort_code != 0 ? IPC_STATUS_ABORTED : IPC_STATUS_OK;
+
+    send_response(pending->client, pending->id, status,
+            result->expedited ? IPC_FLAG_EXPEDITED : 0, result->abort_code,
+            result->data, result->size);
+    release_client(pending->client);
+    free(pending->data);
+    free(pending);
+}
+
+static void handle_nmt(client_t* client, bus_t* bus) {
+    const ipc_request_t* request = &client->request;
+    uint32_t i;
+
+    for (i = 0; i < request->size; i++) {
+        if (client->data[i] > 127) {
+            send_response(client, request->id, IPC_STATUS_INVALID, 0, 0, NULL, 0);
+            return;
+        }
+    }
+    if (!canopen_client_nmt(bus->client, request->command, client->data,
+            request->size)) {
+        send_response(client, request->id, IPC_STATUS_TIMED_OUT, 0, 0, NULL, 0);
+        return;
+    }
+    send_response(client, request->id, IPC_STATUS_OK, 0, 0, NULL, 0);
+}
+
+static void handle_sdo(client_t* client, bus_t* bus) {
+    const ipc_request_t* request = &client->request;
+    pending_t* pending;
+
+    if (request->node_id < 1 || request->node_id > 127) {
+        send_response(client, request->id, IPC_STATUS_INVALID, 0, 0, NULL, 0);
+        return;
+    }
+
+    if ((pending = malloc(sizeof(pending_t))) == NULL) {
+        exit_failure("out of memory\n");
+    }
+    pending->client = client;
+    pending->id = request->id;
+    pending->data = NULL;
+    client->references++;
+
+    /* through the client, so that uploads are answered from its cache */
+    if (request->type == IPC_REQUEST_SDO_UPLOAD) {
+        canopen_client_upload(bus->client, request->node_id, request->index,
+                request->subindex, on_sdo_result, pending);
+    }
+    else {
+        /* segments are sent from the data, which outlives further requests */
+        pending->data = client->data;
+        client->data = NULL;
+        canopen_client_download(bus->client, request->node_id, request->index,
+                request->subindex, pending->data, request->size,
+                request->flags & IPC_FLAG_SIZE_INDICATED, on_sdo_result, pending);
+    }
+}
+
+static void handle_request(client_t* client) {
+    ipc_request_t* request = &client->request;
+    bus_t* bus;
+
+    request->bus[sizeof(request->bus) - 1] = '\0';
+
+    if (request->type != IPC_REQUEST_NMT
+            && request->type != IPC_REQUEST_SDO_UPLOAD
+            && request->type != IPC_REQUEST_SDO_DOWNLOAD) {
+        send_response(client, request->id, IPC_STATUS_INVALID, 0, 0, NULL, 0);
+    }
+    else if (request->type != IPC_REQUEST_SDO_UPLOAD && client->uid != 0) {
+        send_response(client, request->id, IPC_STATUS_DENIED, 0, 0, NULL, 0);
+    }
+    else if ((bus = find_bus(request->bus)) == NULL) {
+        send_response(client, request->id, IPC_STATUS_INVALID, 0, 0, NULL, 0);
+    }
+    else if (request->type == IPC_REQUEST_NMT) {
+        handle_nmt(client, bus);
+    }
+    else {
+        handle_sdo(client, bus);
+    }
+}
+
+/* requests may arrive in pieces, and several at once */
+static void on_client_readable(void* context) {
+    client_t* client = context;
+
+    client->references++;
+    while (!client->closed) {
+        ipc_request_t* request = &client->request;
+        uint8_t* buffer;
+        size_t wanted;
+
+        if (client->received < sizeof(*request)) {
+            buffer = (uint8_t*) request + client->received;
+            wanted = sizeof(*request) - client->received;
+        }
+        else {
+            buffer = client->data + client->received - sizeof(*request);
+            wanted = sizeof(*request) + request->size - client->received;
+        }
+
+        ssize_t received = recv(client->fd, buffer, wanted, MSG_DONTWAIT);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
+        }
+        if (received <= 0) {
+            close_client(client);
+            break;
+        }
+        client->received += received;
+
+        if (client->received == sizeof(*request)) {
+            if (request->size > IPC_MAX_DATA) {
+                close_client(client);
+                break;
+            }
+            free(client->data);
+            if ((client->data = malloc(request->size + 1)) == NULL) {
+                exit_failure("out of memory\n");
+            }
+        }
+        if (client->received == sizeof(*request) + request->size) {
+            handle_request(client);
+            client->received = 0;
+        }
+    }
+    release_client(client);
+}
+
+static void on_accept(void* context) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    client_t* client;
+    int fd;
+
+    (void) context;
+    if ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) < 0) {
+        return;
+    }
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0) {
+        close(fd);
+        return;
+    }
+    if ((client = calloc(1, sizeof(client_t))) == NULL) {
+        exit_failure("out of memory\n");
+    }
+    client->fd = fd;
+    client->uid = credentials.uid;
+    client->references = 1; /* dropped when the connection closes */
+    evloop_add_fd(loop, fd, on_client_readable, client);
+}
+
+/* round trip statistics of every node talked to, on SIGUSR1 and on exit */
+static void print_statistics(void) {
+    sdo_channel_stats_t stats;
+    sdo_cache_stats_t cache_stats;
+    bus_t* bus;
+    int i;
+
+    for (bus = buses; bus != NULL; bus = bus->next) {
+        for (i = 0; i < 128; i++) {
+            if (canopen_client_get_stats(bus->client, i, &stats)) {
+                fprintf(stderr, "%s ", bus->name);
+                print_sdo_channel_stats(&stats);
+            }
+        }
+        if (canopen_client_cache(bus->client) != NULL) {
+            sdo_cache_get_stats(canopen_client_cache(bus->client), &cache_stats);
+            fprintf(stderr, "%s ", bus->name);
+            print_sdo_cache_stats(&cache_stats);
+        }
+    }
+}
+
+static void on_signal(void* context) {
+    struct signalfd_siginfo info;
+
+    (void) context;
+    if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+        return;
+    }
+    if (info.ssi_signo == SIGUSR1) {
+        print_statistics();
+    }
+    else {
+        evloop_stop(loop);
+    }
+}
+
+static void open_listen_socket(const char* path) {
+    struct sockaddr_un addr;
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        exit_failure("socket path too long: %s\n", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        exit_failure("socket failed: %s\n", strerror(errno));
+    }
+
+    /* a stale socket file is left behind by a daemon that was killed */
+    int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe_fd >= 0 && connect(probe_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        exit_failure("canopentool daemon already running on %s\n", path);
+    }
+    close(probe_fd);
+    unlink(path);
+
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        exit_failure("bind to %s failed: %s\n", path, strerror(errno));
+    }
+    /* everybody may read, only root may change the network */
+    chmod(path, 0666);
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        exit_failure("listen failed: %s\n", strerror(errno));
+    }
+}
+
+void run_daemon(void) {
+    const char* path = ipc_socket_path();
+    sigset_t signals;
+    bus_t* bus;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    if ((signal_fd = signalfd(-1, &signals, SFD_CLOEXEC)) < 0) {
+        exit_failure("signalfd failed: %s\n", strerror(errno));
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    open_listen_socket(path);
+
+    if ((loop = evloop_create()) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    evloop_add_fd(loop, listen_fd, on_accept, NULL);
+    evloop_add_fd(loop, signal_fd, on_signal, NULL);
+    evloop_run(loop);
+
+    unlink(path);
+    close(listen_fd);
+    print_statistics();
+    while ((bus = buses) != NULL) {
+        buses = bus->next;
+        canopen_client_close(bus->client);
+        free(bus);
+    }
+}
@@ -0,0 +1,461 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <linux/can.h>
+
+#include "canopentool.h"
+#include "canopen.h"
+
+/*
+ * Every node gets a worker that probes subindex 0 of all indexes in
+ * DUMP_FIRST_INDEX to DUMP_LAST_INDEX. DUMP_WINDOW requests are queued on
+ * its SDO channel at any time, so the next one goes out as soon as the
+ * server answered the previous one. A missing object costs one abort.
+ * When subindex 0 holds one byte N, it may be the highest subindex of a
+ * record, which then has to exist: subindex N is probed, so a variable
+ * costs one more abort. For a record, subindexes 1 to N-1 go on a pending
+ * list that is read before further indexes; records may be sparse, and
+ * every missing entry costs an abort. Until a node answered at all, timed
+ * out requests are not repeated, so that a missing node costs
+ * DUMP_MAX_TIMEOUTS plain timeouts. A node that stops answering later on
+ * gets a partial dump of what was read until then.
+ */
+#define DUMP_FIRST_INDEX 0x1000
+#define DUMP_LAST_INDEX  0x9FFF
+#define DUMP_WINDOW      8
+
+/* a worker gives up on a node after this many timeouts in a row */
+#define DUMP_MAX_TIMEOUTS 3
+
+#define SDO_ABORT_OBJECT_DOES_NOT_EXIST    0x06020000
+#define SDO_ABORT_SUBINDEX_DOES_NOT_EXIST  0x06090011
+#define SDO_ABORT_WRITE_ONLY               0x06010001
+
+typedef struct {
+    uint16_t index;
+    uint8_t subindex;
+    uint32_t abort_code; /* of an object that exists but could not be read */
+    uint8_t* data;
+    size_t size;
+} dump_entry_t;
+
+/* the entries of a record still to be read */
+typedef struct dump_record {
+    uint16_t index;
+    uint8_t next_subindex;
+    uint8_t last_subindex;
+    struct dump_record* next;
+} dump_record_t;
+
+typedef struct {
+    uint8_t node_id;
+    sdo_channel_t* channel;
+    uint32_t next_index;
+    int outstanding;
+    int timeouts;
+    bool answered;
+    bool failed; /* never answered */
+    bool stalled; /* stopped answering after it did */
+    dump_record_t* pending;
+    dump_entry_t* entries;
+    size_t entry_count;
+    size_t entry_capacity;
+    struct timespec started;
+} dump_worker_t;
+
+typedef struct {
+    dump_worker_t* worker;
+    uint16_t index;
+    uint8_t subindex;
+    bool probe; /* of the highest subindex named by subindex 0 */
+} dump_request_t;
+
+static evloop_t* loop;
+static canopen_client_t* client;
+static dump_worker_t* workers[128];
+
+static void on_result(void* context, const sdo_result_t* result);
+
+static void queue_request(dump_worker_t* worker, uint16_t index, uint8_t subindex,
+        bool probe) {
+    dump_request_t* request = malloc(sizeof(dump_request_t));
+
+    if (request == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    request->worker = worker;
+    request->index = index;
+    request->subindex = subindex;
+    request->probe = probe;
+    worker->outstanding++;
+    sdo_channel_upload(worker->channel, index, subindex, on_result, request);
+}
+
+static void add_record(dump_worker_t* worker, uint16_t index, uint8_t last_subindex) {
+    dump_record_t* record = malloc(sizeof(dump_record_t));
+
+    if (record == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    record->index = index;
+    record->next_subindex = 1;
+    record->last_subindex = last_subindex;
+    record->next = worker->pending;
+    worker->pending = record;
+}
+
+static void refill(dump_worker_t* worker) {
+    while (!worker->failed && !worker->stalled && worker->outstanding < DUMP_WINDOW) {
+        dump_record_t* record = worker->pending;
+
+        if (record != NULL) {
+            queue_request(worker, record->index, record->next_subindex++, false);
+            if (record->next_subindex > record->last_subindex) {
+                worker->pending = record->next;
+                free(record);
+            }
+        }
+        else if (worker->next_index <= DUMP_LAST_INDEX) {
+            queue_request(worker, worker->next_index++, 0, false);
+        }
+        else {
+            break;
+        }
+    }
+}
+
+static void add_entry(dump_worker_t* worker, const dump_request_t* request,
+        const sdo_result_t* result) {
+    dump_entry_t* entry;
+
+    if (worker->entry_count == worker->entry_capacity) {
+        worker->entry_capacity = worker->entry_capacity * 2 + 256;
+        worker->entries = realloc(worker->entries,
+                worker->entry_capacity * sizeof(dump_entry_t));
+        if (worker->entries == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    entry = &worker->entries[worker->entry_count++];
+    entry->index = request->index;
+    entry->subindex = request->subindex;
+    entry->abort_code = result->timed_out ? SDO_ERROR_PROTOCOL_TIMED_OUT
+            : result->abort_code;
+    entry->size = result->size;
+    entry->data = NULL;
+    if (result->size > 0 && (entry->data = malloc(result->size)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry->data, result->data, result->size);
+}
+
+static void on_result(void* context, const sdo_result_t* result) {
+    dump_request_t* request = context;
+    dump_worker_t* worker = request->worker;
+
+    worker->outstanding--;
+    worker->timeouts = result->timed_out ? worker->timeouts + 1 : 0;
+    if (!result->timed_out && !worker->answered) {
+        worker->answered = true;
+        sdo_channel_set_retries(worker->channel, SDO_DEFAULT_RETRIES);
+    }
+    if (worker->timeouts >= DUMP_MAX_TIMEOUTS) {
+        if (worker->answered) {
+            worker->stalled = true;
+        }
+        else {
+            worker->failed = true;
+        }
+    }
+
+    if (result->abort_code == SDO_ABORT_OBJECT_DOES_NOT_EXIST
+            || result->abort_code == SDO_ABORT_SUBINDEX_DOES_NOT_EXIST) {
+        /* nothing there */
+    }
+    else if (request->subindex == 0) {
+        add_entry(worker, request, result);
+        if (result->abort_code == 0 && !result->timed_out && result->size == 1
+                && result->data[0] > 0) {
+            queue_request(worker, request->index, result->data[0], true);
+        }
+    }
+    else {
+        add_entry(worker, request, result);
+        if (request->probe && !result->timed_out && request->subindex > 1) {
+            add_record(worker, request->index, request->subindex - 1);
+        }
+    }
+    free(request);
+    refill(worker);
+}
+
+/* a node that stopped answering says nothing about what it did not answer */
+static void drop_timed_out_entries(dump_worker_t* worker) {
+    size_t i, count = 0;
+
+    for (i = 0; i < worker->entry_count; i++) {
+        if (worker->entries[i].abort_code == SDO_ERROR_PROTOCOL_TIMED_OUT) {
+            free(worker->entries[i].data);
+        }
+        else {
+            worker->entries[count++] = worker->entries[i];
+        }
+    }
+    worker->entry_count = count;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    const dump_entry_t* x = a;
+    const dump_entry_t* y = b;
+    return (x->index << 8 | x->subindex) - (y->index << 8 | y->subindex);
+}
+
+static bool is_printable(const dump_entry_t* entry) {
+    size_t i;
+
+    for (i = 0; i < entry->size; i++) {
+        if (!isprint(entry->data[i]) && !(entry->data[i] == 0 && i == entry->size - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * The data type is guessed from the size: up to four bytes are taken as
+ * an unsigned integer, printable text as a visible string and anything
+ * else as a domain, written in hex.
+ */
+static void write_value(FILE* file, const dump_entry_t* entry) {
+    static const int integer_types[] = { 0, 0x0005, 0x0006, 0x0016, 0x0007 };
+    size_t i;
+
+    fprintf(file, "ObjectType=0x7\n");
+    if (entry->abort_code != 0) {
+        fprintf(file, "AccessType=%s\n",
+                entry->abort_code == SDO_ABORT_WRITE_ONLY ? "wo" : "ro");
+        fprintf(file, ";SDO abort 0x%08X\n", entry->abort_code);
+    }
+    else if (entry->size >= 1 && entry->size <= 4) {
+        uint32_t value = 0;
+        for (i = 0; i < entry->size; i++) {
+            value |= (uint32_t) entry->data[i] << 8 * i;
+        }
+        fprintf(file, "DataType=0x%04X\n", integer_types[entry->size]);
+        fprintf(file, "ParameterValue=0x%0*X\n", (int) entry->size * 2, value);
+    }
+    else if (entry->size > 0 && is_printable(entry)) {
+        fprintf(file, "DataType=0x0009\n");
+        fprintf(file, "ParameterValue=%.*s\n", (int) strnlen((char*) entry->data, entry->size),
+                entry->data);
+    }
+    else {
+        fprintf(file, "DataType=0x000F\n");
+        fprintf(file, "ParameterValue=");
+        for (i = 0; i < entry->size; i++) {
+            fprintf(file, "%02X", entry->data[i]);
+        }
+        fprintf(file, "\n");
+    }
+    fprintf(file, "\n");
+}
+
+typedef enum { MANDATORY_OBJECTS, OPTIONAL_OBJECTS, MANUFACTURER_OBJECTS } object_list_t;
+
+static object_list_t object_list(uint16_t index) {
+    if (index == 0x1000 || index == 0x1001 || index == 0x1018) {
+        return MANDATORY_OBJECTS;
+    }
+    return index >= 0x2000 && index <= 0x5FFF ? MANUFACTURER_OBJECTS : OPTIONAL_OBJECTS;
+}
+
+static void write_object_list(FILE* file, const dump_worker_t* worker,
+        const char* section, object_list_t list) {
+    size_t i;
+    int count = 0;
+
+    for (i = 0; i < worker->entry_count; i++) {
+        const dump_entry_t* entry = &worker->entries[i];
+        if ((i == 0 || entry[-1].index != entry->index) && object_list(entry->index) == list) {
+            count++;
+        }
+    }
+    fprintf(file, "[%s]\nSupportedObjects=%d\n", section, count);
+    count = 0;
+    for (i = 0; i < worker->entry_count; i++) {
+        const dump_entry_t* entry = &worker->entries[i];
+        if ((i == 0 || entry[-1].index != entry->index) && object_list(entry->index) == list) {
+            fprintf(file, "%d=0x%04X\n", ++count, entry->index);
+        }
+    }
+    fprintf(file, "\n");
+}
+
+static void write_dcf(dump_worker_t* worker, const char* path) {
+    FILE* file = fopen(path, "w");
+    char date[64];
+    time_t now = time(NULL);
+    size_t i, j;
+
+    if (file == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    qsort(worker->entries, worker->entry_count, sizeof(dump_entry_t), compare_entries);
+
+    strftime(date, sizeof(date), "CreationTime=%I:%M%p\nCreationDate=%m-%d-%Y",
+            localtime(&now));
+    fprintf(file, "[FileInfo]\nFileName=%s\n%s\nCreatedBy=canopentool dump\n\n", path, date);
+    fprintf(file, "[DeviceComissioning]\nNodeID=%d\n\n", worker->node_id);
+    write_object_list(file, worker, "MandatoryObjects", MANDATORY_OBJECTS);
+    write_object_list(file, worker, "OptionalObjects", OPTIONAL_OBJECTS);
+    write_object_list(file, worker, "ManufacturerObjects", MANUFACTURER_OBJECTS);
+
+    for (i = 0; i < worker->entry_count; i = j) {
+        const dump_entry_t* entry = &worker->entries[i];
+        size_t element_size = 0;
+        bool same_size = true;
+
+        /* entries i to j belong to the same index */
+        for (j = i + 1; j < worker->entry_count && worker->entries[j].index == entry->index; j++) {
+            if (element_size != 0 && worker->entries[j].size != element_size) {
+                same_size = false;
+            }
+            element_size = worker->entries[j].size;
+        }
+
+        fprintf(file, "[%04X]\nParameterName=Object %04X\n", entry->index, entry->index);
+        if (j == i + 1 && entry->subindex == 0) {
+            write_value(file, entry);
+            continue;
+        }
+        fprintf(file, "ObjectType=0x%X\nSubNumber=%zu\n\n", same_size ? 0x8 : 0x9, j - i);
+        for (; i < j; i++) {
+            entry = &worker->entries[i];
+            fprintf(file, "[%04Xsub%X]\nParameterName=%s\n", entry->index, entry->subindex,
+                    entry->subindex == 0 ? "Highest sub-index supported" : "Entry");
+            write_value(file, entry);
+        }
+    }
+    fclose(file);
+}
+
+/*
+ * Write node-<id>.dcf for every node that answered. Fails if any node did
+ * not answer or stopped answering before it was read completely.
+ */
+void dump(char* can_interface, const uint8_t* node_ids, int node_count) {
+    struct timespec now;
+    bool running;
+    bool all_complete = true;
+    int i;
+
+    loop = open_loop();
+    client = open_client(loop, can_interface);
+
+    for (i = 0; i < node_count; i++) {
+        dump_worker_t* worker;
+
+        if (workers[node_ids[i]] != NULL) {
+            continue;
+        }
+        if ((worker = calloc(1, sizeof(dump_worker_t))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        if ((worker->channel = canopen_client_channel(client, node_ids[i])) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        sdo_channel_set_retries(worker->channel, 0);
+        worker->node_id = node_ids[i];
+        worker->next_index = DUMP_FIRST_INDEX;
+        clock_gettime(CLOCK_MONOTONIC, &worker->started);
+        workers[node_ids[i]] = worker;
+    }
+    for (i = 0; i < 128; i++) {
+        if (workers[i] != NULL) {
+            refill(workers[i]);
+        }
+    }
+
+    do {
+        if (evloop_run_once(loop) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        running = false;
+        for (i = 0; i < 128; i++) {
+            running |= workers[i] != NULL && workers[i]->outstanding > 0;
+        }
+    } while (running);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < 128; i++) {
+        dump_worker_t* worker = workers[i];
+        sdo_channel_stats_t stats;
+        char path[32];
+        size_t j;
+
+        if (worker == NULL) {
+            continue;
+        }
+        if (worker->failed) {
+            fprintf(stderr, "node %d: no response\n", worker->node_id);
+            all_complete = false;
+        }
+        else {
+            if (worker->stalled) {
+                drop_timed_out_entries(worker);
+            }
+            snprintf(path, sizeof(path), "node-%d.dcf", worker->node_id);
+            write_dcf(worker, path);
+            printf("node %d: %zu entries in %.1f s, %s%s\n", worker->node_id,
+                    worker->entry_count, (now.tv_sec - worker->started.tv_sec)
+                    + (now.tv_nsec - worker->started.tv_nsec) / 1e9, path,
+                    worker->stalled ? " (partial, node stopped answering)" : "");
+            if (worker->stalled) {
+                all_complete = false;
+            }
+        }
+        sdo_channel_get_stats(worker->channel, &stats);
+        print_sdo_channel_stats(&stats);
+        for (j = 0; j < worker->entry_count; j++) {
+            free(worker->entries[j].data);
+        }
+        free(worker->entries);
+        while (worker->pending != NULL) {
+            dump_record_t* record = worker->pending;
+            worker->pending = record->next;
+            free(record);
+        }
+        free(worker);
+    }
+    canopen_client_close(client);
+    evloop_destroy(loop);
+    exit(all_complete ? EXIT_SUCCESS : EXIT_FAILURE);
+}
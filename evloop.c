@@ -0,0 +1,287 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "evloop.h"
+
+#define EVLOOP_MAX_EVENTS 32
+
+struct evloop_source {
+    int fd;
+    bool is_timer;
+    bool removed;
+    evloop_handler_t handler;
+    void* context;
+    evloop_handler_t writable_handler; /* NULL unless waiting for EPOLLOUT */
+    void* writable_context;
+    struct evloop_source* next;
+};
+
+struct evloop {
+    int epoll_fd;
+    bool stopped;
+    struct evloop_source* sources;
+};
+
+static void report_error(char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+evloop_t* evloop_create(void) {
+    evloop_t* loop = calloc(1, sizeof(evloop_t));
+    if (loop == NULL) {
+        report_error("out of memory\n");
+        return NULL;
+    }
+    if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        report_error("epoll_create1 failed: %s\n", strerror(errno));
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+int evloop_fileno(evloop_t* loop) {
+    return loop->epoll_fd;
+}
+
+static void free_removed_sources(evloop_t* loop) {
+    struct evloop_source** link = &loop->sources;
+    while (*link != NULL) {
+        struct evloop_source* source = *link;
+        if (source->removed) {
+            *link = source->next;
+            if (source->is_timer) {
+                close(source->fd);
+            }
+            free(source);
+        }
+        else {
+            link = &source->next;
+        }
+    }
+}
+
+void evloop_destroy(evloop_t* loop) {
+    struct evloop_source* source;
+    for (source = loop->sources; source != NULL; source = source->next) {
+        source->removed = true;
+    }
+    free_removed_sources(loop);
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+static struct evloop_source* add_source(evloop_t* loop, int fd, bool is_timer,
+        evloop_handler_t handler, void* context) {
+    struct evloop_source* source = calloc(1, sizeof(struct evloop_source));
+    if (source == NULL) {
+        report_error("out of memory\n");
+        return NULL;
+    }
+    source->fd = fd;
+    source->is_timer = is_timer;
+    source->handler = handler;
+    source->context = context;
+
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = source;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        report_error("epoll_ctl failed: %s\n", strerror(errno));
+        free(source);
+        return NULL;
+    }
+
+    source->next = loop->sources;
+    loop->sources = source;
+    return source;
+}
+
+/*
+ * Sources are only unlinked after the current dispatch round, because
+ * epoll may already have returned events that point at them.
+ */
+static void remove_source(evloop_t* loop, struct evloop_source* source) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+    source->removed = true;
+}
+
+bool evloop_add_fd(evloop_t* loop, int fd, evloop_handler_t handler, void* context) {
+    return add_source(loop, fd, false, handler, context) != NULL;
+}
+
+void evloop_remove_fd(evloop_t* loop, int fd) {
+    struct evloop_source* source;
+    for (source = loop->sources; source != NULL; source = source->next) {
+        if (!source->removed && !source->is_timer && source->fd == fd) {
+            remove_source(loop, source);
+        }
+    }
+}
+
+bool evloop_set_writable_handler(evloop_t* loop, int fd, evloop_handler_t handler,
+        void* context) {
+    struct evloop_source* source;
+    struct epoll_event event;
+
+    for (source = loop->sources; source != NULL; source = source->next) {
+        if (!source->removed && !source->is_timer && source->fd == fd) {
+            break;
+        }
+    }
+    if (source == NULL) {
+        report_error("no event source for fd %d\n", fd);
+        return false;
+    }
+
+    bzero(&event, sizeof(event));
+    event.events = handler != NULL ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = source;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        report_error("epoll_ctl failed: %s\n", strerror(errno));
+        return false;
+    }
+    source->writable_handler = handler;
+    source->writable_context = context;
+    return true;
+}
+
+evloop_timer_t* evloop_add_timer(evloop_t* loop, evloop_handler_t handler, void* context) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    evloop_timer_t* timer;
+
+    if (fd < 0) {
+        report_error("timerfd_create failed: %s\n", strerror(errno));
+        return NULL;
+    }
+    if ((timer = add_source(loop, fd, true, handler, context)) == NULL) {
+        close(fd);
+    }
+    return timer;
+}
+
+void evloop_remove_timer(evloop_t* loop, evloop_timer_t* timer) {
+    remove_source(loop, timer);
+}
+
+static void timespec_add_ms(struct timespec* ts, unsigned long ms) {
+    ts->tv_sec += ms / 1000UL;
+    ts->tv_nsec += (ms % 1000UL) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+void evloop_timer_arm(evloop_timer_t* timer, unsigned long delay_ms,
+        unsigned long interval_ms) {
+    struct itimerspec spec;
+    bzero(&spec, sizeof(spec));
+
+    if (clock_gettime(CLOCK_MONOTONIC, &spec.it_value) < 0) {
+        report_error("clock_gettime failed: %s\n", strerror(errno));
+        return;
+    }
+    timespec_add_ms(&spec.it_value, delay_ms);
+    timespec_add_ms(&spec.it_interval, interval_ms);
+
+    if (timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        report_error("timerfd_settime failed: %s\n", strerror(errno));
+    }
+}
+
+void evloop_timer_disarm(evloop_timer_t* timer) {
+    struct itimerspec spec;
+    bzero(&spec, sizeof(spec));
+    if (timerfd_settime(timer->fd, 0, &spec, NULL) < 0) {
+        report_error("timerfd_settime failed: %s\n", strerror(errno));
+    }
+}
+
+static int dispatch(evloop_t* loop, int timeout_ms) {
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+    int count;
+    int i;
+
+    do {
+        count = epoll_wait(loop->epoll_fd, events, EVLOOP_MAX_EVENTS, timeout_ms);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0) {
+        report_error("epoll_wait failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct evloop_source* source = events[i].data.ptr;
+        if (source->removed) {
+            continue;
+        }
+        if (source->is_timer) {
+            uint64_t expirations;
+            if (read(source->fd, &expirations, sizeof(expirations)) < 0) {
+                /* disarmed or re-armed by an earlier handler */
+                continue;
+            }
+        }
+        if (events[i].events & EPOLLOUT && source->writable_handler != NULL) {
+            source->writable_handler(source->writable_context);
+        }
+        if (events[i].events & ~EPOLLOUT && !source->removed) {
+            source->handler(source->context);
+        }
+    }
+
+    free_removed_sources(loop);
+    return count;
+}
+
+int evloop_run_once(evloop_t* loop) {
+    return dispatch(loop, -1);
+}
+
+int evloop_poll(evloop_t* loop) {
+    return dispatch(loop, 0);
+}
+
+bool evloop_run(evloop_t* loop) {
+    loop->stopped = false;
+    while (!loop->stopped) {
+        if (evloop_run_once(loop) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void evloop_stop(evloop_t* loop) {
+    loop->stopped = true;
+}
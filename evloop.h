@@ -0,0 +1,84 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVLOOP_H_
+#define EVLOOP_H_
+
+#include <stdbool.h>
+
+/*
+ * Event loop built on epoll. Every file descriptor and every timer is a
+ * registered event source, so waiting costs the same no matter how many
+ * sources exist. Timers are timerfds armed with absolute CLOCK_MONOTONIC
+ * deadlines; periodic timers do not drift with handler run time.
+ *
+ * A loop holds no global state, so every thread may run its own. Errors
+ * are described on stderr and returned, they never end the process.
+ */
+
+typedef struct evloop evloop_t;
+typedef struct evloop_source evloop_timer_t;
+typedef void (*evloop_handler_t)(void* context);
+
+/* returns NULL on failure */
+evloop_t* evloop_create(void);
+void evloop_destroy(evloop_t* loop);
+
+/*
+ * Readable while events are waiting, to embed the loop in another one
+ * that then calls evloop_poll().
+ */
+int evloop_fileno(evloop_t* loop);
+
+/* call handler whenever fd becomes readable, false on failure */
+bool evloop_add_fd(evloop_t* loop, int fd, evloop_handler_t handler, void* context);
+void evloop_remove_fd(evloop_t* loop, int fd);
+
+/*
+ * Also call handler whenever fd, added before, can be written to. A NULL
+ * handler stops that again. Returns false on failure.
+ */
+bool evloop_set_writable_handler(evloop_t* loop, int fd, evloop_handler_t handler,
+        void* context);
+
+/* timers are created disarmed, NULL on failure */
+evloop_timer_t* evloop_add_timer(evloop_t* loop, evloop_handler_t handler, void* context);
+void evloop_remove_timer(evloop_t* loop, evloop_timer_t* timer);
+
+/*
+ * Expire delay_ms from now, then every interval_ms (0 for a one-shot).
+ * Re-arming replaces the previous deadline.
+ */
+void evloop_timer_arm(evloop_timer_t* timer, unsigned long delay_ms,
+        unsigned long interval_ms);
+void evloop_timer_disarm(evloop_timer_t* timer);
+
+/*
+ * Wait for and dispatch one round of events, returns the number handled
+ * or -1 if waiting failed.
+ */
+int evloop_run_once(evloop_t* loop);
+
+/* like evloop_run_once(), but only dispatch events that are already waiting */
+int evloop_poll(evloop_t* loop);
+
+/*
+ * Dispatch events until evloop_stop() is called from a handler. Returns
+ * false if waiting failed.
+ */
+bool evloop_run(evloop_t* loop);
+void evloop_stop(evloop_t* loop);
+
+#endif /* EVLOOP_H_ */
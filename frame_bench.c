@@ -0,0 +1,230 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Decode cost per frame of canopen_frame.h on a mix of SDO, NMT,
+ * heartbeat, EMCY, SYNC and PDO frames, next to out-of-line decoders
+ * that take the frame by value as sdo.c used to. Both must agree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "canopen_frame.h"
+
+#define FRAME_COUNT 4096
+#define MIN_SECONDS 0.5
+
+typedef uint32_t (*decode_function_t)(const struct canfd_frame*);
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t decode_inline(const struct canfd_frame* frame) {
+    uint8_t node_id;
+    bool transmit;
+    int number;
+
+    if ((node_id = sdo_response_node(frame)) != 0) {
+        if (sdo_cs(frame) == 2 && sdo_e(frame)) {
+            return node_id + sdo_index(frame) + sdo_subindex(frame)
+                    + (sdo_s(frame) ? 4 - sdo_n(frame) : 4) + sdo_data32(frame);
+        }
+        if (sdo_cs(frame) == 0) {
+            return node_id + sdo_t(frame) + sdo_segment_n(frame) + sdo_c(frame);
+        }
+        return node_id + sdo_cs(frame) + sdo_data32(frame);
+    }
+    if (is_nmt_command(frame)) {
+        return nmt_command_specifier(frame) + nmt_node_id(frame);
+    }
+    if ((node_id = heartbeat_node_id(frame)) != 0) {
+        return node_id + heartbeat_state(frame);
+    }
+    if (is_sync(frame)) {
+        return sync_counter(frame);
+    }
+    if ((node_id = emcy_node_id(frame)) != 0) {
+        return node_id + emcy_error_code(frame) + emcy_error_register(frame);
+    }
+    if ((number = pdo_number(frame, &transmit)) != 0) {
+        return pdo_node_id(frame) + number + transmit + frame_u32(frame, 0);
+    }
+    return 0;
+}
+
+/* the decoders as they were before canopen_frame.h */
+
+static __attribute__((noipa)) int by_value_cs(struct canfd_frame frame) {
+    return frame.data[0] >> 5 & 0x7;
+}
+
+static __attribute__((noipa)) int by_value_n(struct canfd_frame frame) {
+    return frame.data[0] >> 2 & 0x3;
+}
+
+static __attribute__((noipa)) int by_value_segment_n(struct canfd_frame frame) {
+    return frame.data[0] >> 1 & 0x7;
+}
+
+static __attribute__((noipa)) int by_value_e(struct canfd_frame frame) {
+    return frame.data[0] >> 1 & 0x1;
+}
+
+static __attribute__((noipa)) int by_value_s(struct canfd_frame frame) {
+    return frame.data[0] & 0x1;
+}
+
+static __attribute__((noipa)) int by_value_t(struct canfd_frame frame) {
+    return frame.data[0] >> 4 & 0x1;
+}
+
+static __attribute__((noipa)) uint32_t by_value_data32(struct canfd_frame frame) {
+    return frame.data[4] | frame.data[5] << 8 | frame.data[6] << 16
+            | (uint32_t) frame.data[7] << 24;
+}
+
+static uint32_t decode_by_value(const struct canfd_frame* frame) {
+    canid_t id = frame->can_id;
+    uint8_t node_id = id & 0x7F;
+
+    if (id > 0x580 && id <= 0x5FF && frame->len == 8) {
+        if (by_value_cs(*frame) == 2 && by_value_e(*frame)) {
+            return node_id + (frame->data[1] | frame->data[2] << 8) + frame->data[3]
+                    + (by_value_s(*frame) ? 4 - by_value_n(*frame) : 4)
+                    + by_value_data32(*frame);
+        }
+        if (by_value_cs(*frame) == 0) {
+            return node_id + by_value_t(*frame) + by_value_segment_n(*frame)
+                    + by_value_s(*frame);
+        }
+        return node_id + by_value_cs(*frame) + by_value_data32(*frame);
+    }
+    if (id == 0 && frame->len == 2) {
+        return frame->data[0] + frame->data[1];
+    }
+    if (id > 0x700 && id <= 0x77F && frame->len == 1) {
+        return node_id + (frame->data[0] & 0x7F);
+    }
+    if (id == 0x080 && frame->len <= 1) {
+        return frame->len == 1 ? frame->data[0] : 0;
+    }
+    if (id > 0x080 && id <= 0x0FF && frame->len == 8) {
+        return node_id + (frame->data[0] | frame->data[1] << 8) + frame->data[2];
+    }
+    if (id >= 0x181 && id <= 0x57F && node_id != 0) {
+        return node_id + ((id & 0x780) - 0x180) / 0x100 + 1 + ((id & 0x80) != 0)
+                + (frame->data[0] | frame->data[1] << 8 | frame->data[2] << 16
+                        | (uint32_t) frame->data[3] << 24);
+    }
+    return 0;
+}
+
+static void fill(struct canfd_frame* frames, int count) {
+    static const canid_t pdo_bases[] = { 0x180, 0x200, 0x280, 0x300, 0x380, 0x400, 0x480, 0x500 };
+    int i, j;
+
+    for (i = 0; i < count; i++) {
+        struct canfd_frame* frame = &frames[i];
+        uint8_t node_id = 1 + rand() % 127;
+
+        switch (rand() % 8) {
+        case 0:
+            frame_init(frame, COB_SDO_TX + node_id, 8);
+            break;
+        case 1: /* segments */
+            frame_init(frame, COB_SDO_TX + node_id, 8);
+            for (j = 0; j < 8; j++) {
+                frame->data[j] = rand();
+            }
+            frame->data[0] &= 0x1F;
+            continue;
+        case 2:
+            nmt_encode(frame, 1, rand() % 128);
+            continue;
+        case 3:
+            heartbeat_encode(frame, node_id, NMT_STATE_OPERATIONAL);
+            continue;
+        case 4:
+            frame_init(frame, COB_SYNC, rand() % 2);
+            break;
+        case 5:
+            frame_init(frame, COB_EMCY + node_id, 8);
+            break;
+        default:
+            frame_init(frame, pdo_bases[rand() % 8] + node_id, 8);
+            break;
+        }
+        for (j = 0; j < frame->len; j++) {
+            frame->data[j] = rand();
+        }
+    }
+}
+
+static int compare_can_id(const void* a, const void* b) {
+    const struct canfd_frame* frame_a = a;
+    const struct canfd_frame* frame_b = b;
+    return (frame_a->can_id > frame_b->can_id) - (frame_a->can_id < frame_b->can_id);
+}
+
+static void measure(const char* name, const char* order, decode_function_t decode_frame,
+        const struct canfd_frame* frames) {
+    double started = now(), elapsed;
+    unsigned long rounds = 0;
+    volatile uint32_t sum = 0;
+    int i;
+
+    do {
+        for (i = 0; i < FRAME_COUNT; i++) {
+            sum += decode_frame(&frames[i]);
+        }
+        rounds++;
+    } while ((elapsed = now() - started) < MIN_SECONDS);
+
+    printf("%-9s %-7s %6.2f ns/frame\n", name, order, elapsed / (rounds * FRAME_COUNT) * 1e9);
+}
+
+int main(void) {
+    struct canfd_frame* frames = malloc(FRAME_COUNT * sizeof(struct canfd_frame));
+    int i;
+
+    if (frames == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    fill(frames, FRAME_COUNT);
+
+    for (i = 0; i < FRAME_COUNT; i++) {
+        if (decode_inline(&frames[i]) != decode_by_value(&frames[i])) {
+            fprintf(stderr, "frame 0x%03X decoded differently\n", frames[i].can_id);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* sorted by COB-ID the branches are predicted and only decoding is left */
+    measure("inline", "mixed", decode_inline, frames);
+    measure("by value", "mixed", decode_by_value, frames);
+    qsort(frames, FRAME_COUNT, sizeof(struct canfd_frame), compare_can_id);
+    measure("inline", "sorted", decode_inline, frames);
+    measure("by value", "sorted", decode_by_value, frames);
+    free(frames);
+    return 0;
+}
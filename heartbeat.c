@@ -12,15 +12,18 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stdbool.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -29,15 +32,20 @@
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
-#include <string.h>
 
 #include <curses.h>
 
+#include "transport.h"
+#include "evloop.h"
+#include "busload.h"
+#include "canopen_frame.h"
+
 #define REFRESH_TIME           500 /* milliseconds */
 #define HEARTBEAT_FAILURE_TIME 2000 /* milliseconds */
 #define BOOTUP_BLIP_TIME       1000
 #define BOOTUP_SHOW_TIME       30000
 #define MAX_NODEID             127
+#define MAX_NETWORKS           8
 
 #define COLOR_DOWN            1
 #define COLOR_DOWN_IRRELEVANT 2
@@ -55,15 +63,48 @@ typedef struct {
     long total;
 } packets_t;
 
-static int can_fd = 0;
+typedef struct {
+    struct timespec timestamp; /* CLOCK_MONOTONIC */
+    unsigned char state;
+} heartbeat_t;
+
+/*
+ * One monitored CAN network. The receive thread owns the socket and
+ * updates heartbeats, packets and busload under the lock, everything else
+ * belongs to the display thread.
+ */
+typedef struct {
+    char* interface_name;
+    transport_t* can;
+    pthread_t receiver;
+    pthread_mutex_t lock;
+    heartbeat_t heartbeats[MAX_NODEID + 1];
+    packets_t packets;
+    busload_t busload;
+    bool node_present[MAX_NODEID + 1];
+} network_t;
 
+static network_t networks[MAX_NETWORKS];
+static int network_count = 0;
+static int selected = 0;
+
+static struct timespec start;
+static struct timespec now;
+static struct timespec before;
+static int maxx, maxy;
+static enum {
+    MODE_PACKETRATE, MODE_LEGEND
+} mode = MODE_PACKETRATE;
+static bool hex = true;
+
+static evloop_t* loop;
+static evloop_timer_t* refresh_timer;
+
+/* the CAN sockets are closed by exit() */
 void exit_success(char* format, ...) {
     va_list args;
     va_start(args, format);
     endwin();
-    if (can_fd > 0) {
-        close(can_fd);
-    }
     vprintf(format, args);
     exit(EXIT_SUCCESS);
 }
@@ -72,9 +113,6 @@ void exit_failure_with_help(char* format, ...) {
     va_list args;
     va_start(args, format);
     endwin();
-    if (can_fd > 0) {
-        close(can_fd);
-    }
     vfprintf(stderr, format, args);
     exit(EXIT_FAILURE);
 }
@@ -88,99 +126,517 @@ void sighandler(int signal) {
     }
 }
 
-void heartbeat(char* can_interface) {
-    struct ifreq ifr;
-    struct sockaddr_can addr;
-
-    struct can_frame rx;
-    fd_set can_fdset;
-    struct timeval timeout;
-    struct heartbeat_t {
-        struct timeval timestamp;
-        unsigned char state;
-    } heartbeat[MAX_NODEID + 1];
-    struct timeval start;
-    struct timeval now;
-    struct timeval before;
+/*
+ * true if any node of the network would be shown as a failure
+ */
+static bool network_has_failure(network_t* network, double ms_now) {
+    bool failure = false;
     int nodeid;
-    int maxx, maxy;
+
+    pthread_mutex_lock(&network->lock);
+    for (nodeid = 1; nodeid <= MAX_NODEID && !failure; nodeid++) {
+        heartbeat_t* heartbeat = &network->heartbeats[nodeid];
+        double last_seen = ms_now
+                - ((double) heartbeat->timestamp.tv_sec * 1000.0
+                + (double) heartbeat->timestamp.tv_nsec / 1000000.0);
+        if (last_seen < BOOTUP_SHOW_TIME && heartbeat->state == 0) {
+            continue;
+        }
+        if (last_seen < HEARTBEAT_FAILURE_TIME) {
+            failure = heartbeat->state != 4 && heartbeat->state != 5
+                    && heartbeat->state != 127;
+        }
+        else {
+            failure = network->node_present[nodeid];
+        }
+    }
+    pthread_mutex_unlock(&network->lock);
+    return failure;
+}
+
+static void draw_screen(void) {
+    network_t* network = &networks[selected];
+    heartbeat_t heartbeats[MAX_NODEID + 1];
     packets_t packets;
-    enum {
-        MODE_PACKETRATE, MODE_LEGEND
-    } mode = MODE_PACKETRATE;
-    bool hex = true;
-    bool node_present[MAX_NODEID + 1];
+    busload_window_t load_1s, load_10s, load_60s;
+    bus_state_t bus_state;
+    int rx_errors, tx_errors;
+    bool* node_present = network->node_present;
+    int nodeid;
+    int i;
 
-    for (nodeid = 1; nodeid <= MAX_NODEID; nodeid++) {
-        node_present[nodeid] = false;
+    /*
+     * get actual time
+     */
+    memcpy(&before, &now, sizeof(now));
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+        exit_failure_with_help("clock_gettime(): %s\n", strerror(errno));
     }
 
+    pthread_mutex_lock(&network->lock);
+    memcpy(heartbeats, network->heartbeats, sizeof(heartbeats));
+    packets = network->packets;
+    busload_window(&network->busload, &now, 1000, &load_1s);
+    busload_window(&network->busload, &now, 10000, &load_10s);
+    busload_window(&network->busload, &now, 60000, &load_60s);
+    bus_state = network->busload.state;
+    rx_errors = network->busload.rx_errors;
+    tx_errors = network->busload.tx_errors;
+    pthread_mutex_unlock(&network->lock);
+
     /*
-     * read /etc/canopen/managers.conf
+     * ncurses box, the title lists all networks; failing ones are red and
+     * the one shown below is highlighted
+     */erase();
+    box(stdscr, 0, 0);
+    attrset(A_BOLD);
+    mvprintw(0, 3, " CANopen -");
+    for (i = 0; i < network_count; i++) {
+        double ms_now = (double) now.tv_sec * 1000.0
+                + (double) now.tv_nsec / 1000000.0;
+        printw(" ");
+        if (network_has_failure(&networks[i], ms_now)) {
+            attrset(COLOR_PAIR(COLOR_DOWN) | A_BOLD);
+        }
+        if (i == selected && network_count > 1) {
+            attron(A_REVERSE);
+        }
+        printw("%s", networks[i].interface_name);
+        attrset(A_BOLD);
+    }
+    printw(" ");
+    attrset(A_NORMAL);
+
+    /*
+     * show status of heartbeat messages
      */
     {
-        FILE* f;
-        char line[128];
+#define ITEMSIZE 9
+#define XITEMS   8
+#define XBEGIN   4
+#define YBEGIN   2
 
-        if ((f = fopen("/etc/canopen/managers.conf", "r")) == NULL ) {
-            /* file not exists */
-            for (nodeid = 1; nodeid <= MAX_NODEID; nodeid++) {
-                node_present[nodeid] = true;
+        int nodes_boot = 0;
+        int nodes_stopped = 0;
+        int nodes_operational = 0;
+        int nodes_preoperational = 0;
+        int nodes_failure = 0;
+
+        int x, y;
+
+        for (nodeid = 1; nodeid <= MAX_NODEID; nodeid++) {
+            double ms_last = (double) heartbeats[nodeid].timestamp.tv_sec
+                    * 1000.0
+                    + (double) heartbeats[nodeid].timestamp.tv_nsec / 1000000.0;
+            double ms_now = (double) now.tv_sec * 1000.0
+                    + (double) now.tv_nsec / 1000000.0;
+            double last_seen = ms_now - ms_last;
+            y = nodeid / XITEMS + YBEGIN;
+            x = nodeid % XITEMS * ITEMSIZE + XBEGIN;
+            char* format = hex ? " %02X:%s" : "%3d:%s";
+            if (last_seen < BOOTUP_BLIP_TIME
+                    && heartbeats[nodeid].state == 0) {
+                attrset(COLOR_PAIR(COLOR_BOOTUP_BLIP));
+                mvprintw(y, x, format, nodeid, "BOOT");
+                nodes_boot++;
+            }
+            else if (last_seen < BOOTUP_SHOW_TIME
+                    && heartbeats[nodeid].state == 0) {
+                attrset(COLOR_PAIR(COLOR_BOOTUP));
+                mvprintw(y, x, format, nodeid, "BOOT");
+                nodes_boot++;
+            }
+            else if (last_seen < HEARTBEAT_FAILURE_TIME
+                    && heartbeats[nodeid].state == 4) {
+                attrset(COLOR_PAIR(COLOR_STOPPED));
+                mvprintw(y, x, format, nodeid, "STOP");
+                nodes_stopped++;
+            }
+            else if (last_seen < HEARTBEAT_FAILURE_TIME
+                    && heartbeats[nodeid].state == 5) {
+                attrset(COLOR_PAIR(COLOR_OPERATIONAL));
+                mvprintw(y, x, format, nodeid, "OPER");
+                nodes_operational++;
+            }
+            else if (last_seen < HEARTBEAT_FAILURE_TIME
+                    && heartbeats[nodeid].state == 127) {
+                attrset(COLOR_PAIR(COLOR_PREOPERATIONAL));
+                mvprintw(y, x, format, nodeid, "PRE ");
+                nodes_preoperational++;
+            }
+            else if (last_seen < HEARTBEAT_FAILURE_TIME) { /* unknown state */
+                attrset(COLOR_PAIR(COLOR_ERROR));
+                mvprintw(y, x, format, nodeid, "####");
+                nodes_failure++;
+            }
+            else if (node_present[nodeid]) {
+                attrset(COLOR_PAIR(COLOR_DOWN));
+                mvprintw(y, x, format, nodeid, "UNKN");
+                nodes_failure++;
+            }
+            else {
+                attrset(COLOR_PAIR(COLOR_DOWN_IRRELEVANT));
+                mvprintw(y, x, format, nodeid, "UNKN");
             }
         }
+
+        x = maxx - 18;
+        y = maxy - 1;
+        attrset(A_BOLD);
+        mvprintw(y, x - 1, "    /   /   /    ");
+        attrset(COLOR_PAIR(COLOR_OPERATIONAL));
+        mvprintw(y, x + 0, "%03d", nodes_operational);
+        attrset(COLOR_PAIR(COLOR_PREOPERATIONAL));
+        mvprintw(y, x + 4, "%03d", nodes_preoperational);
+        attrset(COLOR_PAIR(COLOR_STOPPED));
+        mvprintw(y, x + 8, "%03d", nodes_stopped);
+        attrset(COLOR_PAIR(COLOR_DOWN));
+        mvprintw(y, x + 12, "%03d", nodes_failure);
+        attrset(A_NORMAL);
+
+    }
+
+    /*
+     * CAN status: error counters, bus errors of the last 10 s and the
+     * controller state, all from error frames
+     */
+    {
+        int x = 3;
+        int y = maxy - 1;
+
+        attrset(A_BOLD);
+        mvprintw(y, x - 1, "    /   /    ");
+        attrset(rx_errors >= CAN_ERROR_WARNING_THRESHOLD ? COLOR_PAIR(COLOR_ERROR) : A_NORMAL);
+        mvprintw(y, x + 0, "%03d", rx_errors);
+        attrset(tx_errors >= CAN_ERROR_WARNING_THRESHOLD ? COLOR_PAIR(COLOR_ERROR) : A_NORMAL);
+        mvprintw(y, x + 4, "%03d", tx_errors);
+        attrset(load_10s.error_frames > 0 ? COLOR_PAIR(COLOR_ERROR) : A_NORMAL);
+        mvprintw(y, x + 8, "%03d", load_10s.error_frames > 999 ? 999 : load_10s.error_frames);
+        attrset(A_NORMAL);
+
+        if (bus_state != BUS_ERROR_ACTIVE) {
+            attrset(COLOR_PAIR(COLOR_ERROR));
+            mvprintw(y, x + 14, "%s", bus_state == BUS_OFF ? "BUSOFF"
+                    : bus_state == BUS_ERROR_PASSIVE ? "PASSIVE" : "WARNING");
+            attrset(A_NORMAL);
+        }
+    }
+#define BIG 30
+#define SMALL 24
+    if (maxy > SMALL) {
+        /*
+         * Legend
+         */
+        if (mode == MODE_LEGEND || maxy >= BIG) {
+#define LEGEND_X1 10
+#define LEGEND_Y 19
+#define LEGEND_X2 (LEGEND_X1 + 30)
+            attrset(COLOR_PAIR(COLOR_OPERATIONAL));
+            mvprintw(LEGEND_Y + 0, LEGEND_X1, "OPER");
+            attrset(A_NORMAL);
+            mvprintw(LEGEND_Y + 0, LEGEND_X1 + 4, " - operational");
+            attrset(COLOR_PAIR(COLOR_PREOPERATIONAL));
+            mvprintw(LEGEND_Y + 1, LEGEND_X1, "PRE ");
+            attrset(A_NORMAL);
+            mvprintw(LEGEND_Y + 1, LEGEND_X1 + 4, " - pre-operational");
+            attrset(COLOR_PAIR(COLOR_BOOTUP));
+            mvprintw(LEGEND_Y + 2, LEGEND_X1, "BOOT");
+            attrset(A_NORMAL);
+            mvprintw(LEGEND_Y + 2, LEGEND_X1 + 4, " - bootup node");
+            attrset(COLOR_PAIR(COLOR_STOPPED));
+            mvprintw(LEGEND_Y + 0, LEGEND_X2, "STOP");
+            attrset(A_NORMAL);
+            mvprintw(LEGEND_Y + 0, LEGEND_X2 + 4, " - stopped");
+            attrset(COLOR_PAIR(COLOR_ERROR));
+            mvprintw(LEGEND_Y + 1, LEGEND_X2, "####");
+            attrset(A_NORMAL);
+            mvprintw(LEGEND_Y + 1, LEGEND_X2 + 4, " - invalid NMT state");
+            attrset(COLOR_PAIR(COLOR_DOWN));
+            mvprintw(LEGEND_Y + 2, LEGEND_X2, "UNKN");
+            attrset(A_NORMAL);
+            mvprintw(LEGEND_Y + 2, LEGEND_X2 + 4, " - heartbeat failure");
+        }
+
+        /*
+         * packet rate indicator
+         */
+        if (mode == MODE_PACKETRATE || maxy >= BIG) {
+#define RATE_X 4
+#define RATE_Y_SMALL 19
+#define RATE_Y_BIG 24
+            int RATE_Y = maxy >= BIG ? RATE_Y_BIG : RATE_Y_SMALL;
+            char* format =
+                    "%-8s %12ld packets, %8.0f packets/s, %6.1f kBit/s";
+            static const struct {
+                char* label;
+                busload_class_t class;
+            } rows[] = {
+                { "PDO:", BUSLOAD_PDO },
+                { "SDO:", BUSLOAD_SDO },
+                { "NMT:", BUSLOAD_NMT }
+            };
+            long counts[] = { packets.pdo, packets.sdo, packets.nmt };
+
+            for (i = 0; i < 3; i++) {
+                mvprintw(RATE_Y + i, RATE_X, format, rows[i].label, counts[i],
+                        load_1s.frames[rows[i].class] / load_1s.seconds,
+                        load_1s.bits[rows[i].class] / load_1s.seconds / 1024.0);
+                if (load_1s.load[rows[i].class] >= 0.0) {
+                    printw(", %5.1f%%", load_1s.load[rows[i].class] * 100.0);
+                }
+            }
+            mvprintw(RATE_Y + 3, RATE_X, format, "total:", packets.total,
+                    load_1s.total_frames / load_1s.seconds,
+                    load_1s.total_bits / load_1s.seconds / 1024.0);
+            if (load_1s.total_load >= 0.0) {
+                printw(", %5.1f%%", load_1s.total_load * 100.0);
+                mvprintw(RATE_Y + 4, RATE_X,
+                        "bus load %5.1f%% 1s, %5.1f%% 10s, %5.1f%% 60s",
+                        load_1s.total_load * 100.0, load_10s.total_load * 100.0,
+                        load_60s.total_load * 100.0);
+            }
+            else {
+                mvprintw(RATE_Y + 4, RATE_X, "bus load unknown, bit rate not configured");
+            }
+        }
+    }
+
+    /*
+     * rotating indicator
+     */
+    {
+        static int counter = 0;
+        char indicator[] = "|/-\\";
+        mvprintw(0, 0, "%c", indicator[counter]);
+        counter = counter < 2 ? counter + 1 : 0;
+    }
+
+    /*
+     * refresh curses screen
+     */
+    refresh();
+}
+
+static void on_can_readable(void* context) {
+    network_t* network = context;
+    struct canfd_frame rx_frames[TRANSPORT_BATCH_SIZE];
+    transport_timestamp_t rx_timestamps[TRANSPORT_BATCH_SIZE];
+    int rx_count;
+    int nodeid;
+    bool transmit;
+    int i;
+
+    rx_count = transport_read_batch(network->can, rx_frames, rx_timestamps,
+            TRANSPORT_BATCH_SIZE);
+    if (rx_count < 0) {
+        exit_failure_with_help("%s: receiving failed\n", network->interface_name);
+    }
+
+    pthread_mutex_lock(&network->lock);
+    for (i = 0; i < rx_count; i++) {
+        struct canfd_frame* rx = &rx_frames[i];
+        busload_class_t class = BUSLOAD_OTHER;
+        if (rx->can_id & CAN_ERR_FLAG) {
+            busload_add_frame(&network->busload, rx, &rx_timestamps[i].monotonic,
+                    class);
+            continue;
+        }
+        network->packets.total++;
+        if ((nodeid = heartbeat_node_id(rx)) != 0) {
+            network->heartbeats[nodeid].timestamp = rx_timestamps[i].monotonic;
+            network->heartbeats[nodeid].state = heartbeat_state(rx);
+            network->packets.nmt++;
+            class = BUSLOAD_NMT;
+        }
+        else if (rx->can_id == COB_NMT) {
+            network->packets.nmt++;
+            class = BUSLOAD_NMT;
+        }
+        else if (cob_node_id(rx, COB_SDO_TX) || cob_node_id(rx, COB_SDO_RX)) {
+            network->packets.sdo++;
+            class = BUSLOAD_SDO;
+        }
+        else if (pdo_number(rx, &transmit) != 0) {
+            network->packets.pdo++;
+            class = BUSLOAD_PDO;
+        }
+        busload_add_frame(&network->busload, rx, &rx_timestamps[i].monotonic, class);
+    }
+    pthread_mutex_unlock(&network->lock);
+}
+
+/*
+ * receive thread, one per network
+ */
+static void* receive_frames(void* context) {
+    network_t* network = context;
+    evloop_t* receive_loop = evloop_create();
+
+    if (receive_loop == NULL
+            || !evloop_add_fd(receive_loop, transport_fileno(network->can),
+                    on_can_readable, network)
+            || !evloop_run(receive_loop)) {
+        exit_failure_with_help("%s: receiving failed\n", network->interface_name);
+    }
+    return NULL;
+}
+
+static void on_keyboard(void* context) {
+    network_t* network = &networks[selected];
+    int key = getch();
+
+    (void) context;
+    switch (key) {
+    case 'q':
+    case 'Q':
+    case 'x':
+    case 'X':
+        exit_success("thanks for using heartbeat\n");
+        break;
+    case 'l':
+        if (mode == MODE_LEGEND) {
+            mode = MODE_PACKETRATE;
+        }
         else {
-            char nodelist_filename[256] = "";
-            while (fgets(line, sizeof(line), f) != NULL) {
-                char* interface = strtok(line, " \t");
-                char* baudrate = strtok(NULL, " \t");
-                char* nodeid = strtok(NULL, " \t");
-                char* networkname = strtok(NULL, "\n");
+            mode = MODE_LEGEND;
+        }
+        break;
+    case 'c':
+        pthread_mutex_lock(&network->lock);
+        bzero(&network->heartbeats, sizeof(network->heartbeats));
+        bzero(&network->packets, sizeof(network->packets));
+        bzero(&network->busload.buckets, sizeof(network->busload.buckets));
+        pthread_mutex_unlock(&network->lock);
+        break;
+    case ' ':
+        hex = !hex;
+        break;
+    case '\t':
+    case KEY_RIGHT:
+        selected = (selected + 1) % network_count;
+        break;
+    case KEY_BTAB:
+    case KEY_LEFT:
+        selected = (selected + network_count - 1) % network_count;
+        break;
+    }
+    draw_screen();
+}
+
+static void on_refresh(void* context) {
+    (void) context;
+    draw_screen();
+}
+
+/*
+ * read /etc/canopen/managers.conf once and the nodelist of every network
+ * listed there; nodes of unlisted networks are all considered present
+ */
+static void read_node_lists(void) {
+    char nodelist_filename[MAX_NETWORKS][256];
+    FILE* f;
+    char line[128];
+    int nodeid;
+    int i;
+
+    for (i = 0; i < network_count; i++) {
+        nodelist_filename[i][0] = '\0';
+    }
 
+    if ((f = fopen("/etc/canopen/managers.conf", "r")) != NULL ) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            char* interface = strtok(line, " \t");
+            char* baudrate = strtok(NULL, " \t");
+            char* networkname;
+
+            strtok(NULL, " \t"); /* node id */
+            networkname = strtok(NULL, "\n");
+
+            for (i = 0; i < network_count; i++) {
                 if (interface != NULL && networkname != NULL
-                        && !strcmp(interface, can_interface)) {
-                    snprintf(nodelist_filename, sizeof(nodelist_filename),
+                        && nodelist_filename[i][0] == '\0'
+                        && !strcmp(interface, networks[i].interface_name)) {
+                    snprintf(nodelist_filename[i], sizeof(nodelist_filename[i]),
                             "/etc/canopen/%s/nodelist.cpj", networkname);
-                    break;
+
+                    /* the interface knows better, if it can tell */
+                    long bitrate = strtol(baudrate, NULL, 0);
+                    if (networks[i].busload.nominal_bitrate == 0 && bitrate > 0) {
+                        networks[i].busload.nominal_bitrate =
+                                bitrate < 10000 ? bitrate * 1000 : bitrate;
+                    }
                 }
             }
-            fclose(f);
+        }
+        fclose(f);
+    }
+
+    for (i = 0; i < network_count; i++) {
+        bool* node_present = networks[i].node_present;
 
-            if ((f = fopen(nodelist_filename, "r")) != NULL ) {
-                while (fgets(line, sizeof(line), f) != NULL ) {
-                    char* key = strtok(line, "=");
-                    char* value = strtok(NULL, "\n");
-                    for (nodeid = 1; nodeid <= MAX_NODEID; nodeid++) {
-                        char key_cmp[128];
-                        sprintf(key_cmp, "Node%dPresent", nodeid);
-                        if (strcasestr(key, key_cmp) != NULL ) {
-                            if (strtol(value, NULL, 0) == 0x01) {
-                                node_present[nodeid] = true;
-                            }
+        if ((f = fopen(nodelist_filename[i], "r")) != NULL ) {
+            while (fgets(line, sizeof(line), f) != NULL ) {
+                char* key = strtok(line, "=");
+                char* value = strtok(NULL, "\n");
+                for (nodeid = 1; nodeid <= MAX_NODEID; nodeid++) {
+                    char key_cmp[128];
+                    sprintf(key_cmp, "Node%dPresent", nodeid);
+                    if (strcasestr(key, key_cmp) != NULL ) {
+                        if (strtol(value, NULL, 0) == 0x01) {
+                            node_present[nodeid] = true;
                         }
                     }
                 }
-                fclose(f);
             }
-            else {
-                /* file not exists */
-                for (nodeid = 1; nodeid <= MAX_NODEID; nodeid++) {
-                    node_present[nodeid] = true;
-                }
+            fclose(f);
+        }
+        else {
+            /* file not exists */
+            for (nodeid = 1; nodeid <= MAX_NODEID; nodeid++) {
+                node_present[nodeid] = true;
             }
         }
     }
+}
+
+void heartbeat(char** can_interfaces, int count) {
+    int nodeid;
+    int i;
+
+    if (count > MAX_NETWORKS) {
+        exit_failure_with_help("at most %d networks can be monitored\n", MAX_NETWORKS);
+    }
 
     /*
-     * initialize CAN interface
+     * initialize CAN interfaces
      */
-    if (strspn(can_interface, "0123456789") == strlen(can_interface)) {
-        const int new_can_interface_size = 50;
-        char* new_can_interface = malloc(new_can_interface_size);
-        snprintf(new_can_interface, new_can_interface_size,
-                "can%d", atol(can_interface) - 1);
-        can_interface = new_can_interface;
+    for (i = 0; i < count; i++) {
+        network_t* network = &networks[network_count++];
+        char* can_interface = can_interfaces[i];
+
+        if (strspn(can_interface, "0123456789") == strlen(can_interface)) {
+            const int new_can_interface_size = 50;
+            char* new_can_interface = malloc(new_can_interface_size);
+            if (new_can_interface == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            snprintf(new_can_interface, new_can_interface_size,
+                    "can%ld", atol(can_interface) - 1);
+            can_interface = new_can_interface;
+        }
+        network->interface_name = can_interface;
+        if ((network->can = transport_open(can_interface)) == NULL
+                || !transport_set_error_mask(network->can, CAN_ERR_MASK)) {
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&network->lock, NULL);
+        busload_init(&network->busload);
+        busload_query_bitrate(can_interface, &network->busload.nominal_bitrate,
+                &network->busload.data_bitrate);
     }
-    can_fd = socketcan_open(can_interface);
+
+    read_node_lists();
 
     /*
      * initialize ncurses
@@ -218,334 +674,44 @@ void heartbeat(char* can_interface) {
     /*
      * initialize data structures
      */
-    for (nodeid = 1; nodeid <= MAX_NODEID; nodeid++) {
-        heartbeat[nodeid].state = -1;
-        timerclear(&heartbeat[nodeid].timestamp);
+    for (i = 0; i < network_count; i++) {
+        for (nodeid = 1; nodeid <= MAX_NODEID; nodeid++) {
+            networks[i].heartbeats[nodeid].state = -1;
+            networks[i].heartbeats[nodeid].timestamp.tv_sec = 0;
+            networks[i].heartbeats[nodeid].timestamp.tv_nsec = 0;
+        }
     }
-    if (gettimeofday(&start, NULL ) < 0) {
-        exit_failure_with_help("gettimeofday(): %s", strerror(errno));
+    if (clock_gettime(CLOCK_MONOTONIC, &start) < 0) {
+        exit_failure_with_help("clock_gettime(): %s", strerror(errno));
     }
-    bzero(&packets, sizeof(packets));
 
     /*
-     * main loop
+     * one receive thread per network, the signals go to the display thread
      */
-    while (true) {
-        FD_ZERO(&can_fdset);
-        FD_SET(can_fd, &can_fdset);
-        FD_SET(0, &can_fdset);
-        timeout.tv_sec = 0;
-        timeout.tv_usec = REFRESH_TIME * 1000;
-
-        /*
-         * wait for can frame, keyboard or timeout
-         */
-        if (select(FD_SETSIZE, &can_fdset, NULL, NULL, &timeout) < 0) {
-            exit_failure_with_help("select(): %s\n", strerror(errno));
-        }
-
-        /*
-         * CAN frame received
-         */
-        if (FD_ISSET(can_fd, &can_fdset)) { /* received packet */
-            bzero(&rx, sizeof(rx));
-            if (read(can_fd, &rx, sizeof(rx)) < 0) {
-                exit_failure_with_help("read(): %s\n", strerror(errno));
-            }
-            packets.total++;
-            if (rx.can_id > 0x700 && rx.can_id <= 0x700 + MAX_NODEID
-                    && rx.can_dlc == 1) { /* heartbeat message */
-                nodeid = rx.can_id - 0x700;
-                if (ioctl(can_fd, SIOCGSTAMP, &heartbeat[nodeid].timestamp)
-                        < 0) {
-                    exit_failure_with_help("%s:%d ioctl error: %s", __FILE__, __LINE__, strerror(errno));
-                }
-                heartbeat[nodeid].state = rx.data[0] & 0x7F;
-                packets.nmt++;
-            }
-            if (rx.can_id == 0) {
-                packets.nmt++;
-            }
-            if (rx.can_id > 0x580 && rx.can_id <= 0x67f) { /* SDO */
-                packets.sdo++;
-            }
-            if (rx.can_id > 0x180 && rx.can_id <= 0x57f) { /* PDO */
-                packets.pdo++;
-            }
-        }
-
-        /*
-         * keyboard input received
-         */
-        if (FD_ISSET(0, &can_fdset)) { /* keyboard */
-            int key = getch();
-            switch (key) {
-            case 'q':
-            case 'Q':
-            case 'x':
-            case 'X':
-                exit_success("thanks for using heartbeat\n");
-                break;
-            case 'l':
-                if (mode == MODE_LEGEND) {
-                    mode = MODE_PACKETRATE;
-                }
-                else {
-                    mode = MODE_LEGEND;
-                }
-                break;
-            case 'c':
-                bzero(&heartbeat, sizeof(heartbeat));
-                bzero(&packets, sizeof(packets));
-                break;
-            case ' ':
-                hex = !hex;
-                break;
-            }
-        }
-
-        /*
-         * get actual time
-         */
-        memcpy(&before, &now, sizeof(now));
-        if (gettimeofday(&now, NULL ) < 0) {
-            exit_failure_with_help("gettimeofday(): %s\n", strerror(errno));
-        }
-
-        /*
-         * ncurses box
-         */erase();
-        box(stdscr, 0, 0);
-        attrset(A_BOLD);
-        mvprintw(0, 3, " CANopen - %s ", can_interface);
-        attrset(A_NORMAL);
-
-        /*
-         * show status of heartbeat messages
-         */
-        {
-#define ITEMSIZE 9
-#define XITEMS   8
-#define XBEGIN   4
-#define YBEGIN   2
-
-            int nodes_boot = 0;
-            int nodes_stopped = 0;
-            int nodes_operational = 0;
-            int nodes_preoperational = 0;
-            int nodes_failure = 0;
-
-            int x, y;
-
-            for (nodeid = 1; nodeid <= MAX_NODEID; nodeid++) {
-                double ms_last = (double) heartbeat[nodeid].timestamp.tv_sec
-                        * 1000.0
-                        + (double) heartbeat[nodeid].timestamp.tv_usec / 1000.0;
-                double ms_now = (double) now.tv_sec * 1000.0
-                        + (double) now.tv_usec / 1000.0;
-                double last_seen = ms_now - ms_last;
-                y = nodeid / XITEMS + YBEGIN;
-                x = nodeid % XITEMS * ITEMSIZE + XBEGIN;
-                char* format = hex ? " %02X:%s" : "%3d:%s";
-                if (last_seen < BOOTUP_BLIP_TIME
-                        && heartbeat[nodeid].state == 0) {
-                    attrset(COLOR_PAIR(COLOR_BOOTUP_BLIP));
-                    mvprintw(y, x, format, nodeid, "BOOT");
-                    nodes_boot++;
-                }
-                else if (last_seen < BOOTUP_SHOW_TIME
-                        && heartbeat[nodeid].state == 0) {
-                    attrset(COLOR_PAIR(COLOR_BOOTUP));
-                    mvprintw(y, x, format, nodeid, "BOOT");
-                    nodes_boot++;
-                }
-                else if (last_seen < HEARTBEAT_FAILURE_TIME
-                        && heartbeat[nodeid].state == 4) {
-                    attrset(COLOR_PAIR(COLOR_STOPPED));
-                    mvprintw(y, x, format, nodeid, "STOP");
-                    nodes_stopped++;
-                }
-                else if (last_seen < HEARTBEAT_FAILURE_TIME
-                        && heartbeat[nodeid].state == 5) {
-                    attrset(COLOR_PAIR(COLOR_OPERATIONAL));
-                    mvprintw(y, x, format, nodeid, "OPER");
-                    nodes_operational++;
-                }
-                else if (last_seen < HEARTBEAT_FAILURE_TIME
-                        && heartbeat[nodeid].state == 127) {
-                    attrset(COLOR_PAIR(COLOR_PREOPERATIONAL));
-                    mvprintw(y, x, format, nodeid, "PRE ");
-                    nodes_preoperational++;
-                }
-                else if (last_seen < HEARTBEAT_FAILURE_TIME) { /* unknown state */
-                    attrset(COLOR_PAIR(COLOR_ERROR));
-                    mvprintw(y, x, format, nodeid, "####");
-                    nodes_failure++;
-                }
-                else if (node_present[nodeid]) {
-                    attrset(COLOR_PAIR(COLOR_DOWN));
-                    mvprintw(y, x, format, nodeid, "UNKN");
-                    nodes_failure++;
-                }
-                else {
-                    attrset(COLOR_PAIR(COLOR_DOWN_IRRELEVANT));
-                    mvprintw(y, x, format, nodeid, "UNKN");
-                }
-            }
-
-            x = maxx - 18;
-            y = maxy - 1;
-            attrset(A_BOLD);
-            mvprintw(y, x - 1, "    /   /   /    ");
-            attrset(COLOR_PAIR(COLOR_OPERATIONAL));
-            mvprintw(y, x + 0, "%03d", nodes_operational);
-            attrset(COLOR_PAIR(COLOR_PREOPERATIONAL));
-            mvprintw(y, x + 4, "%03d", nodes_preoperational);
-            attrset(COLOR_PAIR(COLOR_STOPPED));
-            mvprintw(y, x + 8, "%03d", nodes_stopped);
-            attrset(COLOR_PAIR(COLOR_DOWN));
-            mvprintw(y, x + 12, "%03d", nodes_failure);
-            attrset(A_NORMAL);
-
-        }
-
-        /*
-         * CAN status
-         */
-#if 0
-        {
-            static double ms_last = 0.0;
-            double ms_now = (double)now.tv_sec * 1000.0 + (double)now.tv_usec / 1000.0;
-            double ms_diff = ms_now - ms_last;
-            int x = 3;
-            int y = maxy - 1;
-
-            if(ms_diff > 500.0) {
-                ioctl(can_fd, CAN_IOCTL_STATUS, &can_status);
-            }
-
-            attrset(A_BOLD); mvprintw(y, x - 1, "    /   /   ");
-            attrset( can_status.rx_errors >= can_status.error_warning_limit ? COLOR_PAIR(COLOR_ERROR) : A_NORMAL);
-            mvprintw(y, x + 0, "%03d", can_status.rx_errors);
-            attrset( can_status.tx_errors >= can_status.error_warning_limit ? COLOR_PAIR(COLOR_ERROR) : A_NORMAL);
-            mvprintw(y, x + 4, "%03d", can_status.tx_errors);
-            attrset(A_NORMAL);
-            mvprintw(y, x + 8, "%02X", can_status.status);
-
-            switch(can_status.type) {
-                case CAN_TYPE_SJA1000:
-                if(can_status.status & (1<<6)) {
-                    attrset(COLOR_PAIR(COLOR_ERROR));
-                    mvprintw(y, x + 14, "PASSIVE");
-                    attrset(A_NORMAL);
-                }
-                if(can_status.status & (1<<7)) {
-                    attrset(COLOR_PAIR(COLOR_ERROR));
-                    mvprintw(y, x + 22, "BUSOFF");
-                    attrset(A_NORMAL);
-                }
-                break;
-            }
-        }
-#endif
-#define BIG 30
-#define SMALL 24
-        if (maxy > SMALL) {
-            /*
-             * Legend
-             */
-            if (mode == MODE_LEGEND || maxy >= BIG) {
-#define LEGEND_X1 10
-#define LEGEND_Y 19
-#define LEGEND_X2 (LEGEND_X1 + 30)
-                attrset(COLOR_PAIR(COLOR_OPERATIONAL));
-                mvprintw(LEGEND_Y + 0, LEGEND_X1, "OPER");
-                attrset(A_NORMAL);
-                mvprintw(LEGEND_Y + 0, LEGEND_X1 + 4, " - operational");
-                attrset(COLOR_PAIR(COLOR_PREOPERATIONAL));
-                mvprintw(LEGEND_Y + 1, LEGEND_X1, "PRE ");
-                attrset(A_NORMAL);
-                mvprintw(LEGEND_Y + 1, LEGEND_X1 + 4, " - pre-operational");
-                attrset(COLOR_PAIR(COLOR_BOOTUP));
-                mvprintw(LEGEND_Y + 2, LEGEND_X1, "BOOT");
-                attrset(A_NORMAL);
-                mvprintw(LEGEND_Y + 2, LEGEND_X1 + 4, " - bootup node");
-                attrset(COLOR_PAIR(COLOR_STOPPED));
-                mvprintw(LEGEND_Y + 0, LEGEND_X2, "STOP");
-                attrset(A_NORMAL);
-                mvprintw(LEGEND_Y + 0, LEGEND_X2 + 4, " - stopped");
-                attrset(COLOR_PAIR(COLOR_ERROR));
-                mvprintw(LEGEND_Y + 1, LEGEND_X2, "####");
-                attrset(A_NORMAL);
-                mvprintw(LEGEND_Y + 1, LEGEND_X2 + 4, " - invalid NMT state");
-                attrset(COLOR_PAIR(COLOR_DOWN));
-                mvprintw(LEGEND_Y + 2, LEGEND_X2, "UNKN");
-                attrset(A_NORMAL);
-                mvprintw(LEGEND_Y + 2, LEGEND_X2 + 4, " - heartbeat failure");
-            }
-
-            /*
-             * packet rate indicator
-             */
-            if (mode == MODE_PACKETRATE || maxy >= BIG) {
-#define RATE_X 4
-#define RATE_Y_SMALL 19
-#define RATE_Y_BIG 24
-#define TIMEINTERVAL 1000.0
-#define SECONDS (1000.0 / TIMEINTERVAL)
-                int RATE_Y = maxy >= BIG ? RATE_Y_BIG : RATE_Y_SMALL;
-                char* format =
-                        "%-8s %12d packets, %8.0f packets/s, %6.1f kBit/s";
-
-                struct {
-                    double nmt;
-                    double pdo;
-                    double sdo;
-                    double total;
-                } rate;
-                static packets_t packets_seen;
-                static double ms_last = 0.0;
-                double ms_now = (double) now.tv_sec * 1000.0
-                        + (double) now.tv_usec / 1000.0;
-                double ms_diff = ms_now - ms_last;
-
-                if (ms_diff > TIMEINTERVAL) {
-                    rate.total = (double) (packets.total - packets_seen.total)
-                            * TIMEINTERVAL / ms_diff * SECONDS;
-                    rate.pdo = (double) (packets.pdo - packets_seen.pdo)
-                            * TIMEINTERVAL / ms_diff * SECONDS;
-                    rate.sdo = (double) (packets.sdo - packets_seen.sdo)
-                            * TIMEINTERVAL / ms_diff * SECONDS;
-                    rate.nmt = (double) (packets.nmt - packets_seen.nmt)
-                            * TIMEINTERVAL / ms_diff * SECONDS;
-                    ms_last = ms_now;
-                    memcpy(&packets_seen, &packets, sizeof(packets_seen));
-                }
-
-                mvprintw(RATE_Y + 0, RATE_X, format, "PDO:", packets.pdo, rate.pdo, rate.pdo
-                        * 64 / 1024.0);
-                mvprintw(RATE_Y + 1, RATE_X, format, "SDO:", packets.sdo, rate.sdo, rate.sdo
-                        * 111 / 1024.0);
-                mvprintw(RATE_Y + 2, RATE_X, format, "NMT:", packets.nmt, rate.nmt, rate.pdo
-                        * 55 / 1024.0);
-                mvprintw(RATE_Y + 3, RATE_X, format, "total:", packets.total, rate.total, rate.total
-                        * 79 / 1024.0);
+    {
+        sigset_t signals, old_signals;
+        sigfillset(&signals);
+        pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+        for (i = 0; i < network_count; i++) {
+            int error = pthread_create(&networks[i].receiver, NULL,
+                    receive_frames, &networks[i]);
+            if (error != 0) {
+                exit_failure_with_help("pthread_create(): %s\n", strerror(error));
             }
         }
+        pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    }
 
-        /*
-         * rotating indicator
-         */
-        {
-            static int counter = 0;
-            char indicator[] = "|/-\\";
-            mvprintw(0, 0, "%c", indicator[counter]);
-            counter = counter < 2 ? counter + 1 : 0;
-        }
-
-        /*
-         * refresh curses screen
-         */
-        refresh();
+    /*
+     * main loop: keyboard input and the refresh tick
+     */
+    if ((loop = evloop_create()) == NULL
+            || !evloop_add_fd(loop, 0, on_keyboard, NULL)
+            || (refresh_timer = evloop_add_timer(loop, on_refresh, NULL)) == NULL) {
+        exit_failure_with_help("event loop failed\n");
+    }
+    evloop_timer_arm(refresh_timer, 0, REFRESH_TIME);
+    if (!evloop_run(loop)) {
+        exit_failure_with_help("event loop failed\n");
     }
 }
@@ -0,0 +1,214 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "ipc.h"
+
+static bool forwarding_enabled = true;
+
+const char* ipc_socket_path(void) {
+    const char* path = getenv(IPC_SOCKET_ENV);
+    return path != NULL && *path != '\0' ? path : IPC_SOCKET_PATH;
+}
+
+void ipc_disable_forwarding(void) {
+    forwarding_enabled = false;
+}
+
+static int ipc_connect(void) {
+    struct sockaddr_un addr;
+    int fd;
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, ipc_socket_path(), sizeof(addr.sun_path) - 1);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd); /* no daemon running */
+        return -1;
+    }
+
+    struct timeval timeout = { IPC_TIMEOUT_MS / 1000, IPC_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+static bool send_all(int fd, const void* buffer, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, buffer, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        buffer = (const uint8_t*) buffer + sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool receive_all(int fd, void* buffer, size_t size) {
+    while (size > 0) {
+        ssize_t received = recv(fd, buffer, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        buffer = (uint8_t*) buffer + received;
+        size -= received;
+    }
+    return true;
+}
+
+/*
+ * One request on a fresh connection. Once the request went out, a lost
+ * daemon is an error rather than a reason to fall back, since the request
+ * may already have reached the bus.
+ */
+static bool transact(ipc_request_t* request, const void* data,
+        ipc_response_t* response, uint8_t** response_data) {
+    int fd;
+
+    if (!forwarding_enabled || (fd = ipc_connect()) < 0) {
+        return false;
+    }
+
+    request->id = getpid();
+    if (!send_all(fd, request, sizeof(*request))
+            || !send_all(fd, data, request->size)) {
+        close(fd);
+        return false;
+    }
+
+    uint64_t timeout_ms = IPC_TIMEOUT_MS + (uint64_t) request->size;
+    struct timeval timeout = { timeout_ms / 1000, timeout_ms % 1000 * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (!receive_all(fd, response, sizeof(*response))
+            || response->id != request->id || response->size > IPC_MAX_DATA) {
+        fprintf(stderr, "no response from canopentool daemon\n");
+        exit(EXIT_FAILURE);
+    }
+    *response_data = NULL;
+    if (response->size > 0) {
+        if ((*response_data = malloc(response->size)) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!receive_all(fd, *response_data, response->size)) {
+            fprintf(stderr, "no response from canopentool daemon\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+
+    if (response->status == IPC_STATUS_DENIED) {
+        free(*response_data);
+        return false;
+    }
+    if (response->status == IPC_STATUS_INVALID) {
+        fprintf(stderr, "canopentool daemon rejected the request\n");
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+static void init_request(ipc_request_t* request, ipc_request_type_t type,
+        char* bus, uint8_t node_id) {
+    bzero(request, sizeof(*request));
+    request->type = type;
+    request->node_id = node_id;
+    strncpy(request->bus, bus, sizeof(request->bus) - 1);
+}
+
+bool ipc_nmt(char* bus, nmt_command_specifier_t command_specifier,
+        const uint8_t* node_ids, int node_count) {
+    ipc_request_t request;
+    ipc_response_t response;
+    uint8_t* data;
+
+    init_request(&request, IPC_REQUEST_NMT, bus, 0);
+    request.command = command_specifier;
+    request.size = node_count;
+    if (!transact(&request, node_ids, &response, &data)) {
+        return false;
+    }
+    free(data);
+    if (response.status != IPC_STATUS_OK) {
+        fprintf(stderr, "canopentool daemon could not send the NMT command\n");
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+static bool sdo_transact(ipc_request_t* request, const void* data,
+        sdo_callback_t callback, void* context) {
+    ipc_response_t response;
+    uint8_t* response_data;
+    sdo_result_t result;
+
+    if (!transact(request, data, &response, &response_data)) {
+        return false;
+    }
+
+    bzero(&result, sizeof(result));
+    result.abort_code = response.abort_code;
+    result.timed_out = response.status == IPC_STATUS_TIMED_OUT;
+    result.expedited = response.flags & IPC_FLAG_EXPEDITED;
+    result.data = response_data;
+    result.size = response.size;
+    callback(context, &result);
+    free(response_data);
+    return true;
+}
+
+bool ipc_sdo_upload(char* bus, uint8_t node_id, uint16_t index,
+        uint8_t subindex, sdo_callback_t callback, void* context) {
+    ipc_request_t request;
+
+    init_request(&request, IPC_REQUEST_SDO_UPLOAD, bus, node_id);
+    request.index = index;
+    request.subindex = subindex;
+    return sdo_transact(&request, NULL, callback, context);
+}
+
+bool ipc_sdo_download(char* bus, uint8_t node_id, uint16_t index,
+        uint8_t subindex, const uint8_t* data, size_t size, bool size_indicated,
+        sdo_callback_t callback, void* context) {
+    ipc_request_t request;
+
+    init_request(&request, IPC_REQUEST_SDO_DOWNLOAD, bus, node_id);
+    request.index = index;
+    request.subindex = subindex;
+    request.flags = size_indicated ? IPC_FLAG_SIZE_INDICATED : 0;
+    request.size = size;
+    return sdo_transact(&request, data, callback, context);
+}
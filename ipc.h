@@ -0,0 +1,101 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPC_H_
+#define IPC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "canopentool.h"
+#include "sdo.h"
+
+/* where the daemon listens, the environment variable overrides it */
+#define IPC_SOCKET_PATH "/run/canopentool.sock"
+#define IPC_SOCKET_ENV  "CANOPENTOOL_SOCKET"
+
+/* limit for the data following a request or response */
+#define IPC_MAX_DATA (16ul << 20)
+
+/*
+ * How long a client waits for the daemon to answer, plus a millisecond
+ * per byte of request data for segmented downloads.
+ */
+#define IPC_TIMEOUT_MS 30000
+
+/*
+ * Requests and responses are a fixed header in host byte order, followed
+ * by size bytes of data. Responses carry the id of their request; they
+ * are not necessarily sent in request order, so a client may have several
+ * requests outstanding on one connection.
+ */
+typedef enum {
+    IPC_REQUEST_NMT = 1,        /* data holds the node ids */
+    IPC_REQUEST_SDO_UPLOAD,
+    IPC_REQUEST_SDO_DOWNLOAD    /* data holds the value */
+} ipc_request_type_t;
+
+#define IPC_FLAG_SIZE_INDICATED 0x01 /* download: server learns the size */
+#define IPC_FLAG_EXPEDITED      0x02 /* upload response: expedited transfer */
+
+typedef struct __attribute__((packed)) {
+    uint32_t id;
+    uint8_t type;
+    uint8_t command;            /* nmt_command_specifier_t */
+    uint8_t node_id;
+    uint8_t subindex;
+    uint16_t index;
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t size;
+    char bus[64];
+} ipc_request_t;
+
+typedef enum {
+    IPC_STATUS_OK,
+    IPC_STATUS_ABORTED,         /* abort_code tells why */
+    IPC_STATUS_TIMED_OUT,
+    IPC_STATUS_DENIED,          /* only root may change the network */
+    IPC_STATUS_INVALID          /* malformed request or unknown bus */
+} ipc_status_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t id;
+    uint8_t status;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t abort_code;
+    uint32_t size;
+} ipc_response_t;
+
+const char* ipc_socket_path(void);
+
+/* let this process access the bus itself even if a daemon is running */
+void ipc_disable_forwarding(void);
+
+/*
+ * Hand a request to the daemon and wait for its response. These return
+ * false if no daemon is running or it refused the request, in which case
+ * the caller should carry it out itself.
+ */
+bool ipc_nmt(char* bus, nmt_command_specifier_t command_specifier,
+        const uint8_t* node_ids, int node_count);
+bool ipc_sdo_upload(char* bus, uint8_t node_id, uint16_t index,
+        uint8_t subindex, sdo_callback_t callback, void* context);
+bool ipc_sdo_download(char* bus, uint8_t node_id, uint16_t index,
+        uint8_t subindex, const uint8_t* data, size_t size, bool size_indicated,
+        sdo_callback_t callback, void* context);
+
+#endif /* IPC_H_ */
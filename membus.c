@@ -0,0 +1,414 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "membus.h"
+
+#define CACHE_LINE 64
+
+/*
+ * Bounded multi-producer single-consumer queue after Dmitry Vyukov: each
+ * cell's sequence number tells whether it is free for the producer at
+ * that position or filled for the consumer.
+ */
+typedef struct {
+    size_t sequence;
+    struct canfd_frame frame;
+    struct timespec timestamp;
+} cell_t;
+
+typedef struct membus membus_t;
+
+typedef struct endpoint {
+    transport_t transport;
+    membus_t* bus;
+    int event_fd;
+    cell_t* cells;
+    unsigned long dropped;
+
+    size_t enqueue_pos __attribute__((aligned(CACHE_LINE)));
+    size_t dequeue_pos __attribute__((aligned(CACHE_LINE)));
+    int armed; /* consumer ran empty and waits for the eventfd */
+
+    pthread_rwlock_t filters_lock;
+    struct can_filter* filters;
+    int filter_count;
+    can_err_mask_t error_mask;
+    bool fd; /* receives CAN FD frames */
+
+    struct canfd_frame tx_queue[TRANSPORT_BATCH_SIZE];
+    int tx_queued;
+    bool tx_failed; /* a wake-up was lost since the last flush */
+
+    struct endpoint* next;
+} endpoint_t;
+
+struct membus {
+    char name[64];
+    pthread_rwlock_t lock; /* held for writing while endpoints come and go */
+    endpoint_t* endpoints;
+    struct membus* next;
+};
+
+static membus_t* buses = NULL;
+static pthread_mutex_t buses_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void report_error(char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+static bool enqueue(endpoint_t* endpoint, const struct canfd_frame* frame,
+        const struct timespec* timestamp) {
+    size_t pos = __atomic_load_n(&endpoint->enqueue_pos, __ATOMIC_RELAXED);
+    cell_t* cell;
+
+    while (true) {
+        cell = &endpoint->cells[pos & (MEMBUS_QUEUE_SIZE - 1)];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&endpoint->enqueue_pos, &pos,
+                    pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return false; /* full */
+        }
+        else {
+            pos = __atomic_load_n(&endpoint->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->frame = *frame;
+    cell->timestamp = *timestamp;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool dequeue(endpoint_t* endpoint, struct canfd_frame* frame,
+        transport_timestamp_t* timestamp) {
+    size_t pos = endpoint->dequeue_pos;
+    cell_t* cell = &endpoint->cells[pos & (MEMBUS_QUEUE_SIZE - 1)];
+
+    if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+        return false; /* empty */
+    }
+    *frame = cell->frame;
+    if (timestamp != NULL) {
+        timestamp->monotonic = cell->timestamp;
+        timestamp->hardware.tv_sec = 0;
+        timestamp->hardware.tv_nsec = 0;
+    }
+    __atomic_store_n(&cell->sequence, pos + MEMBUS_QUEUE_SIZE, __ATOMIC_RELEASE);
+    endpoint->dequeue_pos = pos + 1;
+    return true;
+}
+
+static bool filters_match(endpoint_t* endpoint, const struct canfd_frame* frame) {
+    int i;
+    if ((frame->flags & CANFD_FDF) && !__atomic_load_n(&endpoint->fd, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    if (frame->can_id & CAN_ERR_FLAG) {
+        return frame->can_id & endpoint->error_mask & CAN_ERR_MASK;
+    }
+    for (i = 0; i < endpoint->filter_count; i++) {
+        const struct can_filter* filter = &endpoint->filters[i];
+        if (((frame->can_id ^ filter->can_id) & filter->can_mask) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int membus_fileno(transport_t* transport) {
+    return ((endpoint_t*) transport)->event_fd;
+}
+
+static bool membus_flush(transport_t* transport) {
+    endpoint_t* self = (endpoint_t*) transport;
+    endpoint_t* endpoint;
+    bool woken_all = !self->tx_failed;
+    struct timespec now;
+    int i;
+
+    self->tx_failed = false;
+    if (self->tx_queued == 0) {
+        return woken_all;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_rwlock_rdlock(&self->bus->lock);
+    for (endpoint = self->bus->endpoints; endpoint != NULL;
+            endpoint = endpoint->next) {
+        bool delivered = false;
+
+        if (endpoint == self) {
+            continue;
+        }
+
+        pthread_rwlock_rdlock(&endpoint->filters_lock);
+        for (i = 0; i < self->tx_queued; i++) {
+            if (!filters_match(endpoint, &self->tx_queue[i])) {
+                continue;
+            }
+            if (enqueue(endpoint, &self->tx_queue[i], &now)) {
+                delivered = true;
+            }
+            else {
+                __atomic_add_fetch(&endpoint->dropped, 1, __ATOMIC_RELAXED);
+            }
+        }
+        pthread_rwlock_unlock(&endpoint->filters_lock);
+
+        if (!delivered) {
+            continue;
+        }
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&endpoint->armed, 0, __ATOMIC_SEQ_CST)) {
+            const uint64_t one = 1;
+            if (write(endpoint->event_fd, &one, sizeof(one)) < 0) {
+                report_error("eventfd write failed: %s\n", strerror(errno));
+                woken_all = false;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&self->bus->lock);
+
+    self->tx_queued = 0;
+    return woken_all;
+}
+
+static void membus_queue(transport_t* transport, const struct canfd_frame* frame) {
+    endpoint_t* self = (endpoint_t*) transport;
+
+    if (self->tx_queued == TRANSPORT_BATCH_SIZE && !membus_flush(transport)) {
+        self->tx_failed = true;
+    }
+    self->tx_queue[self->tx_queued++] = *frame;
+}
+
+static int dequeue_batch(endpoint_t* endpoint, struct canfd_frame* frames,
+        transport_timestamp_t* timestamps, int count) {
+    int received = 0;
+    while (received < count && dequeue(endpoint, &frames[received],
+            timestamps != NULL ? &timestamps[received] : NULL)) {
+        received++;
+    }
+    return received;
+}
+
+/*
+ * The eventfd stays readable while frames may be waiting. Only when the
+ * queue runs empty is it cleared and the endpoint armed, so that the next
+ * sender wakes it up again.
+ */
+static int membus_read_batch(transport_t* transport, struct canfd_frame* frames,
+        transport_timestamp_t* timestamps, int count) {
+    endpoint_t* self = (endpoint_t*) transport;
+    int received = dequeue_batch(self, frames, timestamps, count);
+
+    /* still armed means nobody wrote the eventfd since it was cleared */
+    if (received < count && !__atomic_load_n(&self->armed, __ATOMIC_SEQ_CST)) {
+        uint64_t events;
+        if (read(self->event_fd, &events, sizeof(events)) < 0 && errno != EAGAIN) {
+            report_error("eventfd read failed: %s\n", strerror(errno));
+            return -1;
+        }
+        __atomic_store_n(&self->armed, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        /* a sender may have missed the armed flag */
+        int late = dequeue_batch(self, &frames[received],
+                timestamps != NULL ? &timestamps[received] : NULL,
+                count - received);
+        if (late > 0 && __atomic_exchange_n(&self->armed, 0, __ATOMIC_SEQ_CST)) {
+            const uint64_t one = 1;
+            if (write(self->event_fd, &one, sizeof(one)) < 0) {
+                report_error("eventfd write failed: %s\n", strerror(errno));
+                return -1;
+            }
+        }
+        received += late;
+    }
+    return received;
+}
+
+static bool membus_set_filters(transport_t* transport,
+        const struct can_filter* filters, int count) {
+    endpoint_t* self = (endpoint_t*) transport;
+    struct can_filter* copy = NULL;
+
+    if (count > 0) {
+        copy = malloc(count * sizeof(struct can_filter));
+        if (copy == NULL) {
+            report_error("out of memory\n");
+            return false;
+        }
+        memcpy(copy, filters, count * sizeof(struct can_filter));
+    }
+
+    pthread_rwlock_wrlock(&self->filters_lock);
+    free(self->filters);
+    self->filters = copy;
+    self->filter_count = count;
+    pthread_rwlock_unlock(&self->filters_lock);
+    return true;
+}
+
+static bool membus_set_error_mask(transport_t* transport, can_err_mask_t mask) {
+    endpoint_t* self = (endpoint_t*) transport;
+
+    pthread_rwlock_wrlock(&self->filters_lock);
+    self->error_mask = mask;
+    pthread_rwlock_unlock(&self->filters_lock);
+    return true;
+}
+
+static bool membus_enable_fd(transport_t* transport) {
+    __atomic_store_n(&((endpoint_t*) transport)->fd, true, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void free_endpoint(endpoint_t* self) {
+    close(self->event_fd);
+    pthread_rwlock_destroy(&self->filters_lock);
+    free(self->filters);
+    free(self->cells);
+    free(self);
+}
+
+static void membus_close(transport_t* transport) {
+    endpoint_t* self = (endpoint_t*) transport;
+    membus_t* bus = self->bus;
+    endpoint_t** link;
+
+    pthread_mutex_lock(&buses_lock);
+    pthread_rwlock_wrlock(&bus->lock);
+    for (link = &bus->endpoints; *link != NULL; link = &(*link)->next) {
+        if (*link == self) {
+            *link = self->next;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&bus->lock);
+
+    if (bus->endpoints == NULL) {
+        membus_t** bus_link;
+        for (bus_link = &buses; *bus_link != NULL; bus_link = &(*bus_link)->next) {
+            if (*bus_link == bus) {
+                *bus_link = bus->next;
+                break;
+            }
+        }
+        pthread_rwlock_destroy(&bus->lock);
+        free(bus);
+    }
+    pthread_mutex_unlock(&buses_lock);
+
+    free_endpoint(self);
+}
+
+static const transport_ops_t membus_ops = {
+    .fileno = membus_fileno,
+    .queue = membus_queue,
+    .flush = membus_flush,
+    .read_batch = membus_read_batch,
+    .set_filters = membus_set_filters,
+    .set_error_mask = membus_set_error_mask,
+    .enable_fd = membus_enable_fd,
+    .close = membus_close,
+};
+
+transport_t* membus_open(char* bus_name) {
+    static const struct can_filter all_frames = { 0, 0 };
+    endpoint_t* self;
+    membus_t* bus;
+    size_t i;
+
+    if (posix_memalign((void**) &self, CACHE_LINE, sizeof(endpoint_t)) != 0) {
+        report_error("out of memory\n");
+        return NULL;
+    }
+    bzero(self, sizeof(endpoint_t));
+    if ((self->cells = calloc(MEMBUS_QUEUE_SIZE, sizeof(cell_t))) == NULL) {
+        report_error("out of memory\n");
+        free(self);
+        return NULL;
+    }
+    for (i = 0; i < MEMBUS_QUEUE_SIZE; i++) {
+        self->cells[i].sequence = i;
+    }
+    self->transport.ops = &membus_ops;
+    self->armed = 1;
+    if ((self->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        report_error("eventfd failed: %s\n", strerror(errno));
+        free(self->cells);
+        free(self);
+        return NULL;
+    }
+    pthread_rwlock_init(&self->filters_lock, NULL);
+    if (!membus_set_filters(&self->transport, &all_frames, 1)) {
+        free_endpoint(self);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&buses_lock);
+    for (bus = buses; bus != NULL; bus = bus->next) {
+        if (!strncmp(bus->name, bus_name, sizeof(bus->name))) {
+            break;
+        }
+    }
+    if (bus == NULL) {
+        if ((bus = calloc(1, sizeof(membus_t))) == NULL) {
+            pthread_mutex_unlock(&buses_lock);
+            report_error("out of memory\n");
+            free_endpoint(self);
+            return NULL;
+        }
+        strncpy(bus->name, bus_name, sizeof(bus->name) - 1);
+        pthread_rwlock_init(&bus->lock, NULL);
+        bus->next = buses;
+        buses = bus;
+    }
+    self->bus = bus;
+    pthread_rwlock_wrlock(&bus->lock);
+    self->next = bus->endpoints;
+    bus->endpoints = self;
+    pthread_rwlock_unlock(&bus->lock);
+    pthread_mutex_unlock(&buses_lock);
+
+    return &self->transport;
+}
+
+unsigned long membus_dropped(transport_t* transport) {
+    return __atomic_load_n(&((endpoint_t*) transport)->dropped, __ATOMIC_RELAXED);
+}
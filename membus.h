@@ -0,0 +1,36 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMBUS_H_
+#define MEMBUS_H_
+
+#include "transport.h"
+
+/* frames an endpoint can hold before further frames are dropped */
+#define MEMBUS_QUEUE_SIZE 4096
+
+/*
+ * Simulated CAN bus inside the process. Every endpoint opened on the same
+ * bus name receives the frames the other endpoints send, through its own
+ * lock-free queue. The descriptor of an endpoint is an eventfd that is
+ * only written when the endpoint ran empty, so a busy endpoint exchanges
+ * frames without any system call.
+ */
+transport_t* membus_open(char* bus_name);
+
+/* frames lost because an endpoint's queue was full */
+unsigned long membus_dropped(transport_t* transport);
+
+#endif /* MEMBUS_H_ */
@@ -34,16 +34,25 @@
 #include <string.h>
 
 #include "canopentool.h"
+#include "canopen.h"
+#include "ipc.h"
 
-void nmt(char* can_interface, nmt_command_specifier_t command_specifier, uint8_t node_id) {
-    struct can_frame frame;
-    bzero(&frame, sizeof(frame));
-    frame.can_id = 0;
-    frame.can_dlc = 2;
-    frame.data[0] = command_specifier;
-    frame.data[1] = node_id;
+void nmt(char* can_interface, nmt_command_specifier_t command_specifier,
+        const uint8_t* node_ids, int node_count) {
+    transport_t* can;
+    bool sent;
 
-    socketcan_open(can_interface);
-    socketcan_write(frame);
-    socketcan_close();
+    if (ipc_nmt(can_interface, command_specifier, node_ids, node_count)) {
+        return;
+    }
+
+    if ((can = transport_open(can_interface)) == NULL
+            || !transport_set_filters(can, NULL, 0)) { /* transmit only */
+        exit(EXIT_FAILURE);
+    }
+    sent = nmt_send(can, command_specifier, node_ids, node_count);
+    transport_close(can);
+    if (!sent) {
+        exit(EXIT_FAILURE);
+    }
 }
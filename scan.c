@@ -0,0 +1,152 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <linux/can.h>
+
+#include "canopentool.h"
+#include "canopen.h"
+
+/*
+ * The device type 0x1000 is requested from all nodes at once, each over
+ * its own SDO channel, so missing nodes time out together. That request
+ * is not repeated, so the sweep takes one SDO timeout. Nodes that answer,
+ * even with an abort, are asked for the identity 0x1018:1-4, with the
+ * usual retries.
+ */
+#define SCAN_OBJECTS 5
+
+static const struct {
+    uint16_t index;
+    uint8_t subindex;
+} objects[SCAN_OBJECTS] = {
+    { 0x1000, 0 }, { 0x1018, 1 }, { 0x1018, 2 }, { 0x1018, 3 }, { 0x1018, 4 }
+};
+
+typedef struct scan_node scan_node_t;
+
+typedef struct {
+    scan_node_t* node;
+    bool valid;
+    uint32_t value;
+} scan_object_t;
+
+struct scan_node {
+    uint8_t node_id;
+    bool present;
+    scan_object_t objects[SCAN_OBJECTS];
+};
+
+static evloop_t* loop;
+static canopen_client_t* client;
+static scan_node_t nodes[128];
+static int pending;
+
+static void on_identity(void* context, const sdo_result_t* result) {
+    scan_object_t* object = context;
+    size_t i;
+
+    pending--;
+    if (result->timed_out || result->abort_code != 0) {
+        return;
+    }
+    object->valid = true;
+    for (i = 0; i < result->size && i < 4; i++) {
+        object->value |= (uint32_t) result->data[i] << 8 * i;
+    }
+}
+
+static void on_device_type(void* context, const sdo_result_t* result) {
+    scan_object_t* object = context;
+    scan_node_t* node = object->node;
+    int i;
+
+    if (result->timed_out) {
+        pending--;
+        return;
+    }
+    node->present = true;
+    sdo_channel_set_retries(canopen_client_channel(client, node->node_id),
+            SDO_DEFAULT_RETRIES);
+    on_identity(context, result);
+    for (i = 1; i < SCAN_OBJECTS; i++) {
+        pending++;
+        canopen_client_upload(client, node->node_id, objects[i].index,
+                objects[i].subindex, on_identity, &node->objects[i]);
+    }
+}
+
+static void print_nodes(void) {
+    int node_id, i;
+
+    printf("node device-type vendor-id  product    revision   serial\n");
+    for (node_id = 1; node_id <= 127; node_id++) {
+        if (!nodes[node_id].present) {
+            continue;
+        }
+        printf("%4d", node_id);
+        for (i = 0; i < SCAN_OBJECTS; i++) {
+            if (nodes[node_id].objects[i].valid) {
+                printf(" 0x%08X", nodes[node_id].objects[i].value);
+            }
+            else {
+                printf(" %-10s", "-");
+            }
+        }
+        printf("\n");
+    }
+}
+
+void scan(char* can_interface) {
+    int node_id, i;
+
+    loop = open_loop();
+    client = open_client(loop, can_interface);
+
+    for (node_id = 1; node_id <= 127; node_id++) {
+        nodes[node_id].node_id = node_id;
+        for (i = 0; i < SCAN_OBJECTS; i++) {
+            nodes[node_id].objects[i].node = &nodes[node_id];
+        }
+    }
+    for (node_id = 1; node_id <= 127; node_id++) {
+        sdo_channel_t* channel = canopen_client_channel(client, node_id);
+
+        if (channel == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        sdo_channel_set_retries(channel, 0);
+        pending++;
+        canopen_client_upload(client, node_id, objects[0].index, objects[0].subindex,
+                on_device_type, &nodes[node_id].objects[0]);
+    }
+
+    while (pending > 0) {
+        if (evloop_run_once(loop) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    print_nodes();
+
+    canopen_client_close(client);
+    evloop_destroy(loop);
+    exit(EXIT_SUCCESS);
+}
@@ -24,9 +24,13 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <errno.h>
+#include <math.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
 
@@ -34,43 +38,67 @@
 #include <linux/can/raw.h>
 #include <string.h>
 
-#include "canopentool.h"
+#include "transport.h"
+#include "evloop.h"
+#include "sdo.h"
+#include "crc16.h"
+#include "canopen_frame.h"
 
-#define SDO_ERROR_PROTOCOL_TIMED_OUT (0x05040000ul)
-#define SDO_ERROR_GENERAL_ERROR      (0x08000000ul)
+/*
+ * Until a node answered, requests time out after SDO_TIMEOUT_MS. From
+ * then on the timeout follows the node's round trip time, as smoothed
+ * mean plus four times the mean deviation (RFC 6298), within
+ * SDO_MIN_TIMEOUT_MS and SDO_MAX_TIMEOUT_MS. A transfer that timed out is
+ * started over as often as the channel's retries allow, with the timeout
+ * doubled each time, and round trips of repeated transfers are not
+ * measured. Sub-blocks
+ * take SDO_TIMEOUT_MS, since they include the transmission of a block.
+ */
+#define SDO_TIMEOUT_MS     (200)
+#define SDO_MIN_TIMEOUT_MS (20)
+#define SDO_MAX_TIMEOUT_MS (2000)
+
+/*
+ * Uploads start as block uploads, which take one confirmation per block
+ * of SDO_BLOCK_SIZE segments instead of one per segment. A server may
+ * answer with a plain upload for objects of up to SDO_BLOCK_PROTOCOL_SWITCH
+ * bytes, since a block upload costs about three round trips however
+ * small the object is. Downloads above that size are block downloads.
+ */
+#define SDO_BLOCK_SIZE            (127)
+#define SDO_BLOCK_PROTOCOL_SWITCH (14)
+
+/* memory reserved up front for the size a server announces, at most */
+#define SDO_PREALLOCATE_MAX (16 * 1024 * 1024)
+
+/*
+ * A block download has to send as many segments per block as the server
+ * asks for, so losses are answered by pacing: the block goes out in bursts
+ * SDO_BLOCK_BURST_GAP_MS apart. Each block with lost segments halves the
+ * burst length, down to SDO_BLOCK_BURST_MIN since pacing does not help
+ * against bit errors, and each block that went through grows it by
+ * SDO_BLOCK_BURST_STEP, up to the whole block.
+ */
+#define SDO_BLOCK_BURST_GAP_MS (1)
+#define SDO_BLOCK_BURST_MIN    (16)
+#define SDO_BLOCK_BURST_STEP   (8)
 
-#define SDO_TIMEOUT_MS (200)
+/*
+ * SDO over CAN FD: requests go out as CAN FD frames with bit rate
+ * switching, and segments carry their data length in the byte after the
+ * command specifier, followed by up to SDO_FD_SEGMENT_SIZE data bytes.
+ * Initiate and abort frames keep their classic eight-byte layout.
+ */
+#define SDO_FD_SEGMENT_SIZE (CANFD_MAX_DLEN - 2)
 
 
-static void DATA(struct can_frame *frame, uint32_t data, size_t size) {
+static void DATA(struct canfd_frame *frame, uint32_t data, size_t size) {
     frame->data[4] = size > 0 ? data >> 0 & 0xFF : 0;
     frame->data[5] = size > 1 ? data >> 8 & 0xFF : 0;
     frame->data[6] = size > 2 ? data >> 16 & 0xFF : 0;
     frame->data[7] = size > 3 ? data >> 24 & 0xFF : 0;
 }
 
-static uint32_t data32(struct can_frame frame) {
-    return (uint32_t) frame.data[7] << 24
-         | (uint32_t) frame.data[6] << 16
-         | (uint32_t) frame.data[5] << 8
-         | (uint32_t) frame.data[4] << 0;
-}
-
-static uint32_t data24(struct can_frame frame) {
-    return (uint32_t) frame.data[6] << 16
-         | (uint32_t) frame.data[5] << 8
-         | (uint32_t) frame.data[4] << 0;
-}
-
-static uint16_t data16(struct can_frame frame) {
-    return (uint32_t) frame.data[5] << 8
-         | (uint32_t) frame.data[4] << 0;
-}
-
-static uint8_t data8(struct can_frame frame) {
-    return (uint32_t) frame.data[4] << 0;
-}
-
 
 
 static uint8_t CS(int num) {
@@ -93,69 +121,66 @@ static uint8_t T(int t) {
     return (t & 0x1) << 4;
 }
 
-static int cs(struct can_frame frame) {
-    return frame.data[0] >> 5 & 0x7;
+static uint8_t C(int num) {
+    return (num & 0x1) << 0;
 }
 
-static int n(struct can_frame frame) {
-    if ( cs(frame) == 0 ) {
-        return frame.data[0] >> 1 & 0x7;
-    }
-    else {
-        return frame.data[0] >> 2 & 0x3;
-    }
+/* n of a segment, the number of bytes that do not contain data */
+static uint8_t NSEG(int num) {
+    return (num & 0x7) << 1;
 }
 
-static int e(struct can_frame frame) {
-    return frame.data[0] >> 1 & 0x1;
-}
-static int s(struct can_frame frame) {
-    return frame.data[0] >> 0 & 0x1;
+/* block transfer subcommands */
+static uint8_t CC(int num) {
+    return (num & 0x1) << 2;
 }
 
-static int t(struct can_frame frame) {
-    return frame.data[0] >> 4 & 0x1;
+static uint8_t S_BLOCK(int num) {
+    return (num & 0x1) << 1;
 }
 
-static int c(struct can_frame frame) {
-    return frame.data[0] >> 0 & 0x1;
-}
 
 
+/* fields of received frames are decoded by canopen_frame.h */
+uint8_t sdo_response_node_id(const struct canfd_frame* frame) {
+    return sdo_response_node(frame);
+}
+
+static int is_upload_segment_response(const struct canfd_frame* frame) {
+    return sdo_cs(frame) == 0;
+}
 
-static bool is_sdo_confirmation(struct can_frame frame, uint8_t node_id) {
-    return frame.can_id == 0x580 + node_id && frame.can_dlc == 8;
+static int is_download_segment_response(const struct canfd_frame* frame) {
+    return sdo_cs(frame) == 1;
 }
 
-int is_expected_canopen_object(const struct can_frame* frame, uint16_t index, uint8_t subindex) {
-    return frame->data[1] == (index >> 0 & 0xFF)
-        && frame->data[2] == (index >> 8 & 0xFF)
-        && frame->data[3] == subindex;
+static int is_upload_initiate_response(const struct canfd_frame* frame, uint16_t index, uint8_t subindex) {
+    return sdo_cs(frame) == 2 && sdo_is_object(frame, index, subindex);
 }
 
-static int is_upload_segment_response(struct can_frame frame) {
-    return cs(frame) == 0;
+static int is_download_initiate_response(const struct canfd_frame* frame, uint16_t index, uint8_t subindex) {
+    return sdo_cs(frame) == 3 && sdo_is_object(frame, index, subindex);
 }
 
-static int is_download_segment_response(struct can_frame frame) {
-    return cs(frame) == 1;
+static int is_block_upload_initiate_response(const struct canfd_frame* frame, uint16_t index, uint8_t subindex) {
+    return sdo_cs(frame) == 6 && sdo_block_ss(frame) == 0 && sdo_is_object(frame, index, subindex);
 }
 
-static int is_upload_initiate_response(struct can_frame frame, uint16_t index, uint8_t subindex) {
-    return cs(frame) == 2 && is_expected_canopen_object(&frame, index, subindex);
+static int is_block_upload_end_request(const struct canfd_frame* frame) {
+    return sdo_cs(frame) == 6 && sdo_block_ss(frame) == 1;
 }
 
-static int is_download_initiate_response(struct can_frame frame, uint16_t index, uint8_t subindex) {
-    return cs(frame) == 3 && is_expected_canopen_object(&frame, index, subindex);
+static int is_block_download_response(const struct canfd_frame* frame, int subcommand) {
+    return sdo_cs(frame) == 5 && (frame->data[0] & 0x3) == subcommand;
 }
 
-static int is_abort_transfer_request(struct can_frame frame, uint16_t index, uint8_t subindex) {
-    return cs(frame) == 4 && is_expected_canopen_object(&frame, index, subindex);
+static int is_abort_transfer_request(const struct canfd_frame* frame, uint16_t index, uint8_t subindex) {
+    return sdo_cs(frame) == 4 && sdo_is_object(frame, index, subindex);
 }
 
 
 
-static void print_sdo_error(uint32_t error_code) {
+void print_sdo_error(uint32_t error_code) {
     char* text;
     switch (error_code) {
     case 0x05030000: text = "Toggle bit not alternated."; break;
@@ -191,215 +216,832 @@ static void print_sdo_error(uint32_t error_code) {
     case 0x08000024: text = "No data available"; break;
     default: text = "Unknown"; break;
     }
-    fprintf(stderr, "SDO error 0x%08lX (%s)\n", error_code, text);
+    fprintf(stderr, "SDO error 0x%08X (%s)\n", error_code, text);
 }
 
-static void dump_data_binary(struct can_frame frame, int offset) {
-    int i;
-    for (i = offset; i < (8 - n(frame)); i++) {
-        printf("%c", frame.data[i]);
+
+
+typedef enum { SDO_UPLOAD, SDO_DOWNLOAD } sdo_direction_t;
+
+typedef enum {
+    SDO_STATE_INITIATE,
+    SDO_STATE_SEGMENTED,
+    SDO_STATE_BLOCK_INITIATE,
+    SDO_STATE_BLOCK,     /* sub-blocks in transfer */
+    SDO_STATE_BLOCK_END  /* all segments through, waiting for the end */
+} sdo_state_t;
+
+typedef struct sdo_transfer {
+    sdo_direction_t direction;
+    uint16_t index;
+    uint8_t subindex;
+    const uint8_t* data; /* of a download, points to expedited_data or the caller's buffer */
+    uint8_t expedited_data[4];
+    size_t size;
+    bool size_indicated;
+    int attempts;
+    sdo_callback_t callback;
+    void* context;
+    struct sdo_transfer* next;
+} sdo_transfer_t;
+
+struct sdo_channel {
+    transport_t* can;
+    uint8_t node_id;
+    bool fd;
+    evloop_t* loop;
+    evloop_timer_t* timer;
+    int retries;
+
+    /* the first transfer is in progress */
+    sdo_transfer_t* transfers;
+    sdo_transfer_t** tail;
+
+    sdo_state_t state;
+    int toggle;
+    uint8_t* buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
+
+    /*
+     * Segmented download: offset counts the bytes sent so far, and the
+     * following segment is built ahead of time, so that it goes out as
+     * soon as the server confirms the previous one.
+     */
+    size_t offset;
+    struct canfd_frame segment;
+    size_t segment_size;
+
+    /*
+     * Block upload: sequence is the last segment of the current sub-block
+     * received in order, crc whether both sides check the CRC. Servers
+     * that reject block transfers get plain uploads from then on.
+     */
+    uint8_t sequence;
+    bool crc;
+    bool block_unsupported;
+
+    /*
+     * Block download: sequence counts the segments of the block sent so
+     * far, up to position, and offset the bytes the server acknowledged.
+     */
+    int block_size;
+    int burst;
+    bool burst_pending;
+    size_t position;
+
+    /* round trip times in microseconds, measured from sent */
+    struct timespec sent;
+    bool rtt_pending;
+    sdo_channel_stats_t stats;
+};
+
+static void init_request(sdo_channel_t* channel, struct canfd_frame* frame) {
+    bzero(frame, sizeof(*frame));
+    frame->can_id = 0x600 + channel->node_id;
+    frame->len = 8;
+    if (channel->fd) {
+        frame->flags = CANFD_FDF | CANFD_BRS;
     }
 }
 
+static unsigned long timeout_ms(const sdo_channel_t* channel) {
+    unsigned long timeout;
 
+    if (channel->stats.samples == 0) {
+        return SDO_TIMEOUT_MS;
+    }
+    timeout = (channel->stats.rtt_us + 4 * channel->stats.rtt_deviation_us) / 1000 + 1;
+    return timeout < SDO_MIN_TIMEOUT_MS ? SDO_MIN_TIMEOUT_MS
+            : timeout > SDO_MAX_TIMEOUT_MS ? SDO_MAX_TIMEOUT_MS : timeout;
+}
+
+/* after sending a request, or to wait for the next segment of a sub-block */
+static void arm_timeout(sdo_channel_t* channel) {
+    int attempts = channel->transfers->attempts;
 
-struct timeval timeout;
-static void init_timeout(void) {
-    timeout.tv_sec  = (SDO_TIMEOUT_MS / 1000UL);
-    timeout.tv_usec = (SDO_TIMEOUT_MS % 1000UL) * 1000UL;
+    if (channel->state == SDO_STATE_BLOCK) {
+        channel->rtt_pending = false;
+        evloop_timer_arm(channel->timer, SDO_TIMEOUT_MS << attempts, 0);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &channel->sent);
+    channel->rtt_pending = attempts == 0;
+    evloop_timer_arm(channel->timer, timeout_ms(channel) << attempts, 0);
 }
 
-static bool await_sdo_confirmation(struct can_frame* frame_ptr, uint8_t node_id) {
-    while (socketcan_read(frame_ptr, &timeout)) {
-        if (is_sdo_confirmation(*frame_ptr, node_id))
-            return true;
+static void measure_rtt(sdo_channel_t* channel) {
+    sdo_channel_stats_t* stats = &channel->stats;
+    struct timespec now;
+    double rtt;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rtt = (now.tv_sec - channel->sent.tv_sec) * 1e6
+            + (now.tv_nsec - channel->sent.tv_nsec) / 1e3;
+    channel->rtt_pending = false;
+
+    if (stats->samples++ == 0) {
+        stats->rtt_us = rtt;
+        stats->rtt_deviation_us = rtt / 2;
+        stats->rtt_min_us = rtt;
+        stats->rtt_max_us = rtt;
     }
-    return false; // timed out
+    else {
+        stats->rtt_deviation_us += (fabs(stats->rtt_us - rtt) - stats->rtt_deviation_us) / 4;
+        stats->rtt_us += (rtt - stats->rtt_us) / 8;
+        stats->rtt_min_us = rtt < stats->rtt_min_us ? rtt : stats->rtt_min_us;
+        stats->rtt_max_us = rtt > stats->rtt_max_us ? rtt : stats->rtt_max_us;
+    }
+    stats->timeout_ms = timeout_ms(channel);
 }
 
-static void sdo_abort_transfer(uint8_t node_id, uint16_t index,
+static void sdo_abort_transfer(sdo_channel_t* channel, uint16_t index,
         uint8_t subindex, uint32_t abort_code) {
-    struct can_frame frame;
-    bzero(&frame, sizeof(frame));
+    struct canfd_frame frame;
+    init_request(channel, &frame);
 
-    frame.can_id = 0x600 + node_id;
-    frame.can_dlc = 8;
     frame.data[0] = CS(4);
-    frame.data[1] = index >> 8 & 0xFF;
-    frame.data[2] = index >> 0 & 0xFF;
+    frame.data[1] = index >> 0 & 0xFF;
+    frame.data[2] = index >> 8 & 0xFF;
     frame.data[3] = subindex;
-    frame.data[4] = abort_code >> 0 & 0xFF;
-    frame.data[5] = abort_code >> 8 & 0xFF;
-    frame.data[6] = abort_code >> 16 & 0xFF;
-    frame.data[7] = abort_code >> 24 & 0xFF;
+    DATA(&frame, abort_code, 4);
 
-    socketcan_write(frame);
-    init_timeout();
+    transport_write(channel->can, &frame);
 }
 
-static sdo_download_initiate_request(uint8_t node_id, uint16_t index,
-        uint8_t subindex, uint32_t data, sdo_type_specifier_t type) {
-    struct can_frame frame;
-    bzero(&frame, sizeof(frame));
+static void sdo_download_initiate_request(sdo_channel_t* channel,
+        const sdo_transfer_t* transfer) {
+    struct canfd_frame frame;
+    init_request(channel, &frame);
 
-    frame.can_id = 0x600 + node_id;
-    frame.can_dlc = 8;
-    frame.data[0] = CS(1);
-    frame.data[1] = index >> 0 & 0xFF;
-    frame.data[2] = index >> 8 & 0xFF;
-    frame.data[3] = subindex;
+    if (transfer->size <= 4) {
+        frame.data[0] = CS(1) | E(1);
+        if (transfer->size_indicated) {
+            frame.data[0] |= S(1) | N(4 - transfer->size);
+        }
+        memcpy(&frame.data[4], transfer->data, transfer->size);
+    }
+    else {
+        // d contains the number of bytes to be downloaded, if s is set
+        frame.data[0] = CS(1);
+        if (transfer->size_indicated) {
+            frame.data[0] |= S(1);
+            DATA(&frame, transfer->size, 4);
+        }
+    }
+    frame.data[1] = transfer->index >> 0 & 0xFF;
+    frame.data[2] = transfer->index >> 8 & 0xFF;
+    frame.data[3] = transfer->subindex;
+
+    transport_write(channel->can, &frame);
+}
+
+/* smallest CAN FD frame length that holds size bytes */
+static uint8_t canfd_length(size_t size) {
+    static const uint8_t lengths[] = { 8, 12, 16, 20, 24, 32, 48, 64 };
+    size_t i;
+
+    for (i = 0; i < sizeof(lengths) - 1 && lengths[i] < size; i++) {
+    }
+    return lengths[i];
+}
+
+static void prepare_download_segment(sdo_channel_t* channel, int toggle) {
+    const sdo_transfer_t* transfer = channel->transfers;
+    struct canfd_frame* frame = &channel->segment;
+    size_t remaining = transfer->size - channel->offset;
+    size_t size;
+
+    init_request(channel, frame);
+    if (channel->fd) {
+        size = remaining < SDO_FD_SEGMENT_SIZE ? remaining : SDO_FD_SEGMENT_SIZE;
+        frame->data[0] = CS(0);
+        frame->data[1] = size;
+        memcpy(&frame->data[2], transfer->data + channel->offset, size);
+        frame->len = canfd_length(2 + size);
+    }
+    else {
+        size = remaining < 7 ? remaining : 7;
+        frame->data[0] = CS(0) | NSEG(7 - size);
+        memcpy(&frame->data[1], transfer->data + channel->offset, size);
+    }
+    frame->data[0] |= T(toggle) | C(size == remaining);
+    channel->segment_size = size;
+}
+
+static void sdo_download_segment_request(sdo_channel_t* channel) {
+    const sdo_transfer_t* transfer = channel->transfers;
+
+    transport_write(channel->can, &channel->segment);
+
+    arm_timeout(channel);
+    channel->toggle = sdo_t(&channel->segment);
+    channel->offset += channel->segment_size;
+    if (channel->offset < transfer->size) {
+        prepare_download_segment(channel, !channel->toggle);
+    }
+}
+
+static void sdo_upload_initiate_request(sdo_channel_t* channel,
+        const sdo_transfer_t* transfer) {
+    struct canfd_frame frame;
+    init_request(channel, &frame);
 
-    switch (type) {
-    case SDO_TYPE_U32:
-    case SDO_TYPE_I32:
-        frame.data[0] |= E(1) | S(1) | N(0);
-        DATA(&frame, data, 4);
-        break;
-    case SDO_TYPE_U24:
-    case SDO_TYPE_I24:
-        frame.data[0] |= E(1) | S(1) | N(1);
-        DATA(&frame, data, 3);
-        break;
-    case SDO_TYPE_U16:
-    case SDO_TYPE_I16:
-        frame.data[0] |= E(1) | S(1) | N(2);
-        DATA(&frame, data, 2);
-        break;
-    case SDO_TYPE_U8:
-    case SDO_TYPE_I8:
-        frame.data[0] |= E(1) | S(1) | N(3);
-        DATA(&frame, data, 1);
-        break;
-    case SDO_TYPE_UNSPECIFIED:
-        frame.data[0] |= E(1) | S(0);
-        DATA(&frame, data, 4);
-        break;
-    default:
-        fprintf("undefined data type %d\n", (int)type);
-        exit(EXIT_FAILURE);
-    }
-
-    socketcan_write(frame);
-    init_timeout();
-}
-
-static void sdo_upload_initiate_request(uint8_t node_id, uint16_t index,
-        uint8_t subindex) {
-    struct can_frame frame;
-    bzero(&frame, sizeof(frame));
-
-    frame.can_id = 0x600 + node_id;
-    frame.can_dlc = 8;
     frame.data[0] = CS(2);
-    frame.data[1] = index >> 0 & 0xFF;
-    frame.data[2] = index >> 8 & 0xFF;
-    frame.data[3] = subindex;
+    frame.data[1] = transfer->index >> 0 & 0xFF;
+    frame.data[2] = transfer->index >> 8 & 0xFF;
+    frame.data[3] = transfer->subindex;
+
+    transport_write(channel->can, &frame);
+}
+
+static void sdo_block_upload_initiate_request(sdo_channel_t* channel,
+        const sdo_transfer_t* transfer) {
+    struct canfd_frame frame;
+    init_request(channel, &frame);
 
-    socketcan_write(frame);
-    init_timeout();
+    frame.data[0] = CS(5) | CC(1) | 0;
+    frame.data[1] = transfer->index >> 0 & 0xFF;
+    frame.data[2] = transfer->index >> 8 & 0xFF;
+    frame.data[3] = transfer->subindex;
+    frame.data[4] = SDO_BLOCK_SIZE;
+    frame.data[5] = SDO_BLOCK_PROTOCOL_SWITCH;
+
+    transport_write(channel->can, &frame);
 }
 
-static void sdo_upload_segment_request(uint8_t node_id, int toggle) {
-    struct can_frame frame;
-    bzero(&frame, sizeof(frame));
+static void sdo_block_download_initiate_request(sdo_channel_t* channel,
+        const sdo_transfer_t* transfer) {
+    struct canfd_frame frame;
+    init_request(channel, &frame);
+
+    frame.data[0] = CS(6) | CC(1) | 0;
+    if (transfer->size_indicated) {
+        frame.data[0] |= S_BLOCK(1);
+        DATA(&frame, transfer->size, 4);
+    }
+    frame.data[1] = transfer->index >> 0 & 0xFF;
+    frame.data[2] = transfer->index >> 8 & 0xFF;
+    frame.data[3] = transfer->subindex;
+
+    transport_write(channel->can, &frame);
+}
+
+/* sends the next burst of the block without waiting for confirmations */
+static void sdo_download_burst(sdo_channel_t* channel) {
+    const sdo_transfer_t* transfer = channel->transfers;
+    struct canfd_frame frame;
+    int count;
+
+    for (count = 0; count < channel->burst && channel->sequence < channel->block_size
+            && channel->position < transfer->size; count++) {
+        size_t remaining = transfer->size - channel->position;
+        size_t size = remaining < 7 ? remaining : 7;
+
+        init_request(channel, &frame);
+        frame.data[0] = ++channel->sequence;
+        if (size == remaining) {
+            frame.data[0] |= 0x80;
+        }
+        memcpy(&frame.data[1], transfer->data + channel->position, size);
+        transport_queue(channel->can, &frame);
+        channel->position += size;
+    }
+    transport_flush(channel->can);
+
+    channel->burst_pending = channel->sequence < channel->block_size
+            && channel->position < transfer->size;
+    if (channel->burst_pending) {
+        evloop_timer_arm(channel->timer, SDO_BLOCK_BURST_GAP_MS, 0);
+    }
+    else {
+        arm_timeout(channel);
+    }
+}
+
+/* the next block starts after the acknowledged data */
+static void sdo_download_block(sdo_channel_t* channel) {
+    channel->sequence = 0;
+    channel->position = channel->offset;
+    sdo_download_burst(channel);
+}
+
+static void sdo_block_download_end_request(sdo_channel_t* channel) {
+    const sdo_transfer_t* transfer = channel->transfers;
+    struct canfd_frame frame;
+    uint16_t crc = channel->crc ? crc16_ccitt(0, transfer->data, transfer->size) : 0;
+    init_request(channel, &frame);
+
+    // n is the number of bytes in the last segment that do not contain data
+    frame.data[0] = CS(6) | (7 - transfer->size % 7) % 7 << 2 | 1;
+    frame.data[1] = crc >> 0 & 0xFF;
+    frame.data[2] = crc >> 8 & 0xFF;
+
+    transport_write(channel->can, &frame);
+}
+
+/* subcommand 3 starts the upload, 2 acknowledges a sub-block, 1 ends it */
+static void sdo_block_upload_request(sdo_channel_t* channel, int subcommand) {
+    struct canfd_frame frame;
+    init_request(channel, &frame);
+
+    frame.data[0] = CS(5) | subcommand;
+    if (subcommand == 2) {
+        frame.data[1] = channel->sequence;
+        frame.data[2] = SDO_BLOCK_SIZE;
+    }
+
+    transport_write(channel->can, &frame);
+}
+
+static void sdo_upload_segment_request(sdo_channel_t* channel, int toggle) {
+    struct canfd_frame frame;
+    init_request(channel, &frame);
 
-    frame.can_id = 0x600 + node_id;
-    frame.can_dlc = 8;
     frame.data[0] = CS(3) | T(toggle);
 
-    socketcan_write(frame);
-    init_timeout();
+    transport_write(channel->can, &frame);
 }
 
+static void start_transfer(sdo_channel_t* channel) {
+    sdo_transfer_t* transfer = channel->transfers;
 
+    channel->state = SDO_STATE_INITIATE;
+    channel->buffer_size = 0;
+    if (transfer->direction == SDO_UPLOAD && !channel->fd
+            && !channel->block_unsupported) {
+        channel->state = SDO_STATE_BLOCK_INITIATE;
+        sdo_block_upload_initiate_request(channel, transfer);
+    }
+    else if (transfer->direction == SDO_UPLOAD) {
+        sdo_upload_initiate_request(channel, transfer);
+    }
+    else if (transfer->size > SDO_BLOCK_PROTOCOL_SWITCH && !channel->fd
+            && !channel->block_unsupported) {
+        channel->state = SDO_STATE_BLOCK_INITIATE;
+        sdo_block_download_initiate_request(channel, transfer);
+    }
+    else {
+        sdo_download_initiate_request(channel, transfer);
+        if (transfer->size > 4) {
+            channel->offset = 0;
+            prepare_download_segment(channel, 0);
+        }
+    }
+    arm_timeout(channel);
+}
 
-void sdo_upload(char* can_interface, uint8_t node_id, uint16_t index,
-        uint8_t subindex) {
-    socketcan_open(can_interface);
+/*
+ * Complete the transfer in progress and start the next one before the
+ * callback runs, which may queue further transfers or destroy the channel.
+ */
+static void finish_transfer(sdo_channel_t* channel, const sdo_result_t* result) {
+    sdo_transfer_t* transfer = channel->transfers;
 
-    sdo_upload_initiate_request(node_id, index, subindex);
+    evloop_timer_disarm(channel->timer);
+    channel->transfers = transfer->next;
+    if (channel->transfers == NULL) {
+        channel->tail = &channel->transfers;
+    }
+    else {
+        start_transfer(channel);
+    }
 
-    struct can_frame confirmation;
-    while (await_sdo_confirmation(&confirmation, node_id)) {
-        if (is_upload_initiate_response(confirmation, index, subindex)) {
-            if (e(confirmation) == 0 && s(confirmation) == 1) {
-                // d contains the number of bytes to be uploaded
-                sdo_upload_segment_request(node_id, 0);
-                continue;
-            }
-            else if (e(confirmation) == 1 && s(confirmation) == 1) {
-                // d contains the data of length 4-n to be uploaded
-                switch(n(confirmation)) {
-                case 0: printf("0x%X", data32(confirmation)); break;
-                case 1: printf("0x%X", data24(confirmation)); break;
-                case 2: printf("0x%X", data16(confirmation)); break;
-                case 3: printf("0x%X", data8(confirmation)); break;
-                }
-            }
-            else if (e(confirmation) == 1 && s(confirmation) == 0) {
-                // d contains unspecified number of bytes to be uploaded
-                printf("0x%X", data32(confirmation));
+    transfer->callback(transfer->context, result);
+    free(transfer);
+}
+
+static void finish_with_abort(sdo_channel_t* channel, uint32_t abort_code,
+        bool timed_out) {
+    sdo_result_t result;
+    bzero(&result, sizeof(result));
+    result.abort_code = abort_code;
+    result.timed_out = timed_out;
+    finish_transfer(channel, &result);
+}
+
+static void abort_and_finish(sdo_channel_t* channel, uint32_t abort_code) {
+    sdo_transfer_t* transfer = channel->transfers;
+
+    sdo_abort_transfer(channel, transfer->index, transfer->subindex, abort_code);
+    finish_with_abort(channel, abort_code, abort_code == SDO_ERROR_PROTOCOL_TIMED_OUT);
+}
+
+static void on_timeout(void* context) {
+    sdo_channel_t* channel = context;
+
+    if (channel->transfers != NULL && channel->state == SDO_STATE_BLOCK
+            && channel->burst_pending) {
+        sdo_download_burst(channel);
+    }
+    else if (channel->transfers != NULL
+            && channel->transfers->attempts < channel->retries) {
+        /* start over, telling the server to drop what it has got so far */
+        if (channel->state != SDO_STATE_INITIATE) {
+            sdo_abort_transfer(channel, channel->transfers->index,
+                    channel->transfers->subindex, SDO_ERROR_PROTOCOL_TIMED_OUT);
+        }
+        channel->transfers->attempts++;
+        channel->stats.retries++;
+        start_transfer(channel);
+    }
+    else if (channel->transfers != NULL) {
+        channel->stats.timeouts++;
+        abort_and_finish(channel, SDO_ERROR_PROTOCOL_TIMED_OUT);
+    }
+}
+
+static bool reserve_buffer(sdo_channel_t* channel, size_t capacity) {
+    if (capacity > channel->buffer_capacity) {
+        uint8_t* buffer = realloc(channel->buffer, capacity);
+        if (buffer == NULL) {
+            return false;
+        }
+        channel->buffer = buffer;
+        channel->buffer_capacity = capacity;
+    }
+    return true;
+}
+
+static bool append_data(sdo_channel_t* channel, const uint8_t* data, size_t size) {
+    if (channel->buffer_size + size > channel->buffer_capacity
+            && !reserve_buffer(channel, channel->buffer_capacity * 2 + SDO_FD_SEGMENT_SIZE)) {
+        return false;
+    }
+    memcpy(channel->buffer + channel->buffer_size, data, size);
+    channel->buffer_size += size;
+    return true;
+}
+
+static bool append_segment(sdo_channel_t* channel, const struct canfd_frame* frame) {
+    if (frame->flags & CANFD_FDF) {
+        return append_data(channel, &frame->data[2],
+                frame->data[1] < frame->len - 2 ? frame->data[1] : frame->len - 2);
+    }
+    return append_data(channel, &frame->data[1], 7 - sdo_segment_n(frame));
+}
+
+static void handle_block_upload_response(sdo_channel_t* channel, const struct canfd_frame* frame) {
+    sdo_transfer_t* transfer = channel->transfers;
+    sdo_result_t result;
+    bzero(&result, sizeof(result));
+
+    if (channel->state == SDO_STATE_BLOCK_INITIATE
+            && is_block_upload_initiate_response(frame, transfer->index, transfer->subindex)) {
+        // d contains the number of bytes to be uploaded, if s is set
+        channel->crc = sdo_block_sc(frame);
+        if (sdo_block_s(frame) && !reserve_buffer(channel, sdo_data32(frame) < SDO_PREALLOCATE_MAX
+                ? sdo_data32(frame) : SDO_PREALLOCATE_MAX)) {
+            abort_and_finish(channel, SDO_ERROR_OUT_OF_MEMORY);
+            return;
+        }
+        channel->state = SDO_STATE_BLOCK;
+        channel->sequence = 0;
+        sdo_block_upload_request(channel, 3);
+        arm_timeout(channel);
+    }
+    else if (channel->state == SDO_STATE_BLOCK) {
+        /*
+         * Segments after a lost one are dropped; the acknowledgement tells
+         * the server to repeat them in the next sub-block.
+         */
+        bool last = false;
+
+        if (sdo_seqno(frame) == channel->sequence + 1) {
+            if (!append_data(channel, &frame->data[1], 7)) {
+                abort_and_finish(channel, SDO_ERROR_OUT_OF_MEMORY);
+                return;
             }
-            printf("\n");
-            socketcan_close();
-            exit(EXIT_SUCCESS);
-        }
-        else if (is_upload_segment_response(confirmation)) {
-            dump_data_binary(confirmation, 1);
-            if ( c(confirmation) == 0 ) {
-                sdo_upload_segment_request(node_id, t(confirmation)+1);
-            } else {
-                printf("\n");
-                socketcan_close();
-                exit(EXIT_SUCCESS);
+            channel->sequence++;
+            last = sdo_block_c(frame);
+        }
+        if (sdo_block_c(frame) || sdo_seqno(frame) == SDO_BLOCK_SIZE) {
+            sdo_block_upload_request(channel, 2);
+            channel->sequence = 0;
+            if (last) {
+                channel->state = SDO_STATE_BLOCK_END;
             }
         }
-        else if (is_abort_transfer_request(confirmation, index, subindex)) {
-            uint32_t error_code = data32(confirmation);
-            print_sdo_error(error_code);
-            socketcan_close();
-            exit(EXIT_FAILURE);
+        arm_timeout(channel);
+    }
+    else if (channel->state == SDO_STATE_BLOCK_END && is_block_upload_end_request(frame)) {
+        uint16_t crc = frame->data[1] | frame->data[2] << 8;
+
+        if ((size_t) sdo_block_n(frame) > channel->buffer_size) {
+            abort_and_finish(channel, SDO_ERROR_COMMAND_SPECIFIER);
+            return;
+        }
+        channel->buffer_size -= sdo_block_n(frame);
+        if (channel->crc
+                && crc != crc16_ccitt(0, channel->buffer, channel->buffer_size)) {
+            abort_and_finish(channel, SDO_ERROR_CRC);
+            return;
         }
+        sdo_block_upload_request(channel, 1);
+        result.data = channel->buffer;
+        result.size = channel->buffer_size;
+        finish_transfer(channel, &result);
     }
+}
+
+static void handle_upload_response(sdo_channel_t* channel, const struct canfd_frame* frame) {
+    sdo_transfer_t* transfer = channel->transfers;
+    sdo_result_t result;
+    bzero(&result, sizeof(result));
 
-    /* timeout*/
-    sdo_abort_transfer(node_id, index, subindex, SDO_ERROR_PROTOCOL_TIMED_OUT);
-    fprintf(stderr, "SDO timeout\n");
-    exit(EXIT_FAILURE);
+    if (channel->state == SDO_STATE_BLOCK_INITIATE
+            && is_upload_initiate_response(frame, transfer->index, transfer->subindex)) {
+        /* the server switched to a plain upload */
+        channel->state = SDO_STATE_INITIATE;
+    }
+    if (channel->state >= SDO_STATE_BLOCK_INITIATE) {
+        handle_block_upload_response(channel, frame);
+    }
+    else if (channel->state == SDO_STATE_INITIATE
+            && is_upload_initiate_response(frame, transfer->index, transfer->subindex)) {
+        if (sdo_e(frame) == 1) {
+            // d contains the data of length 4-n, or 4 if unspecified
+            result.expedited = true;
+            result.data = &frame->data[4];
+            result.size = sdo_s(frame) ? 4 - sdo_n(frame) : 4;
+            finish_transfer(channel, &result);
+        }
+        else {
+            // d contains the number of bytes to be uploaded, if s is set
+            if (sdo_s(frame) && !reserve_buffer(channel, sdo_data32(frame) < SDO_PREALLOCATE_MAX
+                    ? sdo_data32(frame) : SDO_PREALLOCATE_MAX)) {
+                abort_and_finish(channel, SDO_ERROR_OUT_OF_MEMORY);
+                return;
+            }
+            channel->state = SDO_STATE_SEGMENTED;
+            channel->toggle = 0;
+            sdo_upload_segment_request(channel, channel->toggle);
+            arm_timeout(channel);
+        }
+    }
+    else if (channel->state == SDO_STATE_SEGMENTED && is_upload_segment_response(frame)) {
+        if (sdo_t(frame) != channel->toggle) {
+            abort_and_finish(channel, SDO_ERROR_TOGGLE_BIT);
+        }
+        else if (!append_segment(channel, frame)) {
+            abort_and_finish(channel, SDO_ERROR_OUT_OF_MEMORY);
+        }
+        else if (sdo_c(frame) == 0) {
+            channel->toggle ^= 1;
+            sdo_upload_segment_request(channel, channel->toggle);
+            arm_timeout(channel);
+        }
+        else {
+            result.data = channel->buffer;
+            result.size = channel->buffer_size;
+            finish_transfer(channel, &result);
+        }
+    }
 }
 
-/*
- * only expedited download is implemented
- */
-void sdo_download(char* can_interface, uint8_t node_id, uint16_t index,
-        uint8_t subindex, uint32_t data, sdo_type_specifier_t type) {
-    socketcan_open(can_interface);
+static void handle_block_download_response(sdo_channel_t* channel, const struct canfd_frame* frame) {
+    sdo_transfer_t* transfer = channel->transfers;
+    sdo_result_t result;
+    bzero(&result, sizeof(result));
+
+    if (channel->state == SDO_STATE_BLOCK_INITIATE
+            && is_block_download_response(frame, 0)
+            && sdo_is_object(frame, transfer->index, transfer->subindex)) {
+        if (frame->data[4] < 1 || frame->data[4] > SDO_BLOCK_SIZE) {
+            abort_and_finish(channel, SDO_ERROR_BLOCK_SIZE);
+            return;
+        }
+        channel->crc = sdo_block_sc(frame);
+        channel->block_size = frame->data[4];
+        channel->burst = channel->block_size;
+        channel->offset = 0;
+        channel->state = SDO_STATE_BLOCK;
+        sdo_download_block(channel);
+    }
+    else if (channel->state == SDO_STATE_BLOCK && is_block_download_response(frame, 2)) {
+        int acknowledged = frame->data[1];
+
+        if (acknowledged > channel->sequence || channel->burst_pending) {
+            abort_and_finish(channel, SDO_ERROR_SEQUENCE);
+            return;
+        }
+        if (frame->data[2] < 1 || frame->data[2] > SDO_BLOCK_SIZE) {
+            abort_and_finish(channel, SDO_ERROR_BLOCK_SIZE);
+            return;
+        }
+
+        channel->offset += acknowledged * 7;
+        if (channel->offset > transfer->size) {
+            channel->offset = transfer->size;
+        }
+        if (acknowledged < channel->sequence) {
+            channel->burst = channel->burst / 2 > SDO_BLOCK_BURST_MIN
+                    ? channel->burst / 2 : SDO_BLOCK_BURST_MIN;
+        }
+        else {
+            channel->burst += SDO_BLOCK_BURST_STEP;
+        }
+        channel->block_size = frame->data[2];
+        if (channel->burst > channel->block_size) {
+            channel->burst = channel->block_size;
+        }
+
+        if (channel->offset == transfer->size) {
+            channel->state = SDO_STATE_BLOCK_END;
+            sdo_block_download_end_request(channel);
+            arm_timeout(channel);
+        }
+        else {
+            sdo_download_block(channel);
+        }
+    }
+    else if (channel->state == SDO_STATE_BLOCK_END && is_block_download_response(frame, 1)) {
+        finish_transfer(channel, &result);
+    }
+}
 
-    sdo_download_initiate_request(node_id, index, subindex, data, type);
+static void handle_download_response(sdo_channel_t* channel, const struct canfd_frame* frame) {
+    sdo_transfer_t* transfer = channel->transfers;
+    sdo_result_t result;
+    bzero(&result, sizeof(result));
 
-    struct can_frame confirmation;
-    while (await_sdo_confirmation(&confirmation, node_id)) {
-        if (is_download_initiate_response(confirmation, index, subindex)) {
-            socketcan_close();
-            exit(EXIT_SUCCESS);
+    if (channel->state >= SDO_STATE_BLOCK_INITIATE) {
+        handle_block_download_response(channel, frame);
+    }
+    else if (channel->state == SDO_STATE_INITIATE
+            && is_download_initiate_response(frame, transfer->index, transfer->subindex)) {
+        if (transfer->size <= 4) {
+            finish_transfer(channel, &result);
+        }
+        else {
+            channel->state = SDO_STATE_SEGMENTED;
+            sdo_download_segment_request(channel);
+        }
+    }
+    else if (channel->state == SDO_STATE_SEGMENTED && is_download_segment_response(frame)) {
+        if (sdo_t(frame) != channel->toggle) {
+            abort_and_finish(channel, SDO_ERROR_TOGGLE_BIT);
+        }
+        else if (channel->offset < transfer->size) {
+            sdo_download_segment_request(channel);
         }
-        else if (is_download_segment_response(confirmation)) {
-            sdo_abort_transfer(node_id, index, subindex, SDO_ERROR_GENERAL_ERROR);
-            fprintf(stderr, "SDO download unexpected segment response.");
-            socketcan_close();
-            exit(EXIT_FAILURE);
+        else {
+            finish_transfer(channel, &result);
+        }
+    }
+}
+
+void sdo_channel_handle_frame(sdo_channel_t* channel, const struct canfd_frame* frame) {
+    sdo_transfer_t* transfer = channel->transfers;
+
+    if (transfer == NULL || sdo_response_node(frame) != channel->node_id) {
+        return;
+    }
+    if (channel->rtt_pending) {
+        measure_rtt(channel);
+    }
+
+    /* a last segment of a block may look like an abort, which is 0x80 exactly */
+    if (is_abort_transfer_request(frame, transfer->index, transfer->subindex)
+            && (channel->state != SDO_STATE_BLOCK || frame->data[0] == CS(4))) {
+        if (channel->state == SDO_STATE_BLOCK_INITIATE
+                && sdo_data32(frame) == SDO_ERROR_COMMAND_SPECIFIER) {
+            channel->block_unsupported = true;
+            start_transfer(channel);
         }
-        else if (is_abort_transfer_request(confirmation, index, subindex)) {
-            uint32_t error_code = data32(confirmation);
-            print_sdo_error(error_code);
-            socketcan_close();
-            exit(EXIT_FAILURE);
+        else {
+            finish_with_abort(channel, sdo_data32(frame), false);
         }
     }
+    else if (transfer->direction == SDO_UPLOAD) {
+        handle_upload_response(channel, frame);
+    }
+    else {
+        handle_download_response(channel, frame);
+    }
+}
+
+static void queue_transfer(sdo_channel_t* channel, sdo_transfer_t* transfer) {
+    transfer->next = NULL;
+    *channel->tail = transfer;
+    channel->tail = &transfer->next;
+    if (channel->transfers == transfer) {
+        start_transfer(channel);
+    }
+}
 
-    /* timeout*/
-    sdo_abort_transfer(node_id, index, subindex, SDO_ERROR_PROTOCOL_TIMED_OUT);
-    fprintf(stderr, "SDO timeout\n");
-    socketcan_close();
-    exit(EXIT_FAILURE);
+static void fail_immediately(uint32_t abort_code, sdo_callback_t callback,
+        void* context) {
+    sdo_result_t result;
+    bzero(&result, sizeof(result));
+    result.abort_code = abort_code;
+    callback(context, &result);
+}
+
+static sdo_transfer_t* new_transfer(sdo_direction_t direction, uint16_t index,
+        uint8_t subindex, sdo_callback_t callback, void* context) {
+    sdo_transfer_t* transfer = calloc(1, sizeof(sdo_transfer_t));
+    if (transfer == NULL) {
+        return NULL;
+    }
+    transfer->direction = direction;
+    transfer->index = index;
+    transfer->subindex = subindex;
+    transfer->callback = callback;
+    transfer->context = context;
+    return transfer;
+}
+
+void sdo_channel_upload(sdo_channel_t* channel, uint16_t index, uint8_t subindex,
+        sdo_callback_t callback, void* context) {
+    sdo_transfer_t* transfer =
+            new_transfer(SDO_UPLOAD, index, subindex, callback, context);
+
+    if (transfer == NULL) {
+        fail_immediately(SDO_ERROR_OUT_OF_MEMORY, callback, context);
+        return;
+    }
+    queue_transfer(channel, transfer);
+}
+
+void sdo_channel_download(sdo_channel_t* channel, uint16_t index, uint8_t subindex,
+        const uint8_t* data, size_t size, bool size_indicated,
+        sdo_callback_t callback, void* context) {
+    sdo_transfer_t* transfer;
+
+    if (size == 0 || size > UINT32_MAX) {
+        fail_immediately(SDO_ERROR_GENERAL_ERROR, callback, context);
+        return;
+    }
+    if ((transfer = new_transfer(SDO_DOWNLOAD, index, subindex, callback,
+            context)) == NULL) {
+        fail_immediately(SDO_ERROR_OUT_OF_MEMORY, callback, context);
+        return;
+    }
+    if (size <= 4) {
+        memcpy(transfer->expedited_data, data, size);
+        data = transfer->expedited_data;
+    }
+    transfer->data = data;
+    transfer->size = size;
+    transfer->size_indicated = size_indicated;
+    queue_transfer(channel, transfer);
+}
+
+sdo_channel_t* sdo_channel_create(evloop_t* loop, transport_t* can, uint8_t node_id,
+        bool fd) {
+    if (fd && !transport_enable_fd(can)) {
+        return NULL;
+    }
+
+    sdo_channel_t* channel = calloc(1, sizeof(sdo_channel_t));
+    if (channel == NULL) {
+        return NULL;
+    }
+    channel->can = can;
+    channel->node_id = node_id;
+    channel->fd = fd;
+    channel->loop = loop;
+    if ((channel->timer = evloop_add_timer(loop, on_timeout, channel)) == NULL) {
+        free(channel);
+        return NULL;
+    }
+    channel->tail = &channel->transfers;
+    channel->stats.node_id = node_id;
+    channel->stats.timeout_ms = SDO_TIMEOUT_MS;
+    channel->retries = SDO_DEFAULT_RETRIES;
+    return channel;
+}
+
+void sdo_channel_set_retries(sdo_channel_t* channel, int retries) {
+    channel->retries = retries;
+}
+
+void sdo_channel_get_stats(const sdo_channel_t* channel, sdo_channel_stats_t* stats) {
+    *stats = channel->stats;
+}
+
+void print_sdo_channel_stats(const sdo_channel_stats_t* stats) {
+    if (stats->samples == 0) {
+        fprintf(stderr, "node %d: no round trips measured", stats->node_id);
+    }
+    else {
+        fprintf(stderr, "node %d: rtt %.2f ms, deviation %.2f ms, min %.2f ms, "
+                "max %.2f ms, %lu samples, timeout %lu ms", stats->node_id,
+                stats->rtt_us / 1000, stats->rtt_deviation_us / 1000,
+                stats->rtt_min_us / 1000, stats->rtt_max_us / 1000,
+                stats->samples, stats->timeout_ms);
+    }
+    fprintf(stderr, ", %lu retries, %lu timeouts\n", stats->retries, stats->timeouts);
+}
+
+void sdo_channel_destroy(sdo_channel_t* channel) {
+    while (channel->transfers != NULL) {
+        sdo_transfer_t* transfer = channel->transfers;
+        channel->transfers = transfer->next;
+        free(transfer);
+    }
+    evloop_remove_timer(channel->loop, channel->timer);
+    free(channel->buffer);
+    free(channel);
 }
@@ -0,0 +1,122 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SDO_H_
+#define SDO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "transport.h"
+#include "evloop.h"
+
+#define SDO_ERROR_TOGGLE_BIT         (0x05030000ul)
+#define SDO_ERROR_PROTOCOL_TIMED_OUT (0x05040000ul)
+#define SDO_ERROR_COMMAND_SPECIFIER  (0x05040001ul)
+#define SDO_ERROR_BLOCK_SIZE         (0x05040002ul)
+#define SDO_ERROR_SEQUENCE           (0x05040003ul)
+#define SDO_ERROR_CRC                (0x05040004ul)
+#define SDO_ERROR_OUT_OF_MEMORY      (0x05040005ul)
+#define SDO_ERROR_GENERAL_ERROR      (0x08000000ul)
+
+/*
+ * Outcome of a transfer. data is only valid during the callback. When the
+ * server aborted the transfer or it timed out, abort_code is non-zero.
+ */
+typedef struct {
+    uint32_t abort_code;
+    bool timed_out;
+    bool expedited;
+    const uint8_t* data;
+    size_t size;
+} sdo_result_t;
+
+typedef void (*sdo_callback_t)(void* context, const sdo_result_t* result);
+
+/*
+ * SDO client for one node, driven by an event loop. Transfers are queued
+ * and run one after the other; responses have to be fed in through
+ * sdo_channel_handle_frame() by whoever reads the transport, so that
+ * channels to many nodes can share one transport. Every failure ends up
+ * in the transfer's callback, which may be called before the upload or
+ * download call returns.
+ */
+typedef struct sdo_channel sdo_channel_t;
+
+/*
+ * With fd, transfers run over CAN FD. Returns NULL if the transport does
+ * not support that, or if there is no memory.
+ */
+sdo_channel_t* sdo_channel_create(evloop_t* loop, transport_t* can, uint8_t node_id,
+        bool fd);
+
+/* queued transfers are dropped without calling their callbacks */
+void sdo_channel_destroy(sdo_channel_t* channel);
+
+void sdo_channel_handle_frame(sdo_channel_t* channel, const struct canfd_frame* frame);
+
+void sdo_channel_upload(sdo_channel_t* channel, uint16_t index, uint8_t subindex,
+        sdo_callback_t callback, void* context);
+
+/*
+ * Up to four bytes are downloaded expedited, more in segments or blocks
+ * of segments. Without size_indicated the server is not told the size.
+ * Segments are built from data in place, so it has to stay valid until
+ * the callback.
+ */
+void sdo_channel_download(sdo_channel_t* channel, uint16_t index, uint8_t subindex,
+        const uint8_t* data, size_t size, bool size_indicated,
+        sdo_callback_t callback, void* context);
+
+/*
+ * How often a transfer that timed out is started over, each time with
+ * twice the timeout, before it fails. Applies to transfers that time out
+ * from now on; presence checks, where silence is the expected answer,
+ * should run with none.
+ */
+#define SDO_DEFAULT_RETRIES 2
+void sdo_channel_set_retries(sdo_channel_t* channel, int retries);
+
+/*
+ * Round trip times of a channel's requests and the timeout that follows
+ * from them. They are kept for the lifetime of the channel.
+ */
+typedef struct {
+    uint8_t node_id;
+    unsigned long samples;
+    double rtt_us;           /* smoothed */
+    double rtt_deviation_us; /* smoothed mean deviation */
+    double rtt_min_us;
+    double rtt_max_us;
+    unsigned long timeout_ms;
+    unsigned long retries;   /* transfers started over after a timeout */
+    unsigned long timeouts;  /* transfers that failed after all retries */
+} sdo_channel_stats_t;
+
+void sdo_channel_get_stats(const sdo_channel_t* channel, sdo_channel_stats_t* stats);
+
+/* one line on stderr */
+void print_sdo_channel_stats(const sdo_channel_stats_t* stats);
+
+/* filter passing the SDO responses of all nodes */
+#define SDO_RESPONSE_FILTER { 0x580, 0x780 | CAN_EFF_FLAG | CAN_RTR_FLAG }
+
+/* node a frame belongs to if it is an SDO response, zero otherwise */
+uint8_t sdo_response_node_id(const struct canfd_frame* frame);
+
+void print_sdo_error(uint32_t error_code);
+
+#endif /* SDO_H_ */
@@ -0,0 +1,380 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput and latency of SDO uploads against a responder thread that
+ * answers for every node id on the same bus, usually a vcan interface
+ * (modprobe vcan; ip link add vcan0 type vcan; ip link set vcan0 up).
+ * Each node has one upload in flight at a time, started again as soon as
+ * the previous one completes. The results are written as JSON, tagged
+ * with a revision, so that runs of different commits can be compared.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "canopen.h"
+#include "crc16.h"
+
+#define MIN_SECONDS 1.0
+#define OBJECT_INDEX 0x2000
+#define MAX_OBJECT_SIZE 4096
+
+/*
+ * Sizes are chosen for the protocol the client ends up with: 4 bytes go
+ * expedited, 14 bytes fall back from a block to a segmented upload, and
+ * larger objects are block uploads. Case i is object OBJECT_INDEX + i.
+ */
+static const struct {
+    const char* name;
+    size_t size;
+} cases[] = {
+    { "expedited", 4 },
+    { "segmented", 14 },
+    { "block", MAX_OBJECT_SIZE }
+};
+
+static const int node_counts[] = { 1, 8, 32, 127 };
+
+static uint8_t object[MAX_OBJECT_SIZE];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the responder */
+
+typedef struct {
+    size_t size;        /* of the object being uploaded */
+    size_t sent;        /* bytes of the object sent, segmented and block */
+    size_t block_start; /* offset of the first segment of the sub-block */
+    int toggle;
+    int block_size;
+} node_state_t;
+
+static transport_t* responder;
+static node_state_t nodes[128];
+
+static void respond(uint8_t node_id, uint8_t command, const struct canfd_frame* request,
+        uint32_t data) {
+    struct canfd_frame frame;
+
+    bzero(&frame, sizeof(frame));
+    frame.can_id = 0x580 + node_id;
+    frame.len = 8;
+    frame.data[0] = command;
+    memcpy(&frame.data[1], &request->data[1], 3);
+    frame.data[4] = data >> 0 & 0xFF;
+    frame.data[5] = data >> 8 & 0xFF;
+    frame.data[6] = data >> 16 & 0xFF;
+    frame.data[7] = data >> 24 & 0xFF;
+    transport_queue(responder, &frame);
+}
+
+static void send_sub_block(uint8_t node_id, node_state_t* node) {
+    struct canfd_frame frame;
+    int sequence;
+
+    node->block_start = node->sent;
+    for (sequence = 1; sequence <= node->block_size && node->sent < node->size;
+            sequence++) {
+        size_t size = node->size - node->sent < 7 ? node->size - node->sent : 7;
+
+        bzero(&frame, sizeof(frame));
+        frame.can_id = 0x580 + node_id;
+        frame.len = 8;
+        frame.data[0] = sequence | (node->sent + size == node->size ? 0x80 : 0);
+        memcpy(&frame.data[1], object + node->sent, size);
+        node->sent += size;
+        transport_queue(responder, &frame);
+    }
+}
+
+static void handle_request(const struct canfd_frame* request) {
+    uint8_t node_id = request->can_id - 0x600;
+    node_state_t* node = &nodes[node_id];
+    uint8_t command = request->data[0];
+    uint16_t index = request->data[1] | request->data[2] << 8;
+
+    if (command >> 5 == 5 && (command & 0x3) == 0) {
+        /* block upload initiate, switching to a plain upload up to pst bytes */
+        if (index < OBJECT_INDEX
+                || index >= OBJECT_INDEX + sizeof(cases) / sizeof(cases[0])) {
+            respond(node_id, 0x80, request, 0x06020000); /* no such object */
+            return;
+        }
+        node->size = cases[index - OBJECT_INDEX].size;
+        node->block_size = request->data[4];
+        node->sent = 0;
+        if (node->size <= 4) {
+            respond(node_id, 0x43 | (4 - node->size) << 2, request,
+                    object[0] | object[1] << 8 | object[2] << 16 | object[3] << 24);
+        }
+        else if (node->size <= request->data[5]) {
+            node->toggle = 0;
+            respond(node_id, 0x41, request, node->size);
+        }
+        else {
+            respond(node_id, 0xC6, request, node->size);
+        }
+    }
+    else if (command >> 5 == 5 && (command & 0x3) == 3) {
+        send_sub_block(node_id, node);
+    }
+    else if (command >> 5 == 5 && (command & 0x3) == 2) {
+        node->sent = node->block_start + 7 * request->data[1];
+        if (node->sent > node->size) {
+            node->sent = node->size;
+        }
+        node->block_size = request->data[2];
+        if (node->sent < node->size) {
+            send_sub_block(node_id, node);
+        }
+        else {
+            struct canfd_frame frame;
+            uint16_t crc = crc16_ccitt(0, object, node->size);
+
+            bzero(&frame, sizeof(frame));
+            frame.can_id = 0x580 + node_id;
+            frame.len = 8;
+            frame.data[0] = 0xC1 | (7 - node->size % 7) % 7 << 2;
+            frame.data[1] = crc & 0xFF;
+            frame.data[2] = crc >> 8;
+            transport_queue(responder, &frame);
+        }
+    }
+    else if (command >> 5 == 3 && (command >> 4 & 1) == node->toggle) {
+        struct canfd_frame frame;
+        size_t size = node->size - node->sent < 7 ? node->size - node->sent : 7;
+
+        bzero(&frame, sizeof(frame));
+        frame.can_id = 0x580 + node_id;
+        frame.len = 8;
+        frame.data[0] = node->toggle << 4 | (7 - size) << 1
+                | (node->sent + size == node->size);
+        memcpy(&frame.data[1], object + node->sent, size);
+        node->sent += size;
+        node->toggle ^= 1;
+        transport_queue(responder, &frame);
+    }
+}
+
+static void* run_responder(void* context) {
+    struct canfd_frame frames[TRANSPORT_BATCH_SIZE];
+    struct pollfd pollfd = { transport_fileno(responder), POLLIN, 0 };
+    int count, i;
+
+    (void) context;
+    for (;;) {
+        if (poll(&pollfd, 1, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        if ((count = transport_read_batch(responder, frames, NULL,
+                TRANSPORT_BATCH_SIZE)) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < count; i++) {
+            if (frames[i].can_id > 0x600 && frames[i].can_id <= 0x67F) {
+                handle_request(&frames[i]);
+            }
+        }
+        transport_flush(responder);
+    }
+    return NULL;
+}
+
+/* the client */
+
+typedef struct {
+    int case_index;
+    int node_count;
+    unsigned long transfers;
+    unsigned long failures;
+    double seconds;
+    double* latencies; /* in microseconds */
+    size_t latency_capacity;
+    double started[128];
+    bool running;
+    int in_flight;
+} run_t;
+
+static canopen_client_t* client;
+
+static void start_upload(run_t* run, uint8_t node_id);
+
+/*
+ * Transfers are told apart by node, so the callback context is the
+ * address of the node's slot in a table of pointers to the run.
+ */
+static run_t* slots[128];
+
+static void on_result(void* context, const sdo_result_t* result) {
+    run_t** slot = context;
+    run_t* run = *slot;
+    uint8_t node_id = slot - slots;
+
+    run->in_flight--;
+    if (result->timed_out || result->abort_code != 0
+            || result->size != cases[run->case_index].size
+            || memcmp(result->data, object, result->size)) {
+        run->failures++;
+    }
+    else {
+        if (run->transfers == run->latency_capacity) {
+            run->latency_capacity = run->latency_capacity * 2 + 4096;
+            run->latencies = realloc(run->latencies,
+                    run->latency_capacity * sizeof(double));
+            if (run->latencies == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        run->latencies[run->transfers++] = (now() - run->started[node_id]) * 1e6;
+    }
+    if (run->running) {
+        start_upload(run, node_id);
+    }
+}
+
+static void start_upload(run_t* run, uint8_t node_id) {
+    run->in_flight++;
+    run->started[node_id] = now();
+    canopen_client_upload(client, node_id, OBJECT_INDEX + run->case_index, 0,
+            on_result, &slots[node_id]);
+}
+
+static void measure(evloop_t* loop, run_t* run) {
+    double started = now();
+    int i;
+
+    for (i = 1; i <= run->node_count; i++) {
+        slots[i] = run;
+    }
+    run->running = true;
+    for (i = 1; i <= run->node_count; i++) {
+        start_upload(run, i);
+    }
+    while (run->running || run->in_flight > 0) {
+        if (evloop_run_once(loop) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        if (run->running && now() - started >= MIN_SECONDS) {
+            run->running = false;
+            run->seconds = now() - started;
+        }
+    }
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const run_t* run, double fraction) {
+    if (run->transfers == 0) {
+        return 0;
+    }
+    return run->latencies[(size_t) (fraction * (run->transfers - 1))];
+}
+
+static void report(FILE* output, const run_t* run, bool first) {
+    const char* name = cases[run->case_index].name;
+    size_t size = cases[run->case_index].size;
+    double rate = run->transfers / run->seconds;
+
+    qsort(run->latencies, run->transfers, sizeof(double), compare_doubles);
+    printf("%-9s %5zu bytes %3d nodes %9.0f transfers/s %9.0f bytes/s"
+            "   p50 %7.0f us  p99 %7.0f us  p999 %7.0f us  %lu failed\n",
+            name, size, run->node_count, rate, rate * size,
+            percentile(run, 0.5), percentile(run, 0.99), percentile(run, 0.999),
+            run->failures);
+    fprintf(output, "%s    {\"case\": \"%s\", \"size\": %zu, \"nodes\": %d, "
+            "\"transfers\": %lu, \"failures\": %lu, \"seconds\": %.3f, "
+            "\"transfers_per_second\": %.1f, \"bytes_per_second\": %.1f, "
+            "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}",
+            first ? "" : ",\n", name, size, run->node_count, run->transfers,
+            run->failures, run->seconds, rate, rate * size,
+            percentile(run, 0.5), percentile(run, 0.99), percentile(run, 0.999));
+}
+
+int main(int argc, char** argv) {
+    static const struct can_filter requests = { 0x600, 0x780 | CAN_EFF_FLAG | CAN_RTR_FLAG };
+    char* bus = argc > 1 ? argv[1] : "vcan0";
+    char* path = argc > 2 ? argv[2] : "sdo_bench.json";
+    char* revision = argc > 3 ? argv[3] : "unknown";
+    pthread_t thread;
+    evloop_t* loop;
+    FILE* output;
+    size_t i, j;
+
+    if (argc > 4) {
+        fprintf(stderr, "usage: sdo_bench [bus [output.json [revision]]]\n");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (i = 0; i < MAX_OBJECT_SIZE; i++) {
+        object[i] = rand();
+    }
+
+    if ((responder = transport_open(bus)) == NULL
+            || !transport_set_filters(responder, &requests, 1)
+            || (loop = evloop_create()) == NULL
+            || (client = canopen_client_open(loop, bus, 0)) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    if ((errno = pthread_create(&thread, NULL, run_responder, NULL)) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    if ((output = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(output, "{\n  \"bus\": \"%s\",\n  \"revision\": \"%s\",\n"
+            "  \"results\": [\n", bus, revision);
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        for (j = 0; j < sizeof(node_counts) / sizeof(node_counts[0]); j++) {
+            run_t run;
+
+            bzero(&run, sizeof(run));
+            run.case_index = i;
+            run.node_count = node_counts[j];
+            measure(loop, &run);
+            report(output, &run, i == 0 && j == 0);
+            free(run.latencies);
+        }
+    }
+    fprintf(output, "\n  ]\n}\n");
+    if (fclose(output) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    printf("results written to %s\n", path);
+
+    canopen_client_close(client);
+    evloop_destroy(loop);
+    return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdo_cache.h"
+
+typedef struct sdo_cache_policy {
+    uint16_t index;
+    uint16_t subindex; /* or SDO_CACHE_ALL_SUBINDICES */
+    unsigned long max_age_ms;
+    struct sdo_cache_policy* next;
+} sdo_cache_policy_t;
+
+/* the few values of a node are looked up by walking its list */
+typedef struct sdo_cache_entry {
+    uint16_t index;
+    uint8_t subindex;
+    uint64_t expires_ms; /* on CLOCK_MONOTONIC, UINT64_MAX for never */
+    bool expedited;
+    size_t size;
+    struct sdo_cache_entry* next;
+    uint8_t data[];
+} sdo_cache_entry_t;
+
+struct sdo_cache {
+    sdo_cache_policy_t* policies;
+    sdo_cache_entry_t* entries[128];
+    unsigned long generations[128];
+    sdo_cache_stats_t stats;
+};
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+sdo_cache_t* sdo_cache_create(void) {
+    static const struct {
+        uint16_t index;
+        uint16_t subindex;
+    } constants[] = {
+        { 0x1000, SDO_CACHE_ALL_SUBINDICES }, /* device type */
+        { 0x1008, SDO_CACHE_ALL_SUBINDICES }, /* device name */
+        { 0x1009, SDO_CACHE_ALL_SUBINDICES }, /* hardware version */
+        { 0x100A, SDO_CACHE_ALL_SUBINDICES }, /* software version */
+        { 0x1018, SDO_CACHE_ALL_SUBINDICES }  /* identity */
+    };
+    sdo_cache_t* cache = calloc(1, sizeof(sdo_cache_t));
+    size_t i;
+
+    if (cache == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < sizeof(constants) / sizeof(constants[0]); i++) {
+        if (!sdo_cache_set_policy(cache, constants[i].index, constants[i].subindex,
+                SDO_CACHE_FOREVER)) {
+            sdo_cache_destroy(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+void sdo_cache_destroy(sdo_cache_t* cache) {
+    while (cache->policies != NULL) {
+        sdo_cache_policy_t* policy = cache->policies;
+        cache->policies = policy->next;
+        free(policy);
+    }
+    sdo_cache_invalidate_node(cache, 0);
+    free(cache);
+}
+
+bool sdo_cache_set_policy(sdo_cache_t* cache, uint16_t index, uint16_t subindex,
+        unsigned long max_age_ms) {
+    sdo_cache_policy_t* policy;
+
+    for (policy = cache->policies; policy != NULL; policy = policy->next) {
+        if (policy->index == index && policy->subindex == subindex) {
+            break;
+        }
+    }
+    if (policy == NULL) {
+        if ((policy = malloc(sizeof(sdo_cache_policy_t))) == NULL) {
+            return false;
+        }
+        policy->index = index;
+        policy->subindex = subindex;
+        policy->next = cache->policies;
+        cache->policies = policy;
+    }
+    policy->max_age_ms = max_age_ms;
+    return true;
+}
+
+unsigned long sdo_cache_max_age(const sdo_cache_t* cache, uint16_t index,
+        uint8_t subindex) {
+    const sdo_cache_policy_t* policy;
+    unsigned long max_age_ms = 0;
+
+    for (policy = cache->policies; policy != NULL; policy = policy->next) {
+        if (policy->index != index) {
+            continue;
+        }
+        if (policy->subindex == subindex) {
+            return policy->max_age_ms;
+        }
+        if (policy->subindex == SDO_CACHE_ALL_SUBINDICES) {
+            max_age_ms = policy->max_age_ms;
+        }
+    }
+    return max_age_ms;
+}
+
+static sdo_cache_entry_t** find_entry(sdo_cache_t* cache, uint8_t node_id,
+        uint16_t index, uint8_t subindex) {
+    sdo_cache_entry_t** link;
+
+    for (link = &cache->entries[node_id & 0x7F]; *link != NULL; link = &(*link)->next) {
+        if ((*link)->index == index && (*link)->subindex == subindex) {
+            break;
+        }
+    }
+    return link;
+}
+
+static void remove_entry(sdo_cache_t* cache, sdo_cache_entry_t** link) {
+    sdo_cache_entry_t* entry = *link;
+    *link = entry->next;
+    free(entry);
+    cache->stats.entries--;
+}
+
+bool sdo_cache_lookup(sdo_cache_t* cache, uint8_t node_id, uint16_t index,
+        uint8_t subindex, sdo_result_t* result) {
+    sdo_cache_entry_t** link = find_entry(cache, node_id, index, subindex);
+    sdo_cache_entry_t* entry = *link;
+
+    if (entry != NULL && entry->expires_ms <= now_ms()) {
+        remove_entry(cache, link);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        cache->stats.misses++;
+        return false;
+    }
+    cache->stats.hits++;
+    bzero(result, sizeof(*result));
+    result->expedited = entry->expedited;
+    result->data = entry->data;
+    result->size = entry->size;
+    return true;
+}
+
+unsigned long sdo_cache_generation(const sdo_cache_t* cache, uint8_t node_id) {
+    return cache->generations[node_id & 0x7F];
+}
+
+void sdo_cache_store(sdo_cache_t* cache, uint8_t node_id, uint16_t index,
+        uint8_t subindex, unsigned long generation, const sdo_result_t* result) {
+    unsigned long max_age_ms = sdo_cache_max_age(cache, index, subindex);
+    sdo_cache_entry_t** link;
+    sdo_cache_entry_t* entry;
+
+    if (max_age_ms == 0 || generation != sdo_cache_generation(cache, node_id)) {
+        return;
+    }
+    if (*(link = find_entry(cache, node_id, index, subindex)) != NULL) {
+        remove_entry(cache, link);
+    }
+    if ((entry = malloc(sizeof(sdo_cache_entry_t) + result->size)) == NULL) {
+        return; /* served from the bus then */
+    }
+    entry->index = index;
+    entry->subindex = subindex;
+    entry->expires_ms = max_age_ms == SDO_CACHE_FOREVER ? UINT64_MAX
+            : now_ms() + max_age_ms;
+    entry->expedited = result->expedited;
+    entry->size = result->size;
+    memcpy(entry->data, result->data, result->size);
+    entry->next = cache->entries[node_id & 0x7F];
+    cache->entries[node_id & 0x7F] = entry;
+    cache->stats.entries++;
+}
+
+void sdo_cache_invalidate_object(sdo_cache_t* cache, uint8_t node_id,
+        uint16_t index, uint8_t subindex) {
+    sdo_cache_entry_t** link = find_entry(cache, node_id, index, subindex);
+
+    if (*link != NULL) {
+        remove_entry(cache, link);
+    }
+}
+
+void sdo_cache_invalidate_node(sdo_cache_t* cache, uint8_t node_id) {
+    int first = node_id == 0 ? 1 : node_id & 0x7F;
+    int last = node_id == 0 ? 127 : node_id & 0x7F;
+    int i;
+
+    for (i = first; i <= last; i++) {
+        while (cache->entries[i] != NULL) {
+            remove_entry(cache, &cache->entries[i]);
+        }
+        cache->generations[i]++;
+    }
+    cache->stats.invalidations++;
+}
+
+void sdo_cache_get_stats(const sdo_cache_t* cache, sdo_cache_stats_t* stats) {
+    *stats = cache->stats;
+}
+
+void print_sdo_cache_stats(const sdo_cache_stats_t* stats) {
+    unsigned long reads = stats->hits + stats->misses;
+
+    fprintf(stderr, "cache: %lu hits, %lu misses (%.1f%% hits), %lu invalidations, "
+            "%lu entries\n", stats->hits, stats->misses,
+            reads > 0 ? 100.0 * stats->hits / reads : 0.0,
+            stats->invalidations, stats->entries);
+}
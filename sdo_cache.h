@@ -0,0 +1,92 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SDO_CACHE_H_
+#define SDO_CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sdo.h"
+
+/* max_age_ms of values that are kept until the node restarts */
+#define SDO_CACHE_FOREVER (~0ul)
+
+/* subindex of a policy that covers every subindex of its index */
+#define SDO_CACHE_ALL_SUBINDICES (0x100)
+
+/*
+ * Values of uploaded objects by node, index and subindex. Only objects
+ * with a freshness policy are kept, each for at most the policy's
+ * max_age_ms. The device type 0x1000, the name and version strings
+ * 0x1008-0x100A and the identity 0x1018 are constant while a node runs
+ * and have SDO_CACHE_FOREVER policies from the start.
+ */
+typedef struct sdo_cache sdo_cache_t;
+
+/* returns NULL if there is no memory */
+sdo_cache_t* sdo_cache_create(void);
+void sdo_cache_destroy(sdo_cache_t* cache);
+
+/*
+ * A policy for one subindex takes precedence over one for all subindices
+ * of the index. max_age_ms 0 stops caching. Returns false if there is no
+ * memory.
+ */
+bool sdo_cache_set_policy(sdo_cache_t* cache, uint16_t index, uint16_t subindex,
+        unsigned long max_age_ms);
+
+/* 0 if the object is not cached */
+unsigned long sdo_cache_max_age(const sdo_cache_t* cache, uint16_t index,
+        uint8_t subindex);
+
+/*
+ * Fill in result from a fresh value, counting a hit, or count a miss and
+ * return false. result->data stays valid until the cache is changed.
+ */
+bool sdo_cache_lookup(sdo_cache_t* cache, uint8_t node_id, uint16_t index,
+        uint8_t subindex, sdo_result_t* result);
+
+/*
+ * Changes with every invalidation of the node. An upload takes it before
+ * it starts, so a value that was read before the node restarted is not
+ * stored afterwards.
+ */
+unsigned long sdo_cache_generation(const sdo_cache_t* cache, uint8_t node_id);
+
+/* keep the result of a successful upload */
+void sdo_cache_store(sdo_cache_t* cache, uint8_t node_id, uint16_t index,
+        uint8_t subindex, unsigned long generation, const sdo_result_t* result);
+
+/* drop one value, after a download to it */
+void sdo_cache_invalidate_object(sdo_cache_t* cache, uint8_t node_id,
+        uint16_t index, uint8_t subindex);
+
+/* drop all values of a node, or of all nodes for node id 0 */
+void sdo_cache_invalidate_node(sdo_cache_t* cache, uint8_t node_id);
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations; /* of a node, by boot-up or NMT reset */
+    unsigned long entries;
+} sdo_cache_stats_t;
+
+void sdo_cache_get_stats(const sdo_cache_t* cache, sdo_cache_stats_t* stats);
+
+/* one line on stderr */
+void print_sdo_cache_stats(const sdo_cache_stats_t* stats);
+
+#endif /* SDO_CACHE_H_ */
@@ -0,0 +1,362 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "canopentool.h"
+#include "canopen.h"
+#include "ipc.h"
+
+/*
+ * The command line tools run a single transfer, through the daemon if
+ * one runs or else on a client of their own, and exit with its outcome.
+ */
+static evloop_t* loop;
+static canopen_client_t* client;
+static bool done;
+static int exit_status;
+
+static void sdo_open(char* can_interface) {
+    loop = open_loop();
+    client = open_client(loop, can_interface);
+}
+
+static void sdo_run(void) {
+    while (!done) {
+        if (evloop_run_once(loop) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    canopen_client_close(client);
+    evloop_destroy(loop);
+    exit(exit_status);
+}
+
+static bool report_failure(const sdo_result_t* result) {
+    if (result->timed_out) {
+        fprintf(stderr, "SDO timeout\n");
+    }
+    else if (result->abort_code != 0) {
+        print_sdo_error(result->abort_code);
+    }
+    else {
+        return false;
+    }
+    exit_status = EXIT_FAILURE;
+    done = true;
+    return true;
+}
+
+/*
+ * Uploads with an output file or format go out in a single write, after
+ * the transfer, from the buffer the channel reserved for the announced
+ * size. Hex and base64 are encoded into one buffer first, two and four
+ * characters per lookup.
+ */
+static int output_fd = -1;
+static sdo_output_format_t output_format;
+
+static void write_output(const uint8_t* data, size_t size) {
+    ssize_t written;
+
+    while (size > 0) {
+        if ((written = write(output_fd, data, size)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+static size_t encode_hex(char* text, const uint8_t* data, size_t size) {
+    static uint16_t pairs[256];
+    static const char digits[] = "0123456789ABCDEF";
+    size_t i;
+
+    if (pairs[0] == 0) {
+        for (i = 0; i < 256; i++) {
+            char pair[2] = { digits[i >> 4], digits[i & 0xF] };
+            memcpy(&pairs[i], pair, 2);
+        }
+    }
+    for (i = 0; i < size; i++) {
+        memcpy(&text[2 * i], &pairs[data[i]], 2);
+    }
+    return 2 * size;
+}
+
+static size_t encode_base64(char* text, const uint8_t* data, size_t size) {
+    static const char digits[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char* start = text;
+    uint32_t group;
+
+    for (; size >= 3; data += 3, size -= 3) {
+        group = data[0] << 16 | data[1] << 8 | data[2];
+        *text++ = digits[group >> 18];
+        *text++ = digits[group >> 12 & 0x3F];
+        *text++ = digits[group >> 6 & 0x3F];
+        *text++ = digits[group & 0x3F];
+    }
+    if (size > 0) {
+        group = data[0] << 16 | (size == 2 ? data[1] << 8 : 0);
+        *text++ = digits[group >> 18];
+        *text++ = digits[group >> 12 & 0x3F];
+        *text++ = size == 2 ? digits[group >> 6 & 0x3F] : '=';
+        *text++ = '=';
+    }
+    return text - start;
+}
+
+static void write_upload(const uint8_t* data, size_t size) {
+    char* text;
+    size_t length;
+
+    if (output_format == SDO_OUTPUT_RAW) {
+        write_output(data, size);
+        return;
+    }
+    if ((text = malloc(size / 3 * 4 + 2 * size + 8)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    length = output_format == SDO_OUTPUT_HEX ? encode_hex(text, data, size)
+            : encode_base64(text, data, size);
+    text[length++] = '\n';
+    write_output((uint8_t*) text, length);
+    free(text);
+}
+
+static void on_upload_result(void* context, const sdo_result_t* result) {
+    (void) context;
+    if (report_failure(result)) {
+        return;
+    }
+    if (output_format != SDO_OUTPUT_DEFAULT) {
+        write_upload(result->data, result->size);
+    }
+    else if (result->expedited) {
+        uint32_t value = 0;
+        size_t i;
+        for (i = 0; i < result->size; i++) {
+            value |= (uint32_t) result->data[i] << 8 * i;
+        }
+        printf("0x%X\n", value);
+    }
+    else {
+        fwrite(result->data, 1, result->size, stdout);
+        printf("\n");
+    }
+    exit_status = EXIT_SUCCESS;
+    done = true;
+}
+
+static void on_download_result(void* context, const sdo_result_t* result) {
+    (void) context;
+    if (!report_failure(result)) {
+        exit_status = EXIT_SUCCESS;
+        done = true;
+    }
+}
+
+/*
+ * Upload to a file, or to stdout if path is NULL. SDO_OUTPUT_DEFAULT
+ * prints expedited values as a number and others as they are, followed
+ * by a newline; it writes a file raw.
+ */
+void sdo_upload(char* can_interface, uint8_t node_id, uint16_t index,
+        uint8_t subindex, char* path, sdo_output_format_t format) {
+    output_fd = STDOUT_FILENO;
+    output_format = format;
+    if (path != NULL) {
+        output_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (output_fd < 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (format == SDO_OUTPUT_DEFAULT) {
+            output_format = SDO_OUTPUT_RAW;
+        }
+    }
+
+    if (ipc_sdo_upload(can_interface, node_id, index, subindex,
+            on_upload_result, NULL)) {
+        exit(exit_status);
+    }
+
+    sdo_open(can_interface);
+    canopen_client_upload(client, node_id, index, subindex, on_upload_result, NULL);
+    sdo_run();
+}
+
+void sdo_download(char* can_interface, uint8_t node_id, uint16_t index,
+        uint8_t subindex, uint32_t data, sdo_type_specifier_t type) {
+    uint8_t bytes[4];
+    size_t size;
+    bool size_indicated = true;
+
+    switch (type) {
+    case SDO_TYPE_U32:
+    case SDO_TYPE_I32:
+        size = 4;
+        break;
+    case SDO_TYPE_U24:
+    case SDO_TYPE_I24:
+        size = 3;
+        break;
+    case SDO_TYPE_U16:
+    case SDO_TYPE_I16:
+        size = 2;
+        break;
+    case SDO_TYPE_U8:
+    case SDO_TYPE_I8:
+        size = 1;
+        break;
+    case SDO_TYPE_UNSPECIFIED:
+        size = 4;
+        size_indicated = false;
+        break;
+    default:
+        fprintf(stderr, "undefined data type %d\n", (int)type);
+        exit(EXIT_FAILURE);
+    }
+    bytes[0] = data >> 0 & 0xFF;
+    bytes[1] = data >> 8 & 0xFF;
+    bytes[2] = data >> 16 & 0xFF;
+    bytes[3] = data >> 24 & 0xFF;
+
+    if (ipc_sdo_download(can_interface, node_id, index, subindex, bytes, size,
+            size_indicated, on_download_result, NULL)) {
+        exit(exit_status);
+    }
+
+    sdo_open(can_interface);
+    canopen_client_download(client, node_id, index, subindex, bytes, size,
+            size_indicated, on_download_result, NULL);
+    sdo_run();
+}
+
+static struct timespec download_started;
+static size_t download_size;
+
+static void on_file_download_result(void* context, const sdo_result_t* result) {
+    struct timespec now;
+    double seconds;
+
+    (void) context;
+    if (report_failure(result)) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    seconds = (now.tv_sec - download_started.tv_sec)
+            + (now.tv_nsec - download_started.tv_nsec) / 1e9;
+    printf("%zu bytes in %.3f s, %.0f bytes/s\n", download_size, seconds,
+            seconds > 0 ? download_size / seconds : 0);
+    exit_status = EXIT_SUCCESS;
+    done = true;
+}
+
+/*
+ * Regular files are mapped and the segments are built straight from the
+ * page cache. A pipe cannot be mapped, so it is read up front, because
+ * the server has to be told the size before the first segment.
+ */
+static const uint8_t* map_input(char* path, size_t* size) {
+    int fd = path != NULL ? open(path, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    struct stat st;
+    uint8_t* data = NULL;
+    size_t capacity = 0;
+    ssize_t received;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", path != NULL ? path : "stdin", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        *size = st.st_size;
+        if (*size > 0 && *size <= UINT32_MAX) {
+            data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                fprintf(stderr, "mmap: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            madvise(data, *size, MADV_SEQUENTIAL);
+        }
+    }
+    else {
+        *size = 0;
+        do {
+            if (*size == capacity) {
+                capacity = capacity * 2 + 65536;
+                if ((data = realloc(data, capacity)) == NULL) {
+                    fprintf(stderr, "out of memory\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            received = read(fd, data + *size, capacity - *size);
+            if (received < 0 && errno != EINTR) {
+                fprintf(stderr, "read: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            *size += received > 0 ? received : 0;
+        } while (received != 0 && *size <= UINT32_MAX);
+    }
+
+    if (*size == 0 || *size > UINT32_MAX) {
+        fprintf(stderr, *size == 0 ? "no data to download\n"
+                : "too much data for an SDO download\n");
+        exit(EXIT_FAILURE);
+    }
+    if (path != NULL) {
+        close(fd);
+    }
+    return data;
+}
+
+/*
+ * Download the contents of a file, or of stdin if path is NULL.
+ */
+void sdo_download_file(char* can_interface, uint8_t node_id, uint16_t index,
+        uint8_t subindex, char* path) {
+    const uint8_t* data = map_input(path, &download_size);
+
+    clock_gettime(CLOCK_MONOTONIC, &download_started);
+    if (download_size <= IPC_MAX_DATA
+            && ipc_sdo_download(can_interface, node_id, index, subindex, data,
+                    download_size, true, on_file_download_result, NULL)) {
+        exit(exit_status);
+    }
+
+    sdo_open(can_interface);
+    clock_gettime(CLOCK_MONOTONIC, &download_started);
+    canopen_client_download(client, node_id, index, subindex, data, download_size,
+            true, on_file_download_result, NULL);
+    sdo_run();
+}
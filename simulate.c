@@ -0,0 +1,705 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+
+#include <linux/can.h>
+
+#include "canopentool.h"
+#include "canopen.h"
+#include "busload.h"
+#include "canopen_frame.h"
+
+/*
+ * Simulated nodes on one bus, all served by a single event loop. Every
+ * node has a heartbeat and a PDO event, kept in a min-heap by deadline;
+ * one timer is armed for the earliest deadline, and all frames that are
+ * due when it expires go out in one flush. Deadlines advance by their
+ * period, so rates do not drift with the time spent handling them, and
+ * events with periods below the timer's millisecond resolution fire
+ * several times per expiry. Only when an event falls more than
+ * MAX_LAG_US behind is the backlog dropped.
+ *
+ * The nodes follow NMT commands and run an expedited and segmented SDO
+ * server on a small object dictionary. Block transfers are refused, so
+ * clients fall back to segmented ones. PDOs are only sent while a node
+ * is operational, SDO requests only answered while it is not stopped.
+ */
+#define NEVER UINT64_MAX
+#define MAX_LAG_US 100000
+
+#define DEVICE_TYPE      0x00000000
+#define VENDOR_ID        0x00000000
+#define PRODUCT_CODE     0x00000001
+#define REVISION_NUMBER  0x00010000
+#define DEVICE_NAME      "canopentool simulated node"
+#define HARDWARE_VERSION "1.0"
+#define SOFTWARE_VERSION "1.0"
+
+/* 0x2000:1-4 hold 32 bit values, 0x2100 a domain of up to DOMAIN_SIZE bytes */
+#define VALUE_COUNT 4
+#define DOMAIN_SIZE 1024
+
+#define SDO_ABORT_TOGGLE_BIT               0x05030000
+#define SDO_ABORT_COMMAND_SPECIFIER        0x05040001
+#define SDO_ABORT_OUT_OF_MEMORY            0x05040005
+#define SDO_ABORT_READ_ONLY                0x06010002
+#define SDO_ABORT_OBJECT_DOES_NOT_EXIST    0x06020000
+#define SDO_ABORT_LENGTH_MISMATCH          0x06070010
+#define SDO_ABORT_SUBINDEX_DOES_NOT_EXIST  0x06090011
+#define SDO_ABORT_VALUE_TOO_HIGH           0x06090031
+
+typedef struct node node_t;
+
+typedef struct {
+    uint64_t due_us; /* or NEVER */
+    uint64_t period_us;
+    int heap_index;
+    node_t* node;
+    void (*fire)(node_t* node);
+} event_t;
+
+typedef enum {
+    SDO_IDLE, SDO_UPLOADING, SDO_DOWNLOADING
+} sdo_server_state_t;
+
+struct node {
+    simulated_node_t config;
+    uint8_t state;
+    uint16_t heartbeat_ms; /* 0x1017 */
+    uint32_t values[VALUE_COUNT];
+    uint8_t domain[DOMAIN_SIZE];
+    size_t domain_size;
+    uint32_t pdo_count;
+    event_t heartbeat;
+    event_t pdo;
+
+    /* segmented transfer in progress */
+    sdo_server_state_t sdo_state;
+    uint16_t index;
+    uint8_t subindex;
+    int toggle;
+    uint8_t buffer[DOMAIN_SIZE];
+    size_t size;
+    size_t offset;
+};
+
+typedef struct {
+    unsigned long heartbeats;
+    unsigned long pdos;
+    unsigned long sdo_responses;
+    unsigned long failed_flushes;
+    uint64_t bits;
+} statistics_t;
+
+static evloop_t* loop;
+static evloop_timer_t* timer;
+static transport_t* can;
+static int signal_fd = -1;
+static node_t* nodes[128];
+static event_t* heap[2 * 127];
+static int heap_size;
+static statistics_t statistics;
+static uint64_t started_us;
+
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void send_frame(const struct canfd_frame* frame, unsigned long* counter) {
+    unsigned int nominal_bits, data_bits;
+
+    can_frame_bits(frame, &nominal_bits, &data_bits);
+    statistics.bits += nominal_bits + data_bits;
+    (*counter)++;
+    transport_queue(can, frame);
+}
+
+/* the event heap */
+
+static void swap_events(int a, int b) {
+    event_t* event = heap[a];
+
+    heap[a] = heap[b];
+    heap[b] = event;
+    heap[a]->heap_index = a;
+    heap[b]->heap_index = b;
+}
+
+static void sift_up(int i) {
+    while (i > 0 && heap[(i - 1) / 2]->due_us > heap[i]->due_us) {
+        swap_events(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(int i) {
+    for (;;) {
+        int smallest = i, child;
+
+        for (child = 2 * i + 1; child <= 2 * i + 2 && child < heap_size; child++) {
+            if (heap[child]->due_us < heap[smallest]->due_us) {
+                smallest = child;
+            }
+        }
+        if (smallest == i) {
+            return;
+        }
+        swap_events(i, smallest);
+        i = smallest;
+    }
+}
+
+static void add_event(event_t* event, node_t* node, void (*fire)(node_t*)) {
+    event->due_us = NEVER;
+    event->period_us = 0;
+    event->node = node;
+    event->fire = fire;
+    event->heap_index = heap_size;
+    heap[heap_size++] = event;
+    sift_up(event->heap_index);
+}
+
+static void schedule(event_t* event, uint64_t due_us) {
+    uint64_t previous = event->due_us;
+
+    event->due_us = due_us;
+    if (due_us < previous) {
+        sift_up(event->heap_index);
+    }
+    else {
+        sift_down(event->heap_index);
+    }
+}
+
+/* start a periodic event one period from now, or stop it for period 0 */
+static void set_period(event_t* event, uint64_t period_us) {
+    event->period_us = period_us;
+    schedule(event, period_us > 0 ? now_us() + period_us : NEVER);
+}
+
+static void arm_timer(void) {
+    uint64_t now = now_us();
+
+    if (heap_size == 0 || heap[0]->due_us == NEVER) {
+        evloop_timer_disarm(timer);
+    }
+    else {
+        evloop_timer_arm(timer, heap[0]->due_us > now
+                ? (heap[0]->due_us - now + 999) / 1000 : 0, 0);
+    }
+}
+
+static void flush(void) {
+    if (!transport_flush(can)) {
+        statistics.failed_flushes++;
+    }
+}
+
+static void on_timer(void* context) {
+    uint64_t now = now_us();
+
+    (void) context;
+    while (heap[0]->due_us <= now) {
+        event_t* event = heap[0];
+        uint64_t due_us = event->due_us + event->period_us;
+
+        /* after a stall, carry on at the normal rate instead of catching up */
+        schedule(event, due_us + MAX_LAG_US > now ? due_us : now + event->period_us);
+        event->fire(event->node);
+    }
+    flush();
+    arm_timer();
+}
+
+/* NMT */
+
+static void send_heartbeat(node_t* node) {
+    struct canfd_frame frame;
+
+    heartbeat_encode(&frame, node->config.node_id, node->state);
+    send_frame(&frame, &statistics.heartbeats);
+}
+
+static void send_pdo(node_t* node) {
+    struct canfd_frame frame;
+
+    bzero(&frame, sizeof(frame));
+    frame.can_id = COB_TPDO1 + node->config.node_id;
+    frame.len = 8;
+    frame.data[0] = node->pdo_count >> 0 & 0xFF;
+    frame.data[1] = node->pdo_count >> 8 & 0xFF;
+    frame.data[2] = node->pdo_count >> 16 & 0xFF;
+    frame.data[3] = node->pdo_count >> 24 & 0xFF;
+    frame.data[4] = node->values[0] >> 0 & 0xFF;
+    frame.data[5] = node->values[0] >> 8 & 0xFF;
+    frame.data[6] = node->values[0] >> 16 & 0xFF;
+    frame.data[7] = node->values[0] >> 24 & 0xFF;
+    node->pdo_count++;
+    send_frame(&frame, &statistics.pdos);
+}
+
+static void set_state(node_t* node, uint8_t state) {
+    node->state = state;
+    if (state == NMT_STATE_OPERATIONAL && node->config.pdos_per_second > 0) {
+        set_period(&node->pdo, 1000000 / node->config.pdos_per_second);
+    }
+    else {
+        set_period(&node->pdo, 0);
+    }
+}
+
+/*
+ * A reset of the node also resets the application objects, a reset of
+ * communication only 0x1000-0x1FFF. Both end in pre-operational after
+ * the boot-up message.
+ */
+static void boot(node_t* node, bool reset_application) {
+    if (reset_application) {
+        bzero(node->values, sizeof(node->values));
+        node->domain_size = snprintf((char*) node->domain, DOMAIN_SIZE,
+                "domain of simulated node %d", node->config.node_id);
+    }
+    node->heartbeat_ms = node->config.heartbeat_ms;
+    node->sdo_state = SDO_IDLE;
+    node->state = NMT_STATE_BOOTUP;
+    send_heartbeat(node);
+    set_state(node, NMT_STATE_PREOPERATIONAL);
+    set_period(&node->heartbeat, node->heartbeat_ms * 1000ul);
+}
+
+static void handle_nmt(node_t* node, uint8_t command_specifier) {
+    switch (command_specifier) {
+    case NMT_START_REMOTE_NODE:
+        set_state(node, NMT_STATE_OPERATIONAL);
+        break;
+    case NMT_STOP_REMOTE_NODE:
+        set_state(node, NMT_STATE_STOPPED);
+        break;
+    case NMT_ENTER_PREOPERATIONAL:
+        set_state(node, NMT_STATE_PREOPERATIONAL);
+        break;
+    case NMT_RESET_NODE:
+        boot(node, true);
+        break;
+    case NMT_RESET_COMMUNICATION:
+        boot(node, false);
+        break;
+    }
+}
+
+/* object dictionary */
+
+static size_t put_value(uint8_t* data, uint32_t value, size_t size) {
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        data[i] = value >> 8 * i & 0xFF;
+    }
+    return size;
+}
+
+static size_t put_string(uint8_t* data, const char* string) {
+    size_t size = strlen(string);
+
+    memcpy(data, string, size);
+    return size;
+}
+
+/* data has room for DOMAIN_SIZE bytes */
+static uint32_t read_object(node_t* node, uint16_t index, uint8_t subindex,
+        uint8_t* data, size_t* size) {
+    const uint32_t identity[] = {
+        VENDOR_ID, PRODUCT_CODE, REVISION_NUMBER, node->config.node_id
+    };
+
+    switch (index) {
+    case 0x1000:
+    case 0x1001:
+    case 0x1008:
+    case 0x1009:
+    case 0x100A:
+    case 0x1017:
+    case 0x2100:
+        if (subindex != 0) {
+            return SDO_ABORT_SUBINDEX_DOES_NOT_EXIST;
+        }
+        break;
+    case 0x1018:
+    case 0x2000:
+        if (subindex > 4) {
+            return SDO_ABORT_SUBINDEX_DOES_NOT_EXIST;
+        }
+        break;
+    default:
+        return SDO_ABORT_OBJECT_DOES_NOT_EXIST;
+    }
+
+    switch (index) {
+    case 0x1000:
+        *size = put_value(data, DEVICE_TYPE, 4);
+        break;
+    case 0x1001:
+        *size = put_value(data, 0, 1); /* error register */
+        break;
+    case 0x1008:
+        *size = put_string(data, DEVICE_NAME);
+        break;
+    case 0x1009:
+        *size = put_string(data, HARDWARE_VERSION);
+        break;
+    case 0x100A:
+        *size = put_string(data, SOFTWARE_VERSION);
+        break;
+    case 0x1017:
+        *size = put_value(data, node->heartbeat_ms, 2);
+        break;
+    case 0x1018:
+        *size = subindex == 0 ? put_value(data, 4, 1)
+                : put_value(data, identity[subindex - 1], 4);
+        break;
+    case 0x2000:
+        *size = subindex == 0 ? put_value(data, VALUE_COUNT, 1)
+                : put_value(data, node->values[subindex - 1], 4);
+        break;
+    case 0x2100:
+        memcpy(data, node->domain, node->domain_size);
+        *size = node->domain_size;
+        break;
+    }
+    return 0;
+}
+
+static uint32_t get_value(const uint8_t* data, size_t size, uint32_t max,
+        uint32_t* value) {
+    size_t i;
+
+    if (size == 0 || size > 4) {
+        return SDO_ABORT_LENGTH_MISMATCH;
+    }
+    *value = 0;
+    for (i = 0; i < size; i++) {
+        *value |= (uint32_t) data[i] << 8 * i;
+    }
+    return *value > max ? SDO_ABORT_VALUE_TOO_HIGH : 0;
+}
+
+static uint32_t write_object(node_t* node, uint16_t index, uint8_t subindex,
+        const uint8_t* data, size_t size) {
+    uint8_t unused[DOMAIN_SIZE];
+    size_t unused_size;
+    uint32_t abort_code = read_object(node, index, subindex, unused, &unused_size);
+    uint32_t value;
+
+    if (abort_code != 0) {
+        return abort_code;
+    }
+    if (index == 0x1017) {
+        if ((abort_code = get_value(data, size, 0xFFFF, &value)) == 0) {
+            node->heartbeat_ms = value;
+            set_period(&node->heartbeat, value * 1000ul);
+        }
+        return abort_code;
+    }
+    if (index == 0x2000 && subindex > 0) {
+        return get_value(data, size, UINT32_MAX, &node->values[subindex - 1]);
+    }
+    if (index == 0x2100) {
+        memcpy(node->domain, data, size);
+        node->domain_size = size;
+        return 0;
+    }
+    return SDO_ABORT_READ_ONLY;
+}
+
+/* SDO server */
+
+static void respond(node_t* node, uint8_t command, uint32_t data) {
+    struct canfd_frame frame;
+
+    bzero(&frame, sizeof(frame));
+    frame.can_id = COB_SDO_TX + node->config.node_id;
+    frame.len = 8;
+    frame.data[0] = command;
+    frame.data[1] = node->index >> 0 & 0xFF;
+    frame.data[2] = node->index >> 8 & 0xFF;
+    frame.data[3] = node->subindex;
+    put_value(&frame.data[4], data, 4);
+    send_frame(&frame, &statistics.sdo_responses);
+}
+
+static void abort_transfer(node_t* node, uint32_t abort_code) {
+    node->sdo_state = SDO_IDLE;
+    respond(node, 0x80, abort_code);
+}
+
+static void send_segment(node_t* node, uint8_t command, const uint8_t* data,
+        size_t size) {
+    struct canfd_frame frame;
+
+    bzero(&frame, sizeof(frame));
+    frame.can_id = COB_SDO_TX + node->config.node_id;
+    frame.len = 8;
+    frame.data[0] = command;
+    if (size > 0) {
+        memcpy(&frame.data[1], data, size);
+    }
+    send_frame(&frame, &statistics.sdo_responses);
+}
+
+static void initiate_upload(node_t* node) {
+    uint32_t abort_code = read_object(node, node->index, node->subindex,
+            node->buffer, &node->size);
+    uint32_t value;
+
+    if (abort_code != 0) {
+        abort_transfer(node, abort_code);
+    }
+    else if (node->size <= 4 && node->size > 0) {
+        get_value(node->buffer, node->size, UINT32_MAX, &value);
+        respond(node, 0x43 | (4 - node->size) << 2, value);
+    }
+    else {
+        node->sdo_state = SDO_UPLOADING;
+        node->offset = 0;
+        node->toggle = 0;
+        respond(node, 0x41, node->size);
+    }
+}
+
+static void initiate_download(node_t* node, const struct canfd_frame* frame) {
+    uint32_t abort_code;
+
+    if (sdo_e(frame)) {
+        size_t size = sdo_s(frame) ? 4 - sdo_n(frame) : 4;
+
+        if ((abort_code = write_object(node, node->index, node->subindex,
+                &frame->data[4], size)) != 0) {
+            abort_transfer(node, abort_code);
+            return;
+        }
+    }
+    else {
+        if (sdo_s(frame) && sdo_data32(frame) > DOMAIN_SIZE) {
+            abort_transfer(node, SDO_ABORT_OUT_OF_MEMORY);
+            return;
+        }
+        node->sdo_state = SDO_DOWNLOADING;
+        node->size = 0;
+        node->toggle = 0;
+    }
+    respond(node, 0x60, 0);
+}
+
+static void handle_sdo_request(node_t* node, const struct canfd_frame* frame) {
+    int toggle = sdo_t(frame);
+    size_t size;
+
+    switch (sdo_cs(frame)) {
+    case 1: /* initiate download */
+        node->sdo_state = SDO_IDLE;
+        node->index = sdo_index(frame);
+        node->subindex = sdo_subindex(frame);
+        initiate_download(node, frame);
+        break;
+    case 2: /* initiate upload */
+        node->sdo_state = SDO_IDLE;
+        node->index = sdo_index(frame);
+        node->subindex = sdo_subindex(frame);
+        initiate_upload(node);
+        break;
+    case 0: /* download segment */
+        if (node->sdo_state != SDO_DOWNLOADING || toggle != node->toggle) {
+            abort_transfer(node, node->sdo_state != SDO_DOWNLOADING
+                    ? SDO_ABORT_COMMAND_SPECIFIER : SDO_ABORT_TOGGLE_BIT);
+            break;
+        }
+        size = 7 - sdo_segment_n(frame);
+        if (node->size + size > DOMAIN_SIZE) {
+            abort_transfer(node, SDO_ABORT_OUT_OF_MEMORY);
+            break;
+        }
+        memcpy(node->buffer + node->size, &frame->data[1], size);
+        node->size += size;
+        node->toggle ^= 1;
+        if (sdo_c(frame)) {
+            uint32_t abort_code = write_object(node, node->index, node->subindex,
+                    node->buffer, node->size);
+            if (abort_code != 0) {
+                abort_transfer(node, abort_code);
+                break;
+            }
+            node->sdo_state = SDO_IDLE;
+        }
+        send_segment(node, 0x20 | toggle << 4, NULL, 0);
+        break;
+    case 3: /* upload segment */
+        if (node->sdo_state != SDO_UPLOADING || toggle != node->toggle) {
+            abort_transfer(node, node->sdo_state != SDO_UPLOADING
+                    ? SDO_ABORT_COMMAND_SPECIFIER : SDO_ABORT_TOGGLE_BIT);
+            break;
+        }
+        size = node->size - node->offset < 7 ? node->size - node->offset : 7;
+        send_segment(node, toggle << 4 | (7 - size) << 1
+                | (node->offset + size == node->size), node->buffer + node->offset,
+                size);
+        node->offset += size;
+        node->toggle ^= 1;
+        if (node->offset == node->size) {
+            node->sdo_state = SDO_IDLE;
+        }
+        break;
+    case 4: /* abort */
+        node->sdo_state = SDO_IDLE;
+        break;
+    default: /* block transfers */
+        node->index = sdo_index(frame);
+        node->subindex = sdo_subindex(frame);
+        abort_transfer(node, SDO_ABORT_COMMAND_SPECIFIER);
+        break;
+    }
+}
+
+static void on_can_readable(void* context) {
+    struct canfd_frame frames[TRANSPORT_BATCH_SIZE];
+    int count = transport_read_batch(can, frames, NULL, TRANSPORT_BATCH_SIZE);
+    int i, j;
+
+    (void) context;
+    if (count < 0) {
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < count; i++) {
+        const struct canfd_frame* frame = &frames[i];
+        node_t* node = nodes[sdo_request_node(frame)];
+
+        if (is_nmt_command(frame)) {
+            for (j = 1; j < 128; j++) {
+                if (nodes[j] != NULL && (nmt_node_id(frame) == j || nmt_node_id(frame) == 0)) {
+                    handle_nmt(nodes[j], nmt_command_specifier(frame));
+                }
+            }
+        }
+        else if (node != NULL && frame->len == 8 && node->state != NMT_STATE_STOPPED) {
+            handle_sdo_request(node, frame);
+        }
+    }
+    flush();
+    arm_timer();
+}
+
+static void print_statistics(void) {
+    double seconds = (now_us() - started_us) / 1e6;
+    double bits_per_second = seconds > 0 ? statistics.bits / seconds : 0;
+
+    fprintf(stderr, "%.1f s: %lu heartbeats, %lu PDOs, %lu SDO responses, "
+            "%.0f bit/s (%.1f%% of 1 Mbit/s)", seconds, statistics.heartbeats,
+            statistics.pdos, statistics.sdo_responses, bits_per_second,
+            bits_per_second / 1e4);
+    if (statistics.failed_flushes > 0) {
+        fprintf(stderr, ", %lu failed sends", statistics.failed_flushes);
+    }
+    fprintf(stderr, "\n");
+}
+
+static void on_signal(void* context) {
+    struct signalfd_siginfo info;
+
+    (void) context;
+    if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+        return;
+    }
+    if (info.ssi_signo == SIGUSR1) {
+        print_statistics();
+    }
+    else {
+        evloop_stop(loop);
+    }
+}
+
+void simulate(char* can_interface, const simulated_node_t* configs, int node_count) {
+    static const struct can_filter filters[] = {
+        { COB_NMT, CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG },
+        { COB_SDO_RX, 0x780 | CAN_EFF_FLAG | CAN_RTR_FLAG }
+    };
+    sigset_t signals;
+    int i;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    if ((signal_fd = signalfd(-1, &signals, SFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "signalfd failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    loop = open_loop();
+    if ((can = transport_open(can_interface)) == NULL
+            || !transport_set_filters(can, filters, sizeof(filters) / sizeof(filters[0]))
+            || !evloop_add_fd(loop, transport_fileno(can), on_can_readable, NULL)
+            || !evloop_add_fd(loop, signal_fd, on_signal, NULL)
+            || (timer = evloop_add_timer(loop, on_timer, NULL)) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < node_count; i++) {
+        node_t* node = calloc(1, sizeof(node_t));
+
+        if (node == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        node->config = configs[i];
+        nodes[node->config.node_id] = node;
+        add_event(&node->heartbeat, node, send_heartbeat);
+        add_event(&node->pdo, node, send_pdo);
+    }
+
+    started_us = now_us();
+    for (i = 0; i < node_count; i++) {
+        node_t* node = nodes[configs[i].node_id];
+
+        boot(node, true);
+        if (node->config.state != NMT_STATE_PREOPERATIONAL) {
+            set_state(node, node->config.state);
+        }
+        /* spread the heartbeats over their period, as nodes boot at different times */
+        if (node->heartbeat.period_us > 0) {
+            schedule(&node->heartbeat,
+                    started_us + node->heartbeat.period_us * (i + 1) / node_count);
+        }
+    }
+    flush();
+    arm_timer();
+
+    if (!evloop_run(loop)) {
+        exit(EXIT_FAILURE);
+    }
+    print_statistics();
+    transport_close(can);
+}
@@ -13,77 +13,740 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <arpa/inet.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
 #include <linux/can.h>
-#include <curses.h>
+#include <linux/can/raw.h>
 
-static volatile int can_fd = -1;
+#include "socketcan.h"
 
-static void exit_failure(char* format, ...)
-{
-    endwin();
+/* maximum number of frames fetched or sent by one batched call */
+#define SOCKETCAN_BATCH_SIZE 64
+
+/*
+ * Frames held back while the kernel TX queue is full, and how long they
+ * are retried without progress before they are dropped.
+ */
+#define SOCKETCAN_TX_QUEUE_SIZE 1024
+#define SOCKETCAN_TX_TIMEOUT_MS 1000
+
+/*
+ * PACKET_MMAP capture ring: the kernel fills whole blocks of frames and
+ * retires a partly filled block after RING_BLOCK_TIMEOUT_MS.
+ */
+#define RING_BLOCK_SIZE      (1 << 16)
+#define RING_BLOCK_NR        64
+#define RING_FRAME_SIZE      (1 << 7)
+#define RING_BLOCK_TIMEOUT_MS 10
+
+typedef struct socketcan {
+    transport_t transport;
+    int fd;
+    char interface_name[IFNAMSIZ];
+    unsigned long rx_packets_at_open;
+    unsigned long rx_accepted;
+    struct canfd_frame tx_queue[SOCKETCAN_TX_QUEUE_SIZE]; /* a ring */
+    int tx_head;
+    int tx_queued;
+    bool tx_failed; /* frames were dropped since the last flush */
+
+    /* retries of a full kernel TX queue, see tx_backoff() */
+    int tx_timer_fd;
+    bool tx_retry_armed;
+    long tx_delay_us;
+    long tx_waited_us;
+
+    /* epoll set of rx_fd and tx_timer_fd, what the transport's fileno is */
+    int poll_fd;
+
+    /* capture ring, only used if rx_fd differs from fd */
+    int rx_fd;
+    uint8_t* ring;
+    unsigned int block;
+    struct tpacket3_hdr* packet;
+    unsigned int packets_left;
+    unsigned long rx_dropped;
 
+    struct socketcan* next;
+} socketcan_t;
+
+/* open sockets, for the statistics printed on exit */
+static socketcan_t* open_sockets = NULL;
+static pthread_mutex_t open_sockets_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool statistics_enabled = false;
+static bool packet_mmap_enabled = false;
+static bool hardware_timestamps_enabled = false;
+
+static void report_error(socketcan_t* can, char* format, ...)
+{
     va_list args;
     va_start(args, format);
+    fprintf(stderr, "%s: ", can->interface_name);
     vfprintf(stderr, format, args);
     va_end(args);
+}
+
+/* undo a partly done socketcan_open() */
+static transport_t* open_failed(socketcan_t* can) {
+    if (can->poll_fd >= 0) {
+        close(can->poll_fd);
+    }
+    if (can->tx_timer_fd >= 0) {
+        close(can->tx_timer_fd);
+    }
+    if (can->ring != NULL && can->ring != MAP_FAILED) {
+        munmap(can->ring, RING_BLOCK_SIZE * RING_BLOCK_NR);
+    }
+    if (can->rx_fd >= 0 && can->rx_fd != can->fd) {
+        close(can->rx_fd);
+    }
+    if (can->fd >= 0) {
+        close(can->fd);
+    }
+    free(can);
+    return NULL;
+}
+
+/*
+ * Frame counter of the network device, covering all frames the interface
+ * received regardless of any socket filter.
+ */
+static unsigned long interface_rx_packets(socketcan_t* can) {
+    char path[64 + IFNAMSIZ];
+    unsigned long rx_packets = 0;
+    FILE* f;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_packets",
+            can->interface_name);
+    if ((f = fopen(path, "r")) != NULL) {
+        if (fscanf(f, "%lu", &rx_packets) != 1) {
+            rx_packets = 0;
+        }
+        fclose(f);
+    }
+    return rx_packets;
+}
+
+/*
+ * Kernel software time stamps are taken on CLOCK_REALTIME. Move them to
+ * CLOCK_MONOTONIC using the current offset between both clocks, sampled
+ * once per batch through the vDSO, so clock adjustments between two
+ * batches do not show up as jumps in the reported times.
+ */
+static struct timespec realtime_offset(void) {
+    struct timespec realtime, monotonic, offset;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    offset.tv_sec = realtime.tv_sec - monotonic.tv_sec;
+    offset.tv_nsec = realtime.tv_nsec - monotonic.tv_nsec;
+    if (offset.tv_nsec < 0) {
+        offset.tv_sec--;
+        offset.tv_nsec += 1000000000L;
+    }
+    return offset;
+}
+
+static void realtime_to_monotonic(struct timespec* ts,
+        const struct timespec* offset) {
+    ts->tv_sec -= offset->tv_sec;
+    ts->tv_nsec -= offset->tv_nsec;
+    if (ts->tv_nsec < 0) {
+        ts->tv_sec--;
+        ts->tv_nsec += 1000000000L;
+    }
+}
+
+/*
+ * Receive through an AF_PACKET socket with a TPACKET_V3 ring instead of
+ * the raw socket, which is then only used for transmission.
+ */
+static bool open_packet_ring(socketcan_t* can, int ifindex) {
+    if ((can->rx_fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_CAN))) < 0) {
+        report_error(can, "packet socket failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    const int version = TPACKET_V3;
+    if (setsockopt(can->rx_fd, SOL_PACKET, PACKET_VERSION, &version,
+            sizeof(version)) < 0) {
+        report_error(can, "setsockopt PACKET_VERSION failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* our own frames, older kernels do not know this option */
+    const int ignore_outgoing = 1;
+    setsockopt(can->rx_fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+            &ignore_outgoing, sizeof(ignore_outgoing));
+
+    struct tpacket_req3 req;
+    bzero(&req, sizeof(req));
+    req.tp_block_size = RING_BLOCK_SIZE;
+    req.tp_block_nr = RING_BLOCK_NR;
+    req.tp_frame_size = RING_FRAME_SIZE;
+    req.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * RING_BLOCK_NR;
+    req.tp_retire_blk_tov = RING_BLOCK_TIMEOUT_MS;
+    if (setsockopt(can->rx_fd, SOL_PACKET, PACKET_RX_RING, &req,
+            sizeof(req)) < 0) {
+        report_error(can, "setsockopt PACKET_RX_RING failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    can->ring = mmap(NULL, RING_BLOCK_SIZE * RING_BLOCK_NR,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, can->rx_fd, 0);
+    if (can->ring == MAP_FAILED) {
+        report_error(can, "mmap of capture ring failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct sockaddr_ll addr;
+    bzero(&addr, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_CAN);
+    addr.sll_ifindex = ifindex;
+    if (bind(can->rx_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        report_error(can, "bind of packet socket failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* nothing is read from the raw socket anymore */
+    if (setsockopt(can->fd, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0) < 0) {
+        report_error(can, "setsockopt CAN_RAW_FILTER failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Classic frames arrive as CAN_MTU bytes, where struct canfd_frame has
+ * its flags; tell both apart by CANFD_FDF from here on.
+ */
+static void mark_frame_format(struct canfd_frame* frame, size_t length) {
+    if (length == CANFD_MTU) {
+        frame->flags |= CANFD_FDF;
+    }
+    else {
+        frame->flags = 0;
+    }
+}
+
+static int read_packet_ring(socketcan_t* can, struct canfd_frame* frames,
+        transport_timestamp_t* timestamps, int count) {
+    struct timespec offset = realtime_offset();
+    int received = 0;
+
+    while (received < count) {
+        struct tpacket_block_desc* block = (struct tpacket_block_desc*)
+                (can->ring + can->block * RING_BLOCK_SIZE);
+
+        if (can->packets_left == 0) {
+            uint32_t status = __atomic_load_n(&block->hdr.bh1.block_status,
+                    __ATOMIC_ACQUIRE);
+            if (!(status & TP_STATUS_USER)) {
+                break;
+            }
+            can->packet = (struct tpacket3_hdr*)
+                    ((uint8_t*) block + block->hdr.bh1.offset_to_first_pkt);
+            can->packets_left = block->hdr.bh1.num_pkts;
+        }
+
+        if (can->packets_left > 0) {
+            struct tpacket3_hdr* packet = can->packet;
+            if (packet->tp_snaplen == CAN_MTU || packet->tp_snaplen == CANFD_MTU) {
+                memcpy(&frames[received], (uint8_t*) packet + packet->tp_mac,
+                        packet->tp_snaplen);
+                mark_frame_format(&frames[received], packet->tp_snaplen);
+                if (timestamps != NULL) {
+                    bzero(&timestamps[received], sizeof(transport_timestamp_t));
+                    timestamps[received].monotonic.tv_sec = packet->tp_sec;
+                    timestamps[received].monotonic.tv_nsec = packet->tp_nsec;
+                    realtime_to_monotonic(&timestamps[received].monotonic, &offset);
+                }
+                received++;
+            }
+            can->packet = (struct tpacket3_hdr*)
+                    ((uint8_t*) packet + packet->tp_next_offset);
+            can->packets_left--;
+        }
+
+        if (can->packets_left == 0) {
+            __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                    __ATOMIC_RELEASE);
+            can->block = (can->block + 1) % RING_BLOCK_NR;
+        }
+    }
+
+    can->rx_accepted += received;
+    return received;
+}
+
+void socketcan_enable_packet_mmap(void) {
+    packet_mmap_enabled = true;
+}
+
+void socketcan_enable_hardware_timestamps(void) {
+    hardware_timestamps_enabled = true;
+}
+
+/*
+ * Let the controller time stamp received frames. This configures the
+ * network device for all its users, so a configuration that already
+ * stamps received frames is kept and nothing else of it is changed.
+ */
+static void enable_hardware_timestamps(socketcan_t* can, struct ifreq* ifr) {
+    struct hwtstamp_config hwtstamp;
+
+    bzero(&hwtstamp, sizeof(hwtstamp));
+    ifr->ifr_data = (void*) &hwtstamp;
+    if (ioctl(can->fd, SIOCGHWTSTAMP, ifr) < 0) {
+        report_error(can, "no hardware time stamps: %s\n", strerror(errno));
+        return;
+    }
+    if (hwtstamp.rx_filter != HWTSTAMP_FILTER_NONE) {
+        return;
+    }
+    hwtstamp.rx_filter = HWTSTAMP_FILTER_ALL;
+    if (ioctl(can->fd, SIOCSHWTSTAMP, ifr) < 0) {
+        report_error(can, "no hardware time stamps: %s\n", strerror(errno));
+    }
+}
+
+static int socketcan_fileno(transport_t* transport) {
+    return ((socketcan_t*) transport)->poll_fd;
+}
+
+static void drop_queued(socketcan_t* can) {
+    can->tx_queued = 0;
+    can->tx_failed = true;
+    can->tx_delay_us = 0;
+    can->tx_waited_us = 0;
+}
+
+/*
+ * The kernel reports a full CAN TX queue with ENOBUFS and does not signal
+ * POLLOUT when it drains again. Keep the frames and retry from a timer,
+ * with growing delays, which makes the transport's fileno readable.
+ */
+static void tx_backoff(socketcan_t* can) {
+    struct itimerspec spec;
+
+    if (can->tx_waited_us >= SOCKETCAN_TX_TIMEOUT_MS * 1000L) {
+        report_error(can, "sendmmsg failed: %s\n", strerror(ENOBUFS));
+        drop_queued(can);
+        return;
+    }
+    if (can->tx_delay_us == 0) {
+        can->tx_delay_us = 100;
+    }
+    else if (can->tx_delay_us < 10000L) {
+        can->tx_delay_us *= 2;
+    }
+    bzero(&spec, sizeof(spec));
+    spec.it_value.tv_nsec = can->tx_delay_us * 1000L;
+    if (timerfd_settime(can->tx_timer_fd, 0, &spec, NULL) < 0) {
+        report_error(can, "timerfd_settime failed: %s\n", strerror(errno));
+        drop_queued(can);
+        return;
+    }
+    can->tx_retry_armed = true;
+    can->tx_waited_us += can->tx_delay_us;
+}
 
-    socketcan_close();
+/* frames that cannot be sent are dropped, like on a congested bus */
+static void send_queued(socketcan_t* can) {
+    struct mmsghdr msgs[SOCKETCAN_BATCH_SIZE];
+    struct iovec iovs[SOCKETCAN_BATCH_SIZE];
+    int count;
+    int i;
 
-    exit(EXIT_FAILURE);
+    while (can->tx_queued > 0) {
+        count = can->tx_queued < SOCKETCAN_BATCH_SIZE ? can->tx_queued : SOCKETCAN_BATCH_SIZE;
+        bzero(msgs, count * sizeof(msgs[0]));
+        for (i = 0; i < count; i++) {
+            struct canfd_frame* frame =
+                    &can->tx_queue[(can->tx_head + i) % SOCKETCAN_TX_QUEUE_SIZE];
+            iovs[i].iov_base = frame;
+            iovs[i].iov_len = frame->flags & CANFD_FDF ? CANFD_MTU : CAN_MTU;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int result = sendmmsg(can->fd, msgs, count, MSG_DONTWAIT);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS || errno == EAGAIN) {
+                tx_backoff(can);
+                return;
+            }
+            report_error(can, "sendmmsg failed: %s\n", strerror(errno));
+            drop_queued(can);
+            return;
+        }
+        can->tx_head = (can->tx_head + result) % SOCKETCAN_TX_QUEUE_SIZE;
+        can->tx_queued -= result;
+        can->tx_delay_us = 0;
+        can->tx_waited_us = 0;
+    }
+}
+
+/* a due retry is only sent from here, never ahead of the timer */
+static void retry_queued(socketcan_t* can) {
+    uint64_t expirations;
+
+    if (can->tx_retry_armed
+            && read(can->tx_timer_fd, &expirations, sizeof(expirations)) > 0) {
+        can->tx_retry_armed = false;
+        send_queued(can);
+    }
+}
+
+static void socketcan_queue(transport_t* transport, const struct canfd_frame* frame) {
+    socketcan_t* can = (socketcan_t*) transport;
+
+    if (can->tx_queued >= SOCKETCAN_BATCH_SIZE && !can->tx_retry_armed) {
+        send_queued(can);
+    }
+    if (can->tx_queued == SOCKETCAN_TX_QUEUE_SIZE) {
+        can->tx_failed = true;
+        return;
+    }
+    can->tx_queue[(can->tx_head + can->tx_queued) % SOCKETCAN_TX_QUEUE_SIZE] = *frame;
+    can->tx_queued++;
+}
+
+/*
+ * Frames held back by a full kernel queue are still sent later, when the
+ * caller reads the transport, so only dropped frames make this fail.
+ */
+static bool socketcan_flush(transport_t* transport) {
+    socketcan_t* can = (socketcan_t*) transport;
+    bool sent_all;
+
+    if (!can->tx_retry_armed) {
+        send_queued(can);
+    }
+    sent_all = !can->tx_failed;
+    can->tx_failed = false;
+    return sent_all;
+}
+
+static int socketcan_read_batch(transport_t* transport,
+        struct canfd_frame* frames, transport_timestamp_t* timestamps, int count) {
+    socketcan_t* can = (socketcan_t*) transport;
+    struct mmsghdr msgs[SOCKETCAN_BATCH_SIZE];
+    struct iovec iovs[SOCKETCAN_BATCH_SIZE];
+    char control[SOCKETCAN_BATCH_SIZE][CMSG_SPACE(sizeof(struct scm_timestamping))];
+    int i;
+
+    retry_queued(can);
+
+    if (can->rx_fd != can->fd) {
+        return read_packet_ring(can, frames, timestamps, count);
+    }
+
+    if (count > SOCKETCAN_BATCH_SIZE) {
+        count = SOCKETCAN_BATCH_SIZE;
+    }
+
+    bzero(msgs, count * sizeof(msgs[0]));
+    for (i = 0; i < count; i++) {
+        iovs[i].iov_base = &frames[i];
+        iovs[i].iov_len = sizeof(struct canfd_frame);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (timestamps != NULL) {
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+    }
+
+    int received = recvmmsg(can->fd, msgs, count, MSG_DONTWAIT, NULL);
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        report_error(can, "recvmmsg failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < received; i++) {
+        mark_frame_format(&frames[i], msgs[i].msg_len);
+    }
+    can->rx_accepted += received;
+
+    if (timestamps != NULL) {
+        struct timespec offset = realtime_offset();
+
+        for (i = 0; i < received; i++) {
+            struct cmsghdr* cmsg;
+            bzero(&timestamps[i], sizeof(transport_timestamp_t));
+            for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+                    cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET
+                        && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                    struct scm_timestamping stamps;
+                    memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+                    timestamps[i].monotonic = stamps.ts[0];
+                    realtime_to_monotonic(&timestamps[i].monotonic, &offset);
+                    timestamps[i].hardware = stamps.ts[2];
+                }
+            }
+        }
+    }
+
+    return received;
+}
+
+static bool socketcan_set_filters(transport_t* transport,
+        const struct can_filter* filters, int count) {
+    socketcan_t* can = (socketcan_t*) transport;
+
+    if (can->rx_fd != can->fd) {
+        return true; /* the capture ring delivers everything */
+    }
+    if (setsockopt(can->fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
+            count * sizeof(struct can_filter)) < 0) {
+        report_error(can, "setsockopt CAN_RAW_FILTER failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
 }
 
-int socketcan_open(char* interface_name) {
-    if ((can_fd = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-        exit_failure("socket failed: %s\n", strerror(errno));
+static bool socketcan_set_error_mask(transport_t* transport, can_err_mask_t mask) {
+    socketcan_t* can = (socketcan_t*) transport;
+
+    if (setsockopt(can->fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &mask,
+            sizeof(mask)) < 0) {
+        report_error(can, "setsockopt CAN_RAW_ERR_FILTER failed: %s\n", strerror(errno));
+        return false;
     }
+    return true;
+}
 
+static bool socketcan_enable_fd(transport_t* transport) {
+    socketcan_t* can = (socketcan_t*) transport;
     struct ifreq ifr;
-    strncpy(ifr.ifr_name, interface_name, sizeof(ifr.ifr_name));
-    if (ioctl(can_fd, SIOCGIFINDEX, &ifr) < 0) {
-        exit_failure("failed to enumerate can interface: %s\n", strerror(errno));
+
+    bzero(&ifr, sizeof(ifr));
+    memcpy(ifr.ifr_name, can->interface_name, sizeof(ifr.ifr_name));
+    if (ioctl(can->fd, SIOCGIFMTU, &ifr) < 0 || ifr.ifr_mtu != CANFD_MTU) {
+        return false; /* controller or driver without CAN FD */
     }
 
-    struct sockaddr_can addr;
-    addr.can_family = AF_CAN;
-    addr.can_ifindex = ifr.ifr_ifindex;
-    if (bind(can_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-        exit_failure("bind failed: %s\n", strerror(errno));
+    const int enable = 1;
+    if (setsockopt(can->fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable,
+            sizeof(enable)) < 0) {
+        return false;
+    }
+
+    if (can->rx_fd != can->fd) {
+        /* CAN FD frames are ETH_P_CANFD packets, receive both kinds */
+        struct sockaddr_ll addr;
+        bzero(&addr, sizeof(addr));
+        addr.sll_family = AF_PACKET;
+        addr.sll_protocol = htons(ETH_P_ALL);
+        if (ioctl(can->fd, SIOCGIFINDEX, &ifr) < 0) {
+            report_error(can, "failed to enumerate can interface: %s\n", strerror(errno));
+            return false;
+        }
+        addr.sll_ifindex = ifr.ifr_ifindex;
+        if (bind(can->rx_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            report_error(can, "bind of packet socket failed: %s\n", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Frames delivered to this socket since it was opened, and frames the
+ * interface received in that time but the kernel filter dropped.
+ */
+static void socketcan_statistics(socketcan_t* can, unsigned long* accepted,
+        unsigned long* rejected) {
+    unsigned long received = interface_rx_packets(can) - can->rx_packets_at_open;
+
+    *accepted = can->rx_accepted;
+    *rejected = received > can->rx_accepted ? received - can->rx_accepted : 0;
+}
+
+static void print_statistics(socketcan_t* can) {
+    unsigned long accepted, rejected;
+
+    socketcan_statistics(can, &accepted, &rejected);
+    fprintf(stderr, "%s: %lu frames accepted, %lu rejected by kernel filter",
+            can->interface_name, accepted, rejected);
+    if (can->rx_fd != can->fd) {
+        struct tpacket_stats_v3 stats;
+        socklen_t length = sizeof(stats);
+        if (getsockopt(can->rx_fd, SOL_PACKET, PACKET_STATISTICS, &stats,
+                &length) == 0) {
+            can->rx_dropped += stats.tp_drops;
+        }
+        fprintf(stderr, ", %lu dropped by capture ring", can->rx_dropped);
     }
+    fprintf(stderr, "\n");
+}
+
+static void print_open_sockets_statistics(void) {
+    socketcan_t* can;
 
-    return can_fd;
+    pthread_mutex_lock(&open_sockets_lock);
+    for (can = open_sockets; can != NULL; can = can->next) {
+        print_statistics(can);
+    }
+    pthread_mutex_unlock(&open_sockets_lock);
 }
 
-void socketcan_write(struct can_frame frame) {
-    if ( write(can_fd, &frame, sizeof(struct can_frame)) < 0) {
-        exit_failure("write failed: %s\n", strerror(errno));
+void socketcan_enable_statistics(void) {
+    if (!statistics_enabled) {
+        statistics_enabled = true;
+        atexit(print_open_sockets_statistics);
     }
 }
 
-int socketcan_read(struct can_frame* frame, struct timeval* timeout) {
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET(can_fd, &rfds);
-    if (select(FD_SETSIZE, &rfds, NULL, NULL, timeout) < 0) {
-        exit_failure("select failed: ", strerror(errno));
+static void socketcan_close(transport_t* transport) {
+    socketcan_t* can = (socketcan_t*) transport;
+    socketcan_t** link;
+
+    pthread_mutex_lock(&open_sockets_lock);
+    for (link = &open_sockets; *link != NULL; link = &(*link)->next) {
+        if (*link == can) {
+            *link = can->next;
+            break;
+        }
     }
-    if (FD_ISSET(can_fd, &rfds)) {
-        if (read(can_fd, frame, sizeof(struct can_frame)) < 0) {
-            exit_failure("read failed: ", strerror(errno));
+    pthread_mutex_unlock(&open_sockets_lock);
+
+    /* whatever a full kernel queue held back still goes out, if it can */
+    while (can->tx_queued > 0) {
+        struct pollfd pollfd = { can->tx_timer_fd, POLLIN, 0 };
+        if (!can->tx_retry_armed) {
+            send_queued(can);
+        }
+        else if (poll(&pollfd, 1, -1) >= 0 || errno == EINTR) {
+            retry_queued(can);
+        }
+        else {
+            break;
         }
     }
-    return FD_ISSET(can_fd, &rfds);
+
+    if (statistics_enabled) {
+        print_statistics(can);
+    }
+    close(can->poll_fd);
+    close(can->tx_timer_fd);
+    if (can->rx_fd != can->fd) {
+        munmap(can->ring, RING_BLOCK_SIZE * RING_BLOCK_NR);
+        close(can->rx_fd);
+    }
+    close(can->fd);
+    free(can);
 }
 
-void socketcan_close(void) {
-    if ( can_fd > 0 ) {
-        close(can_fd);
+static const transport_ops_t socketcan_ops = {
+    .fileno = socketcan_fileno,
+    .queue = socketcan_queue,
+    .flush = socketcan_flush,
+    .read_batch = socketcan_read_batch,
+    .set_filters = socketcan_set_filters,
+    .set_error_mask = socketcan_set_error_mask,
+    .enable_fd = socketcan_enable_fd,
+    .close = socketcan_close,
+};
+
+transport_t* socketcan_open(char* interface_name) {
+    socketcan_t* can = calloc(1, sizeof(socketcan_t));
+    if (can == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return NULL;
+    }
+    can->transport.ops = &socketcan_ops;
+    can->rx_fd = -1;
+    can->tx_timer_fd = -1;
+    can->poll_fd = -1;
+    strncpy(can->interface_name, interface_name, sizeof(can->interface_name) - 1);
+
+    if ((can->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+        report_error(can, "socket failed: %s\n", strerror(errno));
+        return open_failed(can);
+    }
+
+    struct ifreq ifr;
+    bzero(&ifr, sizeof(ifr));
+    memcpy(ifr.ifr_name, can->interface_name, sizeof(ifr.ifr_name));
+    if (ioctl(can->fd, SIOCGIFINDEX, &ifr) < 0) {
+        report_error(can, "failed to enumerate can interface: %s\n", strerror(errno));
+        return open_failed(can);
+    }
+
+    struct sockaddr_can addr;
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(can->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        report_error(can, "bind failed: %s\n", strerror(errno));
+        return open_failed(can);
+    }
+
+    /* software time stamps always work, hardware ones only on request */
+    int timestamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (hardware_timestamps_enabled) {
+        enable_hardware_timestamps(can, &ifr);
+        timestamping |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    }
+    if (setsockopt(can->fd, SOL_SOCKET, SO_TIMESTAMPING, &timestamping,
+            sizeof(timestamping)) < 0) {
+        report_error(can, "setsockopt SO_TIMESTAMPING failed: %s\n", strerror(errno));
+        return open_failed(can);
+    }
+
+    can->rx_fd = can->fd;
+    if (packet_mmap_enabled && !open_packet_ring(can, ifr.ifr_ifindex)) {
+        return open_failed(can);
+    }
+
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.events = EPOLLIN;
+    if ((can->tx_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0
+            || (can->poll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0
+            || epoll_ctl(can->poll_fd, EPOLL_CTL_ADD, can->rx_fd, &event) < 0
+            || epoll_ctl(can->poll_fd, EPOLL_CTL_ADD, can->tx_timer_fd, &event) < 0) {
+        report_error(can, "cannot wait for the socket: %s\n", strerror(errno));
+        return open_failed(can);
     }
+
+    can->rx_packets_at_open = interface_rx_packets(can);
+
+    pthread_mutex_lock(&open_sockets_lock);
+    can->next = open_sockets;
+    open_sockets = can;
+    pthread_mutex_unlock(&open_sockets_lock);
+
+    return &can->transport;
 }
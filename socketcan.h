@@ -1,4 +1,3 @@
-/*
 /*
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -17,11 +16,40 @@
 #ifndef SOCKETCAN_H_
 #define SOCKETCAN_H_
 
-#include <net/if.h>
-#include <linux/can.h>
+#include "transport.h"
 
-void socketcan_open(char* interface_name);
-void socketcan_write(struct can_frame frame);
-int socketcan_read(struct can_frame *frame, struct timeval* timeout);
+/*
+ * Transport backend for a raw CAN socket bound to an interface. Frames
+ * are received with recvmmsg() and sent with sendmmsg(), the filters are
+ * installed in the kernel as CAN_RAW_FILTER. One thread may receive while
+ * another changes the filters, but the transmit queue is not thread safe.
+ *
+ * Sending never blocks: frames a full kernel TX queue holds back are
+ * retried each time the transport becomes readable and is read, and at
+ * the latest when it is closed.
+ */
+transport_t* socketcan_open(char* interface_name);
+
+/*
+ * Let sockets opened from now on receive through a memory-mapped
+ * AF_PACKET ring (TPACKET_V3) handed over by the kernel block by block.
+ * Meant for capturing at full bus load; kernel filters are not applied.
+ */
+void socketcan_enable_packet_mmap(void);
+
+/*
+ * Let sockets opened from now on also report the controller's time stamp
+ * of received frames. Unless the device stamps received frames already,
+ * this switches that on for the whole device, which needs CAP_NET_ADMIN
+ * and driver support; without it only software time stamps are taken.
+ */
+void socketcan_enable_hardware_timestamps(void);
+
+/*
+ * Print for every socket, when it is closed or on exit, how many frames
+ * it received and how many the interface received but the kernel filter
+ * dropped.
+ */
+void socketcan_enable_statistics(void);
 
 #endif /* SOCKETCAN_H_ */
@@ -0,0 +1,66 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "transport.h"
+#include "socketcan.h"
+#include "membus.h"
+
+transport_t* transport_open(char* name) {
+    if (!strncmp(name, TRANSPORT_MEMBUS_PREFIX, strlen(TRANSPORT_MEMBUS_PREFIX))) {
+        return membus_open(name + strlen(TRANSPORT_MEMBUS_PREFIX));
+    }
+    return socketcan_open(name);
+}
+
+int transport_fileno(transport_t* transport) {
+    return transport->ops->fileno(transport);
+}
+
+bool transport_write(transport_t* transport, const struct canfd_frame* frame) {
+    transport->ops->queue(transport, frame);
+    return transport->ops->flush(transport);
+}
+
+void transport_queue(transport_t* transport, const struct canfd_frame* frame) {
+    transport->ops->queue(transport, frame);
+}
+
+bool transport_flush(transport_t* transport) {
+    return transport->ops->flush(transport);
+}
+
+int transport_read_batch(transport_t* transport, struct canfd_frame* frames,
+        transport_timestamp_t* timestamps, int count) {
+    return transport->ops->read_batch(transport, frames, timestamps, count);
+}
+
+bool transport_set_filters(transport_t* transport,
+        const struct can_filter* filters, int count) {
+    return transport->ops->set_filters(transport, filters, count);
+}
+
+bool transport_set_error_mask(transport_t* transport, can_err_mask_t mask) {
+    return transport->ops->set_error_mask(transport, mask);
+}
+
+bool transport_enable_fd(transport_t* transport) {
+    return transport->ops->enable_fd(transport);
+}
+
+void transport_close(transport_t* transport) {
+    transport->ops->close(transport);
+}
@@ -0,0 +1,118 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <stdbool.h>
+#include <time.h>
+#include <linux/can.h>
+#include <linux/can/error.h>
+
+/* marks CAN FD frames among classic ones, missing in older kernel headers */
+#ifndef CANFD_FDF
+#define CANFD_FDF 0x04
+#endif
+
+/* maximum number of frames fetched by one transport_read_batch() call */
+#define TRANSPORT_BATCH_SIZE 64
+
+/* prefix of bus names served by the in-memory backend */
+#define TRANSPORT_MEMBUS_PREFIX "mem:"
+
+/*
+ * Receive time of a frame. monotonic is on CLOCK_MONOTONIC, hardware is
+ * the raw time stamp of the CAN controller's clock or zero if unknown.
+ */
+typedef struct {
+    struct timespec monotonic;
+    struct timespec hardware;
+} transport_timestamp_t;
+
+/*
+ * A connection to one CAN bus. Frames of either format are passed as
+ * struct canfd_frame, CAN FD frames have CANFD_FDF set in flags. Backends
+ * embed struct transport as their first member and fill in the operations.
+ * Failures are described on stderr and returned to the caller; nothing in
+ * here exits the process.
+ */
+typedef struct transport transport_t;
+
+typedef struct {
+    int (*fileno)(transport_t* transport);
+    void (*queue)(transport_t* transport, const struct canfd_frame* frame);
+    bool (*flush)(transport_t* transport);
+    int (*read_batch)(transport_t* transport, struct canfd_frame* frames,
+            transport_timestamp_t* timestamps, int count);
+    bool (*set_filters)(transport_t* transport,
+            const struct can_filter* filters, int count);
+    bool (*set_error_mask)(transport_t* transport, can_err_mask_t mask);
+    bool (*enable_fd)(transport_t* transport);
+    void (*close)(transport_t* transport);
+} transport_ops_t;
+
+struct transport {
+    const transport_ops_t* ops;
+};
+
+/*
+ * Open "mem:<name>" on the in-memory bus of that name, anything else as a
+ * SocketCAN interface. Returns NULL if that fails.
+ */
+transport_t* transport_open(char* name);
+
+/* becomes readable when frames are waiting */
+int transport_fileno(transport_t* transport);
+
+/* returns false if the frame could not be sent */
+bool transport_write(transport_t* transport, const struct canfd_frame* frame);
+
+/*
+ * Append a frame to the transmit queue. Queued frames are sent together
+ * on transport_flush(), or earlier when the queue is full. The flush
+ * returns false if any frame queued since the last one was not sent.
+ */
+void transport_queue(transport_t* transport, const struct canfd_frame* frame);
+bool transport_flush(transport_t* transport);
+
+/*
+ * Fetch up to count waiting frames without blocking. timestamps may be
+ * NULL. Returns the number of frames read, or -1 if the bus failed.
+ */
+int transport_read_batch(transport_t* transport, struct canfd_frame* frames,
+        transport_timestamp_t* timestamps, int count);
+
+/*
+ * Deliver only frames with (can_id & can_mask) == (filter.can_id & can_mask)
+ * for any filter, like CAN_RAW_FILTER. An empty list delivers nothing.
+ */
+bool transport_set_filters(transport_t* transport,
+        const struct can_filter* filters, int count);
+
+/*
+ * Deliver error frames (CAN_ERR_FLAG) of the error classes in mask, like
+ * CAN_RAW_ERR_FILTER. None are delivered by default.
+ */
+bool transport_set_error_mask(transport_t* transport, can_err_mask_t mask);
+
+/*
+ * Also send and receive CAN FD frames. Returns false if the bus does not
+ * support CAN FD; until then only classic frames are received.
+ */
+bool transport_enable_fd(transport_t* transport);
+
+void transport_close(transport_t* transport);
+
+#endif /* TRANSPORT_H_ */